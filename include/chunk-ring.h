@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_CHUNK_RING_H
+#define CS_TRACE_CHUNK_RING_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE_SIZE 64
+
+struct trace_chunk;
+
+struct chunk_desc {
+  struct trace_chunk *chunk;
+  size_t len;
+  unsigned long seq;
+};
+
+/* Single-producer single-consumer ring. head is only written by the
+ * consumer and tail only by the producer, each on its own cache line. */
+struct chunk_ring {
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+  _Alignas(CACHE_LINE_SIZE) struct chunk_desc *descs;
+  size_t mask;
+};
+
+int init_chunk_ring(struct chunk_ring *ring, size_t min_size);
+void fini_chunk_ring(struct chunk_ring *ring);
+
+/* Producer side. Returns false if the ring is full. */
+static inline bool push_chunk_desc(struct chunk_ring *ring,
+                                   const struct chunk_desc *desc)
+{
+  size_t tail;
+
+  tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >
+      ring->mask) {
+    return false;
+  }
+  ring->descs[tail & ring->mask] = *desc;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+  return true;
+}
+
+/* Consumer side. Returns false if the ring is empty. */
+static inline bool pop_chunk_desc(struct chunk_ring *ring,
+                                  struct chunk_desc *desc)
+{
+  size_t head;
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+    return false;
+  }
+  *desc = ring->descs[head & ring->mask];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+  return true;
+}
+
+#endif /* CS_TRACE_CHUNK_RING_H */
@@ -7,6 +7,13 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+/* CPUs a target can be traced on at once. */
+#define TRACE_CPUS_MAX 64
+/* Threads and processes a target can be filtered on by context ID. Only as
+ * many as the ETM has context ID comparators are traced. The rest are kept
+ * so that they are traced once earlier ones exit. */
+#define TRACE_CIDS_MAX 64
+
 typedef enum {
   edge_cov,
   path_cov,
@@ -14,10 +21,15 @@ typedef enum {
 
 int fetch_trace(void);
 int decode_trace(void);
+int setup_trace_board(void);
 int init_trace(pid_t parent_pid, pid_t pid);
 void fini_trace(void);
 int start_trace(pid_t pid, bool use_pid_trace);
 int stop_trace(bool disable_all);
+int update_trace_maps(pid_t pid);
+int follow_exec_map(pid_t pid, int *wstatus);
+int get_trace_ptrace_options(void);
+pid_t wait_trace_child(pid_t pid, int *wstatus);
 void trace_suspend_resume_callback(void);
 
 #endif /* CS_TRACE_COMMON_H */
@@ -5,6 +5,8 @@
 #ifndef CS_TRACE_CONFIG_H
 #define CS_TRACE_CONFIG_H
 
+#include <stdbool.h>
+
 #include <sys/types.h>
 
 #include "csregistration.h"
@@ -12,10 +14,22 @@
 #include "utils.h"
 
 void cs_etb_flush_and_wait_stop(struct cs_devices_t *devices);
+void set_trace_stop_on_flush(struct cs_devices_t *devices, bool stop);
+void clear_trace_sink_full(struct cs_devices_t *devices);
+int flush_trace_sinks(struct cs_devices_t *devices);
 int init_etm(cs_device_t dev);
 void show_etm_config(cs_device_t etm);
 int configure_trace(const struct board *board, struct cs_devices_t *devices,
-                    struct map_info *range, int range_count, pid_t pid);
+                    struct map_info *range, int range_count, const pid_t *cids,
+                    int cid_count);
+int update_cpu_trace_ranges(const struct board *board,
+                            struct cs_devices_t *devices, int cpu,
+                            struct map_info *range, int range_count,
+                            const pid_t *cids, int cid_count);
+int update_trace_ranges(const struct board *board,
+                        struct cs_devices_t *devices, struct map_info *range,
+                        int range_count, const pid_t *cids, int cid_count);
+int rearm_trace_start(const struct board *board, struct cs_devices_t *devices);
 int enable_trace(const struct board *board, struct cs_devices_t *devices);
 int disable_trace(const struct board *board, struct cs_devices_t *devices);
 int enable_trace_sinks_only(struct cs_devices_t *devices);
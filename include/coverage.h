@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_COVERAGE_H
+#define CS_TRACE_COVERAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Private bitmap the decoder writes to. Its updates are added to the real
+ * bitmap in address order, and only pages the decoder has touched are
+ * visited. */
+struct coverage_buf {
+  unsigned char *buf;
+  size_t size;
+  size_t map_size;
+  unsigned char *resident;
+  uint32_t *touched;
+  size_t nr_touched;
+};
+
+int init_coverage_buf(struct coverage_buf *cov, size_t size);
+void fini_coverage_buf(struct coverage_buf *cov);
+int harvest_coverage_buf(struct coverage_buf *cov);
+void apply_coverage_buf(struct coverage_buf *cov, unsigned char *bitmap);
+void clear_coverage_buf(struct coverage_buf *cov);
+size_t flush_coverage_buf(struct coverage_buf *cov, unsigned char *bitmap);
+size_t retract_coverage_buf(struct coverage_buf *cov, unsigned char *bitmap);
+
+/* Add eight 8-bit counters with wrap-around, as dst[i] += src[i] would. */
+static inline uint64_t add_coverage_counters(uint64_t a, uint64_t b)
+{
+  const uint64_t high = 0x8080808080808080ULL;
+
+  return ((a & ~high) + (b & ~high)) ^ ((a ^ b) & high);
+}
+
+/* Subtract eight 8-bit counters with wrap-around, as dst[i] -= src[i] would. */
+static inline uint64_t sub_coverage_counters(uint64_t a, uint64_t b)
+{
+  const uint64_t high = 0x8080808080808080ULL;
+
+  return ((a | high) - (b & ~high)) ^ ((a ^ ~b) & high);
+}
+
+#endif /* CS_TRACE_COVERAGE_H */
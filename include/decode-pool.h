@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_DECODE_POOL_H
+#define CS_TRACE_DECODE_POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "trace-pool.h"
+
+/* Chunks of one trace stream are decoded in fetch order by one worker at a
+ * time, so the decoder state of the stream stays consistent. */
+struct decode_stream {
+  void *ctx;
+  int (*decode)(void *ctx, struct trace_chunk *chunk);
+  struct trace_chunk *head;
+  struct trace_chunk *tail;
+  bool busy;
+  int error;
+};
+
+struct decode_pool_worker {
+  struct decode_pool *pool;
+  int index;
+  pthread_t thread;
+  uint64_t busy_ns;
+  unsigned long chunks;
+};
+
+struct decode_pool {
+  struct decode_pool_worker *workers;
+  int nr_workers;
+  struct decode_stream **streams;
+  int nr_streams;
+  int max_streams;
+  int next_stream;
+  size_t pending;
+  bool stopping;
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t idle_cond;
+};
+
+int init_decode_pool(struct decode_pool *pool, int nr_workers,
+                     int max_streams);
+void fini_decode_pool(struct decode_pool *pool);
+int add_decode_stream(struct decode_pool *pool, struct decode_stream *stream,
+                      void *ctx,
+                      int (*decode)(void *ctx, struct trace_chunk *chunk));
+void queue_decode_chunk(struct decode_pool *pool, struct decode_stream *stream,
+                        struct trace_chunk *chunk);
+int wait_decode_pool(struct decode_pool *pool);
+void dump_decode_pool_stats(FILE *stream, struct decode_pool *pool);
+
+#endif /* CS_TRACE_DECODE_POOL_H */
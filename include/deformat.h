@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_DEFORMAT_H
+#define CS_TRACE_DEFORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FORMATTER_FRAME_SIZE 16
+#define FORMATTER_FRAME_DATA_MAX 15
+#define FORMATTER_ID_NULL 0x00
+#define FORMATTER_ID_COUNT 0x80
+/* Full frame sync packet, read as a little-endian word. It can only appear
+ * where a frame starts, since 0xff would be an ID change to reserved 0x7f. */
+#define FORMATTER_FSYNC 0x7fffffffU
+#define FORMATTER_FSYNC_SIZE 4
+
+/* Data bytes in a frame packed by pack_frame(): one ID change, then data. */
+#define FORMATTER_PACK_DATA (FORMATTER_FRAME_SIZE - 2)
+/* Room for the frames reframe_trace() and flush_reframer() write for len
+ * bytes, with up to a frame of bytes kept from before. */
+#define REFRAMED_SIZE(len)                                                   \
+  ((((len) + FORMATTER_PACK_DATA - 1) / FORMATTER_PACK_DATA + 1) *           \
+   FORMATTER_FRAME_SIZE)
+
+/* ETMv4 A-sync: 11 bytes of 0x00 followed by 0x80. */
+#define ETM4_ASYNC_ZEROS 11
+#define ETM4_ASYNC_END 0x80
+
+/* The source ID is carried over frame and chunk boundaries. */
+struct deformatter {
+  int cur_id;
+};
+
+/* Contiguous bytes of one source ID. Bytes that do not fit in buf are
+ * counted in dropped. */
+struct deformat_stream {
+  unsigned char *buf;
+  size_t size;
+  size_t len;
+  size_t dropped;
+};
+
+/* Splits a formatted stream by source ID in one pass. IDs without a stream
+ * are dropped. A frame split by frame syncs is completed on the next call. */
+struct deformat_demux {
+  struct deformatter deformatter;
+  struct deformat_stream *streams[FORMATTER_ID_COUNT];
+  unsigned char partial[FORMATTER_FRAME_SIZE];
+  size_t partial_len;
+  size_t frames;
+  size_t skipped;
+  size_t fsyncs;
+};
+
+/* Packs the bytes of one ID back into frames of that ID alone. */
+struct reframer {
+  int trace_id;
+  unsigned char data[FORMATTER_PACK_DATA];
+  size_t len;
+};
+
+/* Where decoding of an ID can start without earlier data. */
+struct async_pos {
+  size_t offset;
+  int cur_id;
+  bool at_start;
+};
+
+/* A-sync scan of a stream fed in buffers. The zeros of trace_id at the end
+ * of a buffer are carried over, so that an A-sync split between buffers is
+ * found too. */
+struct async_scanner {
+  struct deformatter deformatter;
+  int trace_id;
+  size_t offset;      /* Stream offset of the next buffer */
+  size_t seen;        /* Bytes of trace_id scanned */
+  size_t zeros;       /* Zeros of trace_id at the end of the scanned bytes */
+  struct async_pos run;
+  size_t next_offset; /* Where the next A-sync may start */
+};
+
+void init_deformatter(struct deformatter *deformatter);
+size_t deformat_frame(struct deformatter *deformatter, int trace_id,
+                      const unsigned char *frame, unsigned char *out);
+void make_resync_frame(unsigned char *frame, int id);
+void init_async_scanner(struct async_scanner *scanner, int trace_id);
+size_t scan_async(struct deformatter *deformatter, int trace_id,
+                  const unsigned char *buf, size_t size, size_t min_gap,
+                  struct async_pos *pos, size_t max);
+size_t scan_async_stream(struct async_scanner *scanner,
+                         const unsigned char *buf, size_t size,
+                         struct async_pos *pos, size_t max);
+void init_deformat_demux(struct deformat_demux *demux);
+void reset_deformat_demux(struct deformat_demux *demux);
+void set_deformat_stream(struct deformat_demux *demux, int trace_id,
+                         struct deformat_stream *stream);
+void demux_frames(struct deformat_demux *demux, const unsigned char *buf,
+                  size_t size);
+void pack_frame(int trace_id, const unsigned char *data, size_t len,
+                unsigned char *frame);
+void init_reframer(struct reframer *reframer, int trace_id);
+size_t reframe_trace(struct reframer *reframer, const unsigned char *buf,
+                     size_t size, unsigned char *out);
+size_t flush_reframer(struct reframer *reframer, unsigned char *out);
+
+#endif /* CS_TRACE_DEFORMAT_H */
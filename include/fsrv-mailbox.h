@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_FSRV_MAILBOX_H
+#define CS_TRACE_FSRV_MAILBOX_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+
+#define FSRV_MAILBOX_ENV "__AFLCS_MAILBOX_FD"
+#define FSRV_MAILBOX_MAGIC 0x58424d43 /* "CMBX" */
+#define FSRV_MAILBOX_SLOTS 16
+#define FSRV_MAILBOX_LINE 64
+
+/*
+ * Shared-memory replacement of the control and status pipes between cs-proxy
+ * and the forkserver of the target. Each direction is a single-producer
+ * single-consumer queue of the same 32-bit words the pipes carry. tail is the
+ * futex word the consumer sleeps on, and the producer only makes the wake
+ * call when waiters says the consumer is asleep. Both processes map the
+ * queue, so the futexes are not process-private. The protocol has at most a
+ * few words in flight, so a full queue is an error.
+ */
+struct mailbox_queue {
+  _Alignas(FSRV_MAILBOX_LINE) _Atomic uint32_t tail;
+  _Atomic uint32_t waiters;
+  _Alignas(FSRV_MAILBOX_LINE) _Atomic uint32_t head;
+  uint32_t slots[FSRV_MAILBOX_SLOTS];
+};
+
+struct fsrv_mailbox {
+  uint32_t magic;
+  struct mailbox_queue ctl; /* cs-proxy to forkserver */
+  struct mailbox_queue st;  /* forkserver to cs-proxy */
+};
+
+struct fsrv_mailbox *create_fsrv_mailbox(int *fd);
+struct fsrv_mailbox *open_fsrv_mailbox(int fd);
+void close_fsrv_mailbox(struct fsrv_mailbox *box);
+int post_mailbox(struct mailbox_queue *queue, uint32_t val);
+int take_mailbox(struct mailbox_queue *queue, uint32_t *val, pid_t peer);
+
+#endif /* CS_TRACE_FSRV_MAILBOX_H */
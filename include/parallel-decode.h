@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_PARALLEL_DECODE_H
+#define CS_TRACE_PARALLEL_DECODE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "libcsdec.h"
+
+#include "coverage.h"
+#include "deformat.h"
+
+#define PARALLEL_DECODE_MIN_SEGMENT 0x10000
+/* Trace past its end that the decoder of a segment reads. It must hold the
+ * waypoint after the A-sync that starts the next segment. */
+#define PARALLEL_DECODE_OVERLAP 0x1000
+
+/* buf[0, size) is decoded, which runs prefix bytes into the next segment. */
+struct decode_segment {
+  const unsigned char *buf;
+  size_t size;
+  size_t prefix;
+  int cur_id;
+  bool resync;
+};
+
+struct parallel_decoder;
+
+/* Edge decoder with a private bitmap, and a probe decoder that decodes the
+ * overlap at the start of the segment from a reset state. */
+struct decode_worker {
+  struct parallel_decoder *pd;
+  libcsdec_t decoder;
+  struct coverage_buf cov;
+  libcsdec_t probe;
+  struct coverage_buf probe_cov;
+  struct decode_segment segment;
+  int ret;
+  bool queued;
+  bool started;
+  pthread_t thread;
+};
+
+/* min_segment and overlap may be lowered after init, e.g. for short test
+ * traces. overlap is capped at the distance between split points. */
+struct parallel_decoder {
+  struct decode_worker *workers;
+  int nr_workers;
+  int carry;
+  size_t bitmap_size;
+  size_t min_segment;
+  size_t overlap;
+  int trace_id;
+  int map_count;
+  struct libcsdec_memory_map *mem_map;
+  struct deformatter deformatter;
+  struct async_pos *splits;
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  int pending;
+  bool stopping;
+};
+
+int init_parallel_decoder(struct parallel_decoder *pd, int nr_workers,
+                          size_t bitmap_size, int map_count,
+                          struct libcsdec_memory_image *mem_img);
+int reset_parallel_decoder(struct parallel_decoder *pd, int trace_id,
+                           int map_count, struct libcsdec_memory_map *mem_map);
+int run_parallel_decoder(struct parallel_decoder *pd, const void *buf,
+                         size_t size, unsigned char *bitmap);
+void fini_parallel_decoder(struct parallel_decoder *pd, unsigned char *bitmap);
+
+#endif /* CS_TRACE_PARALLEL_DECODE_H */
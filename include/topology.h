@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_TOPOLOGY_H
+#define CS_TRACE_TOPOLOGY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "csaccess.h"
+#include "csregistration.h"
+
+/*
+ * Topology cache file layout. All fields are little-endian, and the file is
+ * one struct topology.
+ *
+ * A board is registered once with its ROM table walk while the CSAL calls of
+ * its registration function are recorded as a list of operations on the
+ * devices it uses. Later runs replay the list instead, which registers only
+ * those devices and skips probing the ROM tables.
+ */
+
+#define TOPOLOGY_CACHE_MAGIC "CSTOPO"
+#define TOPOLOGY_CACHE_VERSION 1
+#define TOPOLOGY_HARDWARE_MAX 64
+#define TOPOLOGY_DEVICES_MAX 512
+#define TOPOLOGY_OPS_MAX 1024
+/* Sinks besides the ETB that the boards in known-boards.h fill in. */
+#define TOPOLOGY_SINKS_MAX 2
+#define TOPOLOGY_CPUS_MAX 128
+
+typedef enum {
+  topo_op_register = 1,
+  topo_op_affinity,
+  topo_op_replicator,
+  topo_op_atb,
+  topo_op_trigsrc,
+  topo_op_trigdst,
+  topo_op_stm_master,
+  topo_op_stm_select,
+} topology_op_type_t;
+
+/* addr is 0 for replicators added by software. */
+struct topology_device {
+  uint64_t addr;
+  uint32_t classes;
+  uint32_t reserved;
+};
+
+/* dev and the device arguments are indices into the device table. */
+struct topology_op {
+  uint32_t type;
+  int32_t dev;
+  int32_t args[4];
+  uint64_t addr;
+};
+
+struct topology {
+  char magic[8];
+  uint32_t version;
+  int32_t n_cpu;
+  char hardware[TOPOLOGY_HARDWARE_MAX];
+  uint32_t nr_devices;
+  uint32_t nr_ops;
+  struct topology_device devices[TOPOLOGY_DEVICES_MAX];
+  struct topology_op ops[TOPOLOGY_OPS_MAX];
+  int32_t etb;
+  int32_t itm;
+  int32_t trace_sinks[TOPOLOGY_SINKS_MAX];
+  uint32_t cpu_id[TOPOLOGY_CPUS_MAX];
+  int32_t trace_ids[TOPOLOGY_CPUS_MAX];
+};
+
+/* The recorded or loaded topology and the handles of its devices. broken is
+ * set when a call cannot be recorded, and the topology is then not stored. */
+struct topology_state {
+  struct topology topo;
+  cs_device_t handles[TOPOLOGY_DEVICES_MAX];
+  bool broken;
+  bool ready;
+};
+
+/*
+ * Trace ID of each CPU in [first_cpu, last_cpu] of a board. With
+ * n = cpu - first_cpu, the ID is base + (n % cluster) * stride + n / cluster.
+ */
+struct trace_id_rule {
+  const char *hardware;
+  int first_cpu;
+  int last_cpu;
+  int base;
+  int cluster;
+  int stride;
+};
+
+/* Topology of the registered board, recorded or loaded from the cache. */
+extern struct topology_state board_topology;
+/* Trace IDs of the boards in known-boards.h. */
+extern const struct trace_id_rule trace_id_rules[];
+
+void init_topology(struct topology_state *state, const char *hardware,
+                   int n_cpu);
+void remove_topology(const char *path);
+int load_topology(struct topology_state *state, const char *path);
+int store_topology(const struct topology_state *state, const char *path);
+int capture_topology(struct topology_state *state,
+                     const struct cs_devices_t *devices,
+                     const struct trace_id_rule *rules);
+int replay_topology(struct topology_state *state,
+                    struct cs_devices_t *devices);
+int lookup_trace_id(const struct trace_id_rule *rules, const char *hardware,
+                    int cpu);
+
+/* Counterparts of the CSAL registration calls for the boards in
+ * known-boards.h. They are recorded while record_topology() has a state. */
+void record_topology(struct topology_state *state);
+int topo_register_romtable(cs_physaddr_t addr);
+int topo_exclude_range(cs_physaddr_t from, cs_physaddr_t to);
+cs_device_t topo_device_register(cs_physaddr_t addr);
+cs_device_t topo_device_get(cs_physaddr_t addr);
+int topo_set_affinity(cs_device_t dev, unsigned int cpu);
+cs_device_t topo_cpu_get_device(int cpu, unsigned int classes);
+int topo_atb_register(cs_device_t from, unsigned int from_port, cs_device_t to,
+                      unsigned int to_port);
+cs_device_t topo_atb_add_replicator(unsigned int n_ports);
+int topo_cti_connect_trigsrc(cs_device_t dev, int trig, cs_device_t cti,
+                             int n);
+int topo_cti_connect_trigdst(cs_device_t cti, int n, cs_device_t dev,
+                             int trig);
+int topo_stm_config_master(cs_device_t stm, unsigned int master,
+                           cs_physaddr_t addr);
+int topo_stm_select_master(cs_device_t stm, unsigned int master);
+
+#endif /* CS_TRACE_TOPOLOGY_H */
@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_TRACE_BROKER_H
+#define CS_TRACE_TRACE_BROKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+
+#include "deformat.h"
+#include "utils.h"
+
+#define TRACE_BROKER_DEFAULT_NAME "/cs-broker"
+#define TRACE_BROKER_MAGIC 0x4b524243 /* "CBRK" */
+#define TRACE_BROKER_CLIENTS_MAX 32
+#define TRACE_BROKER_DEFAULT_RING_SIZE 0x100000
+#define TRACE_BROKER_LINE 64
+/* The sink stream is demultiplexed in blocks of this size. */
+#define TRACE_BROKER_DEMUX_BLOCK 0x4000
+
+/* Payload bytes in a re-framed frame: one ID change, then data only. */
+#define BROKER_FRAME_DATA FORMATTER_PACK_DATA
+
+typedef enum {
+  broker_slot_free,
+  broker_slot_claimed,
+  broker_slot_ready,
+  broker_slot_active,
+  broker_slot_rejected,
+  broker_slot_closing,
+} broker_slot_state_t;
+
+struct broker_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+/*
+ * One registered client. The client fills in the request and sets state to
+ * ready, then the broker programs the ETM of cpu, fills in trace_id and sets
+ * state to active. The ring is a byte FIFO of whole formatter frames that
+ * carry the trace of this client only, re-framed under trace_id, so that the
+ * client decodes it like the output of its own sink. tail is only written by
+ * the broker and head only by the client. A flush is requested by bumping
+ * flush_req, and flush_ack reaches it once all trace up to the request is in
+ * the ring.
+ *
+ * When trace of the client is lost, the broker bumps gaps and sets gap to
+ * tail, and pushes nothing more until head reaches gap. The trace from gap
+ * on does not continue the trace before it, so the client restarts its
+ * decoder there.
+ */
+struct broker_slot {
+  _Atomic uint32_t state;
+  int32_t pid;
+  int32_t cpu;
+  int32_t cid;
+  int32_t trace_id;
+  int32_t range_count;
+  struct broker_range ranges[RANGE_MAX];
+
+  _Alignas(TRACE_BROKER_LINE) _Atomic uint32_t flush_req;
+  _Atomic uint32_t flush_ack;
+
+  _Alignas(TRACE_BROKER_LINE) _Atomic uint64_t tail;
+  _Atomic uint64_t gap;
+  _Atomic uint64_t gaps;
+  _Alignas(TRACE_BROKER_LINE) _Atomic uint64_t head;
+
+  /* Accounting, written by the broker. */
+  _Alignas(TRACE_BROKER_LINE) uint64_t bytes;
+  uint64_t frames;
+  uint64_t dropped;
+  uint64_t flushes;
+};
+
+/* The rings follow the header, ring_size bytes per slot. */
+struct trace_broker_shm {
+  uint32_t magic;
+  int32_t broker_pid;
+  uint64_t ring_size;
+  struct broker_slot slots[TRACE_BROKER_CLIENTS_MAX];
+};
+
+struct trace_broker {
+  struct trace_broker_shm *shm;
+  unsigned char *rings;
+  size_t map_size;
+  char name[NAME_MAX];
+};
+
+/* Broker side state of a slot: the bytes the demultiplexer extracted from
+ * the current block, and those of the frame being re-framed. */
+struct broker_stream {
+  struct deformat_stream out;
+  unsigned char block[TRACE_BROKER_DEMUX_BLOCK];
+  unsigned char data[BROKER_FRAME_DATA];
+  size_t len;
+};
+
+struct broker_client {
+  struct trace_broker broker;
+  struct broker_slot *slot;
+  unsigned char *ring;
+  size_t ring_size;
+  /* Gaps seen so far, and whether the client discarded trace itself. */
+  uint64_t gaps;
+  bool lost;
+};
+
+/* Broker side. */
+int create_trace_broker(struct trace_broker *broker, const char *name,
+                        size_t ring_size);
+void destroy_trace_broker(struct trace_broker *broker);
+void set_broker_slot_state(struct broker_slot *slot, broker_slot_state_t state);
+void ack_broker_flush(struct broker_slot *slot, uint32_t req);
+void init_broker_stream(struct broker_stream *stream);
+void demux_broker_trace(struct trace_broker *broker,
+                        struct deformat_demux *demux,
+                        struct broker_stream *streams, const unsigned char *buf,
+                        size_t size);
+void flush_broker_stream(struct trace_broker *broker,
+                         struct broker_stream *stream, int index);
+void drop_broker_stream(struct trace_broker *broker,
+                        struct broker_stream *stream, int index);
+void dump_broker_slot(FILE *stream, struct broker_slot *slot);
+
+/* Client side. */
+int open_broker_client(struct broker_client *client, const char *name);
+int register_broker_client(struct broker_client *client, int cpu, int trace_id,
+                           pid_t cid, const struct map_info *range,
+                           int range_count);
+void close_broker_client(struct broker_client *client);
+int sync_broker_client(struct broker_client *client);
+void discard_broker_client(struct broker_client *client);
+size_t get_broker_backlog(struct broker_client *client);
+uint64_t get_broker_write_pos(struct broker_client *client);
+size_t read_broker_client(struct broker_client *client, void *buf,
+                          size_t size, bool *gap);
+
+#endif /* CS_TRACE_TRACE_BROKER_H */
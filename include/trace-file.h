@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_TRACE_FILE_H
+#define CS_TRACE_TRACE_FILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+
+#include "deformat.h"
+#include "utils.h"
+
+/*
+ * Trace container layout. All fields are little-endian.
+ *
+ *   struct trace_file_header
+ *   { struct trace_file_chunk, chunk data }[footer.chunk_count]
+ *   struct trace_file_map[footer.map_count]
+ *   struct trace_file_chunk[footer.chunk_count]   (index)
+ *   struct trace_file_footer
+ *
+ * Chunk data is the formatted ETR output of one fetch_trace(), optionally
+ * compressed. Index entries are copies of the chunk headers in fetch order,
+ * except that an A-sync that ends in the next chunk is only in the index.
+ * The memory map is written on close, so that it holds the mappings that
+ * appeared while tracing as well.
+ */
+
+#define TRACE_FILE_MAGIC "CSTRACE"
+#define TRACE_FILE_FOOTER_MAGIC "CSTRIDX"
+#define TRACE_FILE_CHUNK_MAGIC 0x4b4e4843 /* "CHNK" */
+#define TRACE_FILE_VERSION 2
+#define TRACE_FILE_BOARD_MAX 64
+
+#define TRACE_FILE_NO_SYNC UINT64_MAX
+
+/* Chunk flags */
+#define TRACE_CHUNK_ASYNC_START (1U << 0)
+#define TRACE_CHUNK_ZSTD (1U << 1)
+
+struct trace_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  int32_t trace_id;
+  uint32_t reserved;
+  char board[TRACE_FILE_BOARD_MAX];
+};
+
+struct trace_file_map {
+  uint64_t start;
+  uint64_t end;
+  uint64_t offset;
+  char path[PATH_MAX];
+};
+
+struct trace_file_chunk {
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t seq;
+  uint64_t file_offset; /* Offset of the chunk data in the file */
+  uint64_t data_size;   /* Stored size of the chunk data */
+  uint64_t raw_offset;  /* Offset in the concatenated raw trace */
+  uint64_t raw_size;
+  uint64_t sync_offset; /* Frame with the first A-sync, or TRACE_FILE_NO_SYNC */
+  int32_t sync_id;      /* Source ID in effect at sync_offset */
+  uint32_t reserved;
+};
+
+struct trace_file_footer {
+  uint64_t map_offset;
+  uint64_t map_count;
+  uint64_t index_offset;
+  uint64_t chunk_count;
+  char magic[8];
+};
+
+struct trace_file_writer {
+  FILE *fp;
+  int trace_id;
+  uint64_t file_offset;
+  uint64_t raw_offset;
+  struct async_scanner scanner;
+  struct trace_file_chunk *index;
+  size_t index_count;
+  size_t index_size;
+};
+
+struct trace_file {
+  void *map;
+  size_t size;
+  const struct trace_file_header *header;
+  const struct trace_file_map *maps;
+  size_t map_count;
+  const struct trace_file_chunk *index;
+  size_t chunk_count;
+};
+
+int open_trace_file(struct trace_file_writer *writer, const char *path,
+                    int trace_id, const char *board_name);
+int write_trace_file_chunk(struct trace_file_writer *writer, unsigned long seq,
+                           const void *raw, size_t raw_size, const void *data,
+                           size_t data_size, uint32_t flags);
+int close_trace_file(struct trace_file_writer *writer,
+                     struct map_info *map_info, int count);
+
+int map_trace_file(struct trace_file *file, const char *path);
+void unmap_trace_file(struct trace_file *file);
+ssize_t find_trace_file_chunk(const struct trace_file *file,
+                              uint64_t raw_offset);
+const void *get_trace_file_chunk(const struct trace_file *file, size_t i,
+                                 size_t *size);
+ssize_t read_trace_file_chunk(const struct trace_file *file, size_t i,
+                              void *buf, size_t size);
+
+#endif /* CS_TRACE_TRACE_FILE_H */
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_TRACE_MEMO_H
+#define CS_TRACE_TRACE_MEMO_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "coverage.h"
+
+#define TRACE_MEMO_ENTRIES 4096
+
+/* Bitmap words that the decode of one trace added to, with the counters
+ * added. */
+struct trace_memo_entry {
+  uint64_t hash;
+  size_t len;
+  uint32_t generation;
+  size_t nr_words;
+  uint64_t *counts;
+  uint32_t *index;
+};
+
+/* Direct-mapped cache of decode results. The entries together hold at most
+ * max_bytes of edges. */
+struct trace_memo {
+  struct trace_memo_entry *entries;
+  size_t mask;
+  size_t clock;
+  size_t max_bytes;
+  size_t used_bytes;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long skipped;
+};
+
+uint64_t hash_trace(const void *buf, size_t size, uint64_t seed);
+
+int init_trace_memo(struct trace_memo *memo, size_t nr_entries,
+                    size_t max_bytes);
+void fini_trace_memo(struct trace_memo *memo);
+struct trace_memo_entry *find_trace_memo(struct trace_memo *memo,
+                                         uint64_t hash, size_t len,
+                                         uint32_t generation);
+int add_trace_memo(struct trace_memo *memo, uint64_t hash, size_t len,
+                   uint32_t generation, const struct coverage_buf *cov);
+void replay_trace_memo(const struct trace_memo_entry *entry,
+                       unsigned char *bitmap, size_t bitmap_size);
+void dump_trace_memo_stats(FILE *stream, struct trace_memo *memo);
+
+#endif /* CS_TRACE_TRACE_MEMO_H */
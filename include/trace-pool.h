@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_TRACE_POOL_H
+#define CS_TRACE_TRACE_POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "chunk-ring.h"
+
+struct trace_chunk {
+  void *buf;
+  size_t size;
+  size_t len;
+  unsigned long seq;
+  /* The trace does not continue that of the chunk before. */
+  bool reset;
+  int refs;
+  struct trace_chunk *next;
+};
+
+struct trace_pool {
+  size_t chunk_size;
+  size_t nr_chunks;
+  size_t max_chunks;
+  int node;
+  struct trace_chunk *free_list;
+  struct chunk_ring filled;
+  pthread_mutex_t mutex;
+  pthread_cond_t free_cond;
+};
+
+int init_trace_pool(struct trace_pool *pool, size_t chunk_size,
+                    size_t nr_prealloc, size_t max_size, int node);
+void fini_trace_pool(struct trace_pool *pool);
+struct trace_chunk *get_free_chunk(struct trace_pool *pool, bool wait);
+void hold_chunk(struct trace_pool *pool, struct trace_chunk *chunk);
+void put_free_chunk(struct trace_pool *pool, struct trace_chunk *chunk);
+void queue_filled_chunk(struct trace_pool *pool, struct trace_chunk *chunk);
+struct trace_chunk *dequeue_filled_chunk(struct trace_pool *pool);
+
+#endif /* CS_TRACE_TRACE_POOL_H */
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_TRACE_WRITER_H
+#define CS_TRACE_TRACE_WRITER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "trace-file.h"
+#include "trace-pool.h"
+
+struct trace_writer {
+  struct trace_file_writer *file;
+  bool failed;
+  struct trace_pool *pool;
+  struct trace_chunk **queue;
+  size_t queue_size;
+  size_t queue_head;
+  size_t queue_count;
+  bool stopping;
+  void *out_buf;
+  size_t out_buf_size;
+  size_t bytes_in;
+  size_t bytes_out;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+int start_trace_writer(struct trace_writer *writer,
+                       struct trace_file_writer *file, struct trace_pool *pool);
+void write_trace_chunk(struct trace_writer *writer, struct trace_chunk *chunk);
+int stop_trace_writer(struct trace_writer *writer);
+
+#endif /* CS_TRACE_TRACE_WRITER_H */
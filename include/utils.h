@@ -5,8 +5,10 @@
 #define CS_TRACE_UTILS_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include <sys/types.h>
 
@@ -16,8 +18,9 @@
 
 #define PAGE_SIZE 0x1000
 #define ALIGN_UP(val, align) (((val) + (align)-1) & ~((align)-1))
+#define ALIGN_DOWN(val, align) ((val) & ~((align)-1))
 
-#define RANGE_MAX (1)
+#define RANGE_MAX (16)
 
 struct map_info {
   unsigned long start;
@@ -27,6 +30,24 @@ struct map_info {
   char path[PATH_MAX];
 };
 
+struct udmabuf {
+  int num;
+  int fd;
+  void *buf;
+  size_t size;
+  unsigned long phys_addr;
+  int sync_offset_fd;
+  int sync_size_fd;
+  int sync_for_cpu_fd;
+  int sync_for_device_fd;
+};
+
+/* A range of a u-dma-buf region. */
+struct udmabuf_slice {
+  size_t offset;
+  size_t size;
+};
+
 struct mmap_params {
   void *addr;
   size_t length;
@@ -39,17 +60,46 @@ struct mmap_params {
 void dump_buf(void *buf, size_t buf_size, const char *buf_path);
 void dump_maps(FILE *stream, pid_t pid);
 void dump_map_info(FILE *stream, struct map_info *map_info, int count);
-int setup_map_info(pid_t pid, struct map_info *map_info, int info_count_max);
+int setup_map_info(pid_t pid, struct map_info *map_info, int info_count_max,
+                   const char *modules);
+int update_map_info(pid_t pid, struct map_info *map_info, int count,
+                    int info_count_max, const char *modules);
+bool has_traced_modules(struct map_info *map_info, int count,
+                        const char *modules);
 int export_decoder_args(int trace_id, const char *trace_path,
                         const char *args_path, struct map_info *map_info,
                         int count);
 int get_preferred_cpu(pid_t pid);
+int get_preferred_node_cpu(pid_t pid, int node);
 int find_free_cpu(void);
 int set_cpu_affinity(int cpu, pid_t pid);
+int set_cpu_list_affinity(const int *cpus, int count, pid_t pid);
+int parse_cpu_arg(const char *arg, int *cpus, int max);
 int set_pthread_cpu_affinity(int cpu, pthread_t thread);
+int set_pthread_node_affinity(int node, pthread_t thread);
+int get_cpu_node(int cpu);
+int get_phys_addr_node(unsigned long phys_addr);
+int get_node_cpus(int node, cpu_set_t *cpu_set, size_t setsize);
+int bind_memory_node(void *addr, size_t len, int node);
+int get_memory_node(void *addr);
+void futex_wait(uint32_t *uaddr, uint32_t val);
+void futex_wake(uint32_t *uaddr);
+int load_map_images(struct map_info *map_info, int count, int node,
+                    bool preload);
+int lookup_elf_symbol(const char *path, const char *name, off_t *offset);
 void read_pid_fd_path(pid_t pid, int fd, char *buf, size_t size);
 int get_mmap_params(pid_t pid, struct mmap_params *params);
 bool is_syscall_exit_group(pid_t pid);
+int install_exec_map_filter(void);
+bool is_exec_map_stop(int wstatus);
 int get_udmabuf_info(int udmabuf_num, unsigned long *phys_addr, size_t *size);
+int open_udmabuf(int udmabuf_num, struct udmabuf *udmabuf);
+void close_udmabuf(struct udmabuf *udmabuf);
+int sync_udmabuf_for_cpu(struct udmabuf *udmabuf, size_t offset, size_t size);
+int sync_udmabuf_for_device(struct udmabuf *udmabuf, size_t offset,
+                            size_t size);
+int get_udmabuf_slices(const struct udmabuf *udmabuf, size_t read_offset,
+                       size_t write_offset, bool wrapped,
+                       struct udmabuf_slice slices[2]);
 
 #endif /* CS_TRACE_UTILS_H */
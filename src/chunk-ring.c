@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#include "chunk-ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The ring size is rounded up to a power of two so that indices wrap with a
+ * mask. */
+int init_chunk_ring(struct chunk_ring *ring, size_t min_size)
+{
+  size_t size;
+
+  if (!ring || min_size == 0) {
+    return -1;
+  }
+
+  for (size = 1; size < min_size; size <<= 1) {
+  }
+
+  ring->descs = calloc(size, sizeof(struct chunk_desc));
+  if (!ring->descs) {
+    perror("calloc");
+    return -1;
+  }
+  ring->mask = size - 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+
+  return 0;
+}
+
+void fini_chunk_ring(struct chunk_ring *ring)
+{
+  if (!ring) {
+    return;
+  }
+
+  free(ring->descs);
+  ring->descs = NULL;
+  ring->mask = 0;
+}
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <stdatomic.h>
 
 #include <sys/ptrace.h>
 #include <sys/types.h>
@@ -21,6 +22,7 @@
 #include <sys/mman.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "csaccess.h"
 #include "csregistration.h"
@@ -32,16 +34,40 @@
 #include "common.h"
 #include "known-boards.h"
 #include "config.h"
+#include "coverage.h"
+#include "decode-pool.h"
+#include "deformat.h"
+#include "parallel-decode.h"
+#include "trace-broker.h"
+#include "trace-file.h"
+#include "trace-memo.h"
+#include "trace-pool.h"
+#include "trace-writer.h"
 #include "utils.h"
 
 #define DEFAULT_TRACE_CPU 0
 #define DEFAULT_DECODER_CPU -1
 #define DEFAULT_UDMABUF_NUM 0
 #define DEFAULT_ETF_SIZE 0x1000
-#define DEFAULT_TRACE_SIZE 0x80000
-#define DEFAULT_TRACE_NAME "cstrace.bin"
+#define DEFAULT_TRACE_POOL_PREALLOC 2
+#define DEFAULT_TRACE_POOL_MAX_SIZE 0x4000000
+#define DEFAULT_TRACE_NAME "cstrace.cst"
+#define DEFAULT_RAW_TRACE_NAME "cstrace.bin"
 #define DEFAULT_TRACE_ARGS_NAME "decoderargs.txt"
 
+#define CONTINUOUS_DRAIN_STEP_SHIFT 3
+#define ETM_SYNC_PERIOD_MIN 8
+#define ETM_SYNC_PERIOD_MAX 20
+#define DEFAULT_PARALLEL_SYNC_PERIOD 14
+#define DEFAULT_CONTINUOUS_SYNC_PERIOD 14
+
+#define TRACE_EVENT_RING_SIZE 64
+#define TRACE_TASKS_MAX 1024
+#define TRACE_EVENT_BIT(event) (1U << (event))
+
+/* Multi-core mode splits each chunk by trace ID in blocks of this size. */
+#define CPU_DEMUX_BLOCK 0x4000
+
 #define TRACE_DISABLE_TRIAL 8
 #define TRACE_DISABLE_TRIAL_USLEEP 10
 
@@ -65,7 +91,6 @@ typedef enum {
   start_event,
   stop_event,
   suspend_event,
-  resume_event,
 } trace_event_t;
 
 char *board_name = DEFAULT_BOARD_NAME;
@@ -73,7 +98,36 @@ const struct board *board;
 struct cs_devices_t devices;
 int udmabuf_num = DEFAULT_UDMABUF_NUM;
 bool decoding_on = false;
+bool zero_copy_on = false;
+bool continuous_on = false;
+size_t trace_pool_max_size = DEFAULT_TRACE_POOL_MAX_SIZE;
+bool numa_on = false;
+bool preload_images_on = false;
+bool stream_export_on = false;
+/* Write every fetched chunk to the trace file that fini_trace() closes. */
+bool trace_export_on = false;
+int decode_jobs = 1;
+int decode_workers = 0;
+bool batch_coverage_on = false;
+size_t trace_memo_size = 0;
+/* File the board topology is recorded to and replayed from, or NULL. */
+char *topology_cache_path = NULL;
+char *trace_modules = NULL;
+bool follow_maps_on = false;
+/* Trace the child processes of the target too, filtered by context ID. */
+bool follow_fork_on = false;
+bool persistent_on = false;
+/* Loop head and end of a persistent target, or 0 to trace whole iterations. */
+unsigned long persistent_start = 0;
+unsigned long persistent_end = 0;
+/* Address or symbol where trace starts in each process, or NULL. */
+char *trace_start_point = NULL;
+/* Shared memory name of the broker that owns the sinks, or NULL to own them. */
+char *broker_name = NULL;
 int trace_cpu = -1;
+/* CPUs the target runs on. More than one enables multi-core mode. */
+int trace_cpus[TRACE_CPUS_MAX];
+int nr_trace_cpus = 0;
 bool export_config = false;
 unsigned long etr_ram_addr = 0;
 size_t etr_ram_size = 0;
@@ -88,55 +142,301 @@ unsigned int trace_bitmap_size = 0;
 
 static int trace_id = -1;
 static pid_t child_pid = -1;
+/* Context ID the ETMs filter on, or 0. */
+static pid_t trace_cid = 0;
+/* Thread IDs of trace_cid, and with follow-fork of its children, that the
+ * ETMs match, since CONTEXTIDR holds the ID of the running thread. The ETMs
+ * match as many of them as they have comparators for. */
+static pid_t trace_cids[TRACE_CIDS_MAX];
+static int nr_trace_cids = 0;
+
+/* Tasks of the traced tree besides the child that wait_trace_child() knows,
+ * and whether their first stop is yet to come. */
+struct traced_task {
+  pid_t tid;
+  bool starting;
+};
+
+static struct traced_task traced_tasks[TRACE_TASKS_MAX];
+static int nr_traced_tasks = 0;
+
+/* Set by the decoder thread before it stops the child, and the task that
+ * took the stop, which the tracer resumes with the trace. */
+static _Atomic bool trace_stop_sent = false;
+static pid_t held_tid = 0;
 static bool is_first_trace = true;
 static libcsdec_t decoder = NULL;
-static void *trace_buf = NULL;
-static size_t trace_buf_size = 0;
-static void *trace_buf_ptr = NULL;
-static void *decoded_trace_buf = NULL;
+static struct parallel_decoder parallel_decoder;
+static struct coverage_buf coverage_buf;
+static struct trace_memo trace_memo;
+/* Bumped whenever the traced memory map changes, which invalidates memoized
+ * decodes. */
+static uint32_t map_generation = 0;
+static bool parallel_decode_on = false;
+static struct decode_pool decode_pool;
+static struct decode_stream trace_stream;
+static struct trace_pool trace_pool;
+static struct trace_writer trace_writer;
+static struct trace_file_writer trace_file;
+static struct broker_client broker_client;
+
+/* Multi-core mode: each CPU traces under its own ID, and its trace is split
+ * out of each chunk and re-framed for a decoder of its own. The decoders run
+ * on different workers, so the ones past the first write a private bitmap
+ * that is added to the real one at the end of each session. */
+struct cpu_decoder {
+  int cpu;
+  int trace_id;
+  libcsdec_t decoder;
+  struct coverage_buf coverage;
+  struct deformat_stream out;
+  struct reframer reframer;
+  struct decode_stream stream;
+  struct trace_chunk *chunk;
+  unsigned char block[CPU_DEMUX_BLOCK];
+};
+
+static bool multi_core_on = false;
+static struct cpu_decoder cpu_decoders[TRACE_CPUS_MAX];
+static struct deformat_demux cpu_demux;
+static unsigned char cpu_frames[REFRAMED_SIZE(CPU_DEMUX_BLOCK)];
+
+/* NUMA layout. decode_node holds trace chunks, images, bitmap and decoder. */
+static int trace_node = -1;
+static int udmabuf_node = -1;
+static int decode_node = -1;
+static int decoder_cpu = -1;
+static unsigned long fetch_seq = 0;
+static bool trace_export_incomplete = false;
+
+/* Zero-copy mode: the decoder reads the ETR buffer through this mapping. */
+static struct udmabuf etr_udmabuf;
+static size_t etr_read_offset = 0;
+/* Continuous mode: bytes the ETR has written and the decoder has consumed in
+ * this session. The RWP alone cannot tell a lap from a short backlog. */
+static uint64_t etr_write_count = 0;
+static uint64_t etr_read_count = 0;
+static size_t etr_last_write_offset = 0;
+static size_t etr_start_offset = 0;
+static struct udmabuf_slice etr_slices[2];
+static int etr_slice_count = 0;
 
 static pthread_t decoder_thread;
 
 static pthread_mutex_t trace_mutex;
-static pthread_mutex_t trace_state_mutex;
-static pthread_mutex_t trace_event_mutex;
-static pthread_cond_t trace_event_cond;
-static trace_state_t trace_state = init_state;
-static trace_event_t trace_event = init_event;
 
-static pthread_mutex_t trace_decoder_mutex;
-static pthread_cond_t trace_decoder_cond;
-static bool decoder_ready = true;
+/* Written by the tracer thread, and by the decoder thread to resume from a
+ * suspension. Also the futex word resume_held_task() sleeps on. */
+static _Atomic uint32_t trace_state = init_state;
+
+/* Events are published to a ring in order. trace_event_seq counts them and
+ * is the futex word the decoder thread sleeps on. The tracer thread is the
+ * only producer and the decoder thread the only consumer. trace_event_cursor
+ * counts the events consumed and is the futex word the producer sleeps on
+ * while the ring is full, so no event is ever overwritten. */
+struct trace_event_slot {
+  trace_event_t event;
+  /* Session the event starts or stops. */
+  uint32_t session;
+};
+
+static struct trace_event_slot trace_events[TRACE_EVENT_RING_SIZE];
+static _Atomic uint32_t trace_event_seq = 0;
+static _Atomic uint32_t trace_event_cursor = 0;
+
+/* Session of the last start or stop event consumed. */
+static uint32_t trace_event_session = 0;
+
+/* Trace sessions started, and those the decoder thread has finished. */
+static _Atomic uint32_t trace_session_seq = 0;
+static _Atomic uint32_t decoded_session_seq = 0;
 
 extern int registration_verbose;
+extern int etm_sync_period;
+extern unsigned long etm_start_addr;
+extern unsigned long etm_stop_addr;
 
 static int enable_cs_trace(pid_t pid);
 static int disable_cs_trace(bool disable_all);
+static size_t get_etr_backlog(void);
+static ssize_t drain_udmabuf_trace(size_t max_size);
+static int decode_trace_memo(void);
 
+/* Only called on the tracer thread. Waits while the ring is full. Without
+ * decoding there is no decoder thread to consume events. */
 static void signal_trace_event(trace_event_t event)
 {
-  pthread_mutex_lock(&trace_event_mutex);
-  trace_event = event;
-  pthread_cond_broadcast(&trace_event_cond);
-  pthread_mutex_unlock(&trace_event_mutex);
+  struct trace_event_slot *slot;
+  uint32_t seq;
+  uint32_t cursor;
+
+  if (!decoding_on) {
+    return;
+  }
+  seq = atomic_load_explicit(&trace_event_seq, memory_order_relaxed);
+  while (seq - (cursor = atomic_load_explicit(&trace_event_cursor,
+                                              memory_order_acquire)) >=
+         TRACE_EVENT_RING_SIZE) {
+    futex_wait((uint32_t *)&trace_event_cursor, cursor);
+  }
+  slot = &trace_events[seq % TRACE_EVENT_RING_SIZE];
+  slot->event = event;
+  slot->session =
+      atomic_load_explicit(&trace_session_seq, memory_order_relaxed);
+  atomic_store_explicit(&trace_event_seq, seq + 1, memory_order_release);
+  futex_wake((uint32_t *)&trace_event_seq);
+}
+
+/* Consume the next event. Only called on the decoder thread. */
+static void next_trace_event(struct trace_event_slot *event)
+{
+  uint32_t cursor;
+  uint32_t seq;
+
+  cursor = atomic_load_explicit(&trace_event_cursor, memory_order_relaxed);
+  while ((seq = atomic_load_explicit(&trace_event_seq,
+                                     memory_order_acquire)) == cursor) {
+    futex_wait((uint32_t *)&trace_event_seq, cursor);
+  }
+  *event = trace_events[cursor % TRACE_EVENT_RING_SIZE];
+  atomic_store_explicit(&trace_event_cursor, cursor + 1,
+                        memory_order_release);
+  /* The producer only waits on a full ring. */
+  if (seq - cursor == TRACE_EVENT_RING_SIZE) {
+    futex_wake((uint32_t *)&trace_event_cursor);
+  }
+
+  if (event->event == start_event) {
+    trace_event_session = event->session;
+  }
+}
+
+/* Consume events up to the first one in mask and return it. Only called on
+ * the decoder thread. */
+static trace_event_t wait_trace_event(unsigned int mask)
+{
+  struct trace_event_slot event;
+
+  do {
+    next_trace_event(&event);
+  } while (!(mask & TRACE_EVENT_BIT(event.event)));
+
+  return event.event;
+}
+
+/* Tell whether an event in mask is pending, without consuming any. Only
+ * called on the decoder thread. */
+static bool peek_trace_event(unsigned int mask)
+{
+  uint32_t seq;
+  uint32_t cursor;
+
+  seq = atomic_load_explicit(&trace_event_seq, memory_order_acquire);
+  cursor = atomic_load_explicit(&trace_event_cursor, memory_order_relaxed);
+  for (; cursor != seq; cursor++) {
+    if (mask &
+        TRACE_EVENT_BIT(trace_events[cursor % TRACE_EVENT_RING_SIZE].event)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* A persistent child outlives its sessions, so the end of a session cannot
+ * be told from the child exiting. */
+static bool is_session_stopping(void)
+{
+  return peek_trace_event(TRACE_EVENT_BIT(stop_event) |
+                          TRACE_EVENT_BIT(fini_event));
+}
+
+static void wait_trace_stop(void)
+{
+  wait_trace_event(TRACE_EVENT_BIT(stop_event) | TRACE_EVENT_BIT(fini_event));
+}
+
+/* Addresses in a traced range are absolute. Others are offsets from the load
+ * base of the first traced range, which is the main executable unless
+ * modules are selected. */
+static unsigned long resolve_trace_addr(unsigned long addr)
+{
+  int i;
+
+  for (i = 0; i < range_count; i++) {
+    if (addr >= map_info[i].start && addr < map_info[i].end) {
+      return addr;
+    }
+  }
+  if (range_count == 0) {
+    return addr;
+  }
+
+  return map_info[0].start - (unsigned long)map_info[0].offset + addr;
+}
+
+/* Resolve an address, or a symbol of a traced module. */
+static int resolve_trace_point(const char *point, unsigned long *addr)
+{
+  off_t offset;
+  char *end;
+  int i;
+
+  *addr = strtoul(point, &end, 0);
+  if (*point != '\0' && *end == '\0') {
+    *addr = resolve_trace_addr(*addr);
+    return 0;
+  }
+
+  for (i = 0; i < range_count; i++) {
+    if ((i > 0 && !strcmp(map_info[i].path, map_info[i - 1].path)) ||
+        lookup_elf_symbol(map_info[i].path, point, &offset) < 0) {
+      continue;
+    }
+    if (offset >= map_info[i].offset &&
+        offset < map_info[i].offset +
+                     (off_t)(map_info[i].end - map_info[i].start)) {
+      *addr = map_info[i].start + (unsigned long)(offset - map_info[i].offset);
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static void finish_trace_session(void)
+{
+  int i;
+
+  if (coverage_buf.buf) {
+    flush_coverage_buf(&coverage_buf, trace_bitmap);
+  }
+  for (i = 1; multi_core_on && i < nr_trace_cpus; i++) {
+    flush_coverage_buf(&cpu_decoders[i].coverage, trace_bitmap);
+  }
+  atomic_store_explicit(&decoded_session_seq, trace_event_session,
+                        memory_order_release);
+  futex_wake((uint32_t *)&decoded_session_seq);
 }
 
-static void wait_trace_event(trace_event_t event)
+/* Wait until the decoder thread has finished every started session. */
+static void wait_trace_sessions(void)
 {
-  pthread_mutex_lock(&trace_event_mutex);
-  while (trace_event != event) {
-    pthread_cond_wait(&trace_event_cond, &trace_event_mutex);
+  uint32_t seq;
+
+  while ((seq = atomic_load_explicit(&decoded_session_seq,
+                                     memory_order_acquire)) !=
+         atomic_load_explicit(&trace_session_seq, memory_order_acquire)) {
+    futex_wait((uint32_t *)&decoded_session_seq, seq);
   }
-  pthread_mutex_unlock(&trace_event_mutex);
 }
 
 static void set_trace_state(trace_state_t new_state)
 {
   trace_state_t old_state;
 
-  pthread_mutex_lock(&trace_state_mutex);
-  old_state = trace_state;
-  trace_state = new_state;
+  old_state = atomic_exchange_explicit(&trace_state, new_state,
+                                       memory_order_acq_rel);
   if (old_state == init_state) {
     signal_trace_event(init_event);
   } else if (new_state == fini_state) {
@@ -144,16 +444,44 @@ static void set_trace_state(trace_state_t new_state)
   } else if (new_state == ready_state) {
     signal_trace_event(stop_event);
   } else if (old_state == ready_state && new_state == running_state) {
+    atomic_fetch_add_explicit(&trace_session_seq, 1, memory_order_release);
     signal_trace_event(start_event);
   } else if (old_state == running_state && new_state == suspended_state) {
     signal_trace_event(suspend_event);
   } else if (old_state == suspended_state && new_state == running_state) {
-    signal_trace_event(resume_event);
+    /* The decoder thread has nothing to do on a resume. */
   } else {
     fprintf(stderr, "Unexpected trace state transition: %d -> %d\n", old_state,
             new_state);
   }
-  pthread_mutex_unlock(&trace_state_mutex);
+  if (old_state == suspended_state) {
+    futex_wake((uint32_t *)&trace_state);
+  }
+}
+
+/* Back to running after a suspension, unless the session has been stopped in
+ * the meantime. Only called on the decoder thread, which needs no event for
+ * its own transition. */
+static void resume_trace_state(void)
+{
+  uint32_t state;
+
+  state = suspended_state;
+  if (atomic_compare_exchange_strong_explicit(&trace_state, &state,
+                                              running_state,
+                                              memory_order_acq_rel,
+                                              memory_order_relaxed)) {
+    futex_wake((uint32_t *)&trace_state);
+  }
+}
+
+static bool is_tracing(void)
+{
+  uint32_t state;
+
+  state = atomic_load_explicit(&trace_state, memory_order_acquire);
+
+  return state == running_state || state == suspended_state;
 }
 
 static int trace_sink_polling(unsigned long decoding_threshold)
@@ -161,21 +489,36 @@ static int trace_sink_polling(unsigned long decoding_threshold)
   int ret;
   unsigned long init_pos;
   unsigned long curr_offset;
-
-  pthread_mutex_lock(&trace_decoder_mutex);
-  decoder_ready = false;
-  pthread_cond_broadcast(&trace_decoder_cond);
-  pthread_mutex_unlock(&trace_decoder_mutex);
+  trace_event_t event;
+  bool decoded;
 
   ret = 0;
-  init_pos = cs_get_buffer_rwp(devices.etb);
+  decoded = false;
+  init_pos = broker_name ? 0 : cs_get_buffer_rwp(devices.etb);
 
   while (!kill(child_pid, 0)) {
+    if (persistent_on && is_session_stopping()) {
+      break;
+    }
+    if (broker_name) {
+      /* The broker ring is read while the child runs. */
+      if (get_broker_backlog(&broker_client) > decoding_threshold) {
+        fetch_trace();
+        if ((ret = decode_trace()) < 0) {
+          fprintf(stderr, "decode_trace() failed\n");
+          goto exit;
+        }
+        decoded = true;
+      }
+      continue;
+    }
     curr_offset = cs_get_buffer_rwp(devices.etb) - init_pos;
     if (curr_offset > decoding_threshold) {
       /* Suspend child_pid process. */
+      atomic_store_explicit(&trace_stop_sent, true, memory_order_release);
       ret = kill(child_pid, SIGSTOP);
       if (ret < 0) {
+        atomic_store_explicit(&trace_stop_sent, false, memory_order_relaxed);
         if (errno == ESRCH) {
           /* child_pid killed. */
           goto killed;
@@ -184,8 +527,13 @@ static int trace_sink_polling(unsigned long decoding_threshold)
         goto exit;
       }
 
-      /* Wait for suspending trace. */
-      wait_trace_event(suspend_event);
+      /* Wait for suspending trace. The child may exit instead. */
+      event = wait_trace_event(TRACE_EVENT_BIT(suspend_event) |
+                               TRACE_EVENT_BIT(stop_event) |
+                               TRACE_EVENT_BIT(fini_event));
+      if (event != suspend_event) {
+        goto stopped;
+      }
 
       if ((ret = disable_cs_trace(false)) < 0) {
         fprintf(stderr, "disable_cs_trace() failed\n");
@@ -193,6 +541,18 @@ static int trace_sink_polling(unsigned long decoding_threshold)
       }
       fetch_trace();
 
+      /* Zero-copy slices point into the ETR buffer, which is overwritten once
+       * the sinks are enabled again. Consume them while the child is stopped.
+       */
+      if (zero_copy_on) {
+        if ((ret = decode_trace()) < 0) {
+          fprintf(stderr, "decode_trace() failed\n");
+          goto exit;
+        }
+        /* The ETR is not emptied, so measure from where it stopped. */
+        init_pos = cs_get_buffer_rwp(devices.etb);
+      }
+
       enable_cs_trace(child_pid);
       /* Continue child_pid process. */
       ret = kill(child_pid, SIGCONT);
@@ -204,33 +564,124 @@ static int trace_sink_polling(unsigned long decoding_threshold)
         perror("kill");
         goto exit;
       }
+      resume_trace_state();
 
       /* Decode trace during the process is running. */
-      if ((ret = decode_trace()) < 0) {
+      if (!zero_copy_on && (ret = decode_trace()) < 0) {
         fprintf(stderr, "decode_trace() failed\n");
         goto exit;
       }
+      decoded = true;
     }
   }
 
 killed:
-  pthread_mutex_lock(&trace_event_mutex);
-  while (trace_event != stop_event && trace_event != fini_event) {
-    pthread_cond_wait(&trace_event_cond, &trace_event_mutex);
-  }
-  pthread_mutex_unlock(&trace_event_mutex);
+  wait_trace_stop();
 
+stopped:
   fetch_trace();
-  if ((ret = decode_trace()) < 0) {
+  /* Only a trace that is decoded as a whole can be memoized. */
+  if (trace_memo.entries && !decoded) {
+    ret = decode_trace_memo();
+  } else {
+    ret = decode_trace();
+  }
+  if (ret < 0) {
     fprintf(stderr, "decode_trace() failed\n");
-    goto exit;
   }
 
 exit:
-  pthread_mutex_lock(&trace_decoder_mutex);
-  decoder_ready = true;
-  pthread_cond_broadcast(&trace_decoder_cond);
-  pthread_mutex_unlock(&trace_decoder_mutex);
+  /* Report the trace as decoded only after the workers are done with it,
+   * also on failure since they still hold its chunks. */
+  if (decode_workers > 0 && wait_decode_pool(&decode_pool) < 0) {
+    fprintf(stderr, "Decode worker failed\n");
+    ret = -1;
+  }
+  /* Let the tracer resume the child if a suspension failed. */
+  resume_trace_state();
+  finish_trace_session();
+
+  return ret;
+}
+
+/* Continuous mode: the ETR keeps running and the decoder chases the RWP. The
+ * child is only stopped when the backlog gets close to a whole buffer. */
+static int trace_sink_chasing(size_t drain_step, size_t throttle_threshold)
+{
+  int ret;
+  ssize_t n;
+  trace_event_t event;
+
+  ret = 0;
+
+  while (!kill(child_pid, 0)) {
+    if (persistent_on && is_session_stopping()) {
+      break;
+    }
+    if ((n = drain_udmabuf_trace(drain_step)) < 0) {
+      fprintf(stderr, "drain_udmabuf_trace() failed\n");
+      ret = -1;
+      goto exit;
+    }
+
+    if (get_etr_backlog() <= throttle_threshold) {
+      continue;
+    }
+
+    /* The decoder is about to be lapped. Throttle child_pid until the
+     * backlog is consumed. */
+    atomic_store_explicit(&trace_stop_sent, true, memory_order_release);
+    ret = kill(child_pid, SIGSTOP);
+    if (ret < 0) {
+      atomic_store_explicit(&trace_stop_sent, false, memory_order_relaxed);
+      if (errno == ESRCH) {
+        goto killed;
+      }
+      perror("kill");
+      goto exit;
+    }
+
+    event = wait_trace_event(TRACE_EVENT_BIT(suspend_event) |
+                             TRACE_EVENT_BIT(stop_event) |
+                             TRACE_EVENT_BIT(fini_event));
+    if (event != suspend_event) {
+      goto stopped;
+    }
+
+    while ((n = drain_udmabuf_trace(drain_step)) > 0) {
+    }
+    if (n < 0) {
+      fprintf(stderr, "drain_udmabuf_trace() failed\n");
+      ret = -1;
+      goto exit;
+    }
+
+    ret = kill(child_pid, SIGCONT);
+    if (ret < 0) {
+      if (errno == ESRCH) {
+        goto killed;
+      }
+      perror("kill");
+      goto exit;
+    }
+    resume_trace_state();
+  }
+
+killed:
+  wait_trace_stop();
+
+stopped:
+  /* The sinks are flushed and stopped. Consume the rest. */
+  while ((n = drain_udmabuf_trace(etr_udmabuf.size)) > 0) {
+  }
+  if (n < 0) {
+    fprintf(stderr, "drain_udmabuf_trace() failed\n");
+    ret = -1;
+  }
+
+exit:
+  resume_trace_state();
+  finish_trace_session();
 
   return ret;
 }
@@ -240,6 +691,9 @@ static void *decoder_worker(void *arg)
   trace_event_t event;
   size_t etf_ram_size;
   unsigned long decoding_threshold;
+  size_t drain_step;
+  size_t throttle_threshold;
+  struct rusage usage;
 
   if (etr_ram_size == 0) {
     etr_ram_size = cs_get_buffer_size_bytes(devices.etb);
@@ -251,49 +705,54 @@ static void *decoder_worker(void *arg)
     } else {
       decoding_threshold = etr_ram_size;
     }
+  } else if (broker_name) {
+    /* Leave room in the ring for the trace that arrives while fetching. */
+    decoding_threshold = etr_ram_size / 2;
   } else {
     decoding_threshold = etr_ram_size;
   }
 
+  /* Keep each live drain short so that the RWP is checked often, and leave
+   * two drain steps of headroom before the ETR laps the read pointer. */
+  drain_step = etr_ram_size >> CONTINUOUS_DRAIN_STEP_SHIFT;
+  throttle_threshold = etr_ram_size - drain_step * 2;
+
+  /* A persistent child stops itself at the end of each iteration, which
+   * would be confused with a suspension. One iteration must fit in the
+   * sinks. */
+  if (persistent_on) {
+    decoding_threshold = ULONG_MAX;
+    throttle_threshold = SIZE_MAX;
+  }
+
   while (1) {
-    pthread_mutex_lock(&trace_event_mutex);
-    while (trace_event != start_event && trace_event != fini_event) {
-      pthread_cond_wait(&trace_event_cond, &trace_event_mutex);
-    }
-    event = trace_event; /* TODO: trace_event can be changed in if cond. */
-    pthread_mutex_unlock(&trace_event_mutex);
+    event = wait_trace_event(TRACE_EVENT_BIT(start_event) |
+                             TRACE_EVENT_BIT(fini_event));
     if (event == start_event) {
-      trace_sink_polling(decoding_threshold);
+      if (continuous_on) {
+        trace_sink_chasing(drain_step, throttle_threshold);
+      } else {
+        trace_sink_polling(decoding_threshold);
+      }
     } else if (event == fini_event) {
       break;
     }
   }
 
+  if (registration_verbose > 0) {
+    getrusage(RUSAGE_THREAD, &usage);
+    fprintf(stderr, "Decoder thread faulted %ld pages (%ld major)\n",
+            usage.ru_minflt + usage.ru_majflt, usage.ru_majflt);
+  }
+
   return NULL;
 }
 
 /* TODO: Take cov_type as a argument. */
-static int reset_decoder(struct map_info *map_info, int map_info_num)
+static int reset_one_decoder(libcsdec_t decoder, int trace_id,
+                             int map_info_num)
 {
   libcsdec_result_t ret;
-  int i;
-
-  if (!decoder) {
-    return -1;
-  }
-
-  if (!mem_map) {
-    mem_map = malloc(sizeof(struct libcsdec_memory_map) * map_info_num);
-    if (!mem_map) {
-      perror("malloc");
-      return -1;
-    }
-    for (i = 0; i < map_info_num; i++) {
-      mem_map[i].start = map_info[i].start;
-      mem_map[i].end = map_info[i].end;
-      strncpy(mem_map[i].path, map_info[i].path, sizeof(map_info[i].path) - 1);
-    }
-  }
 
   ret = LIBCSDEC_ERROR;
 
@@ -312,14 +771,10 @@ static int reset_decoder(struct map_info *map_info, int map_info_num)
 }
 
 /* TODO: Take cov_type as a argument. */
-static int run_decoder(void *buf, size_t buf_size)
+static int run_one_decoder(libcsdec_t decoder, void *buf, size_t buf_size)
 {
   libcsdec_result_t ret;
 
-  if (!decoder) {
-    return -1;
-  }
-
   ret = LIBCSDEC_ERROR;
 
   switch (cov_type) {
@@ -336,108 +791,308 @@ static int run_decoder(void *buf, size_t buf_size)
   return (ret == LIBCSDEC_SUCCESS) ? 0 : -1;
 }
 
-static libcsdec_t init_decoder(struct map_info *map_info, int map_info_num)
+/* TODO: Take cov_type as a argument. */
+static void finish_one_decoder(libcsdec_t decoder)
 {
-  libcsdec_t decoder;
+  switch (cov_type) {
+    case edge_cov:
+      libcsdec_finish_edge(decoder);
+      break;
+    case path_cov:
+      libcsdec_finish_path(decoder);
+      break;
+  }
+}
+
+/* Each session starts with empty sinks, so nothing is carried over. */
+static int reset_cpu_decoders(int map_info_num)
+{
+  struct cpu_decoder *cpu;
+  int ret;
   int i;
 
-  if (!trace_bitmap) {
-    trace_bitmap = malloc(trace_bitmap_size);
-    if (!trace_bitmap) {
-      perror("malloc");
-      decoder = (libcsdec_t)NULL;
-      goto exit;
+  ret = 0;
+
+  init_deformat_demux(&cpu_demux);
+  for (i = 0; i < nr_trace_cpus; i++) {
+    cpu = &cpu_decoders[i];
+    cpu->out.len = 0;
+    init_reframer(&cpu->reframer, cpu->trace_id);
+    set_deformat_stream(&cpu_demux, cpu->trace_id, &cpu->out);
+    if (reset_one_decoder(cpu->decoder, cpu->trace_id, map_info_num) < 0) {
+      ret = -1;
     }
   }
 
-  if (!mem_img) {
-    mem_img = malloc(sizeof(struct libcsdec_memory_image) * map_info_num);
-    if (!mem_img) {
-      perror("malloc");
-      decoder = (libcsdec_t)NULL;
-      goto exit;
+  return ret;
+}
+
+/* Split buf by trace ID in one pass per block, and decode the trace of each
+ * CPU re-framed under its ID alone. The frames short of a whole one are
+ * decoded at the end, so that buf is decoded entirely. */
+static int run_cpu_decoders(const unsigned char *buf, size_t buf_size)
+{
+  struct cpu_decoder *cpu;
+  size_t offset;
+  size_t n;
+  size_t len;
+  int ret;
+  int i;
+
+  ret = 0;
+
+  for (offset = 0; offset < buf_size; offset += n) {
+    n = buf_size - offset;
+    if (n > CPU_DEMUX_BLOCK) {
+      n = CPU_DEMUX_BLOCK;
     }
-    for (i = 0; i < map_info_num; i++) {
-      mem_img[i].data = map_info[i].buf;
-      mem_img[i].size =
-          (size_t)ALIGN_UP(map_info[i].end - map_info[i].start, PAGE_SIZE);
+    demux_frames(&cpu_demux, &buf[offset], n);
+    for (i = 0; i < nr_trace_cpus; i++) {
+      cpu = &cpu_decoders[i];
+      if (cpu->out.len == 0) {
+        continue;
+      }
+      len = reframe_trace(&cpu->reframer, cpu->out.buf, cpu->out.len,
+                          cpu_frames);
+      cpu->out.len = 0;
+      if (len > 0 && run_one_decoder(cpu->decoder, cpu_frames, len) < 0) {
+        ret = -1;
+      }
     }
   }
 
-  switch (cov_type) {
-    case edge_cov:
-      decoder = libcsdec_init_edge(trace_bitmap, trace_bitmap_size,
-                                   map_info_num, mem_img);
-      break;
-    case path_cov:
-      decoder = libcsdec_init_path(trace_bitmap, trace_bitmap_size,
-                                   map_info_num, mem_img);
-      break;
-    default:
-      decoder = (libcsdec_t)NULL;
-      break;
+  for (i = 0; i < nr_trace_cpus; i++) {
+    cpu = &cpu_decoders[i];
+    len = flush_reframer(&cpu->reframer, cpu_frames);
+    if (len > 0 && run_one_decoder(cpu->decoder, cpu_frames, len) < 0) {
+      ret = -1;
+    }
   }
 
-exit:
-  return decoder;
+  return ret;
 }
 
 /* TODO: Take cov_type as a argument. */
-static int fini_decoder(void)
+static int reset_decoder(struct map_info *map_info, int map_info_num)
 {
+  int i;
+
   if (!decoder) {
     return -1;
   }
 
-  switch (cov_type) {
-    case edge_cov:
-      libcsdec_finish_edge(decoder);
-      break;
-    case path_cov:
-      libcsdec_finish_path(decoder);
-      break;
+  if (!mem_map) {
+    mem_map = malloc(sizeof(struct libcsdec_memory_map) * map_info_num);
+    if (!mem_map) {
+      perror("malloc");
+      return -1;
+    }
+    for (i = 0; i < map_info_num; i++) {
+      mem_map[i].start = map_info[i].start;
+      mem_map[i].end = map_info[i].end;
+      strncpy(mem_map[i].path, map_info[i].path, sizeof(map_info[i].path) - 1);
+    }
   }
 
-  return 0;
-}
+  if (parallel_decode_on) {
+    return reset_parallel_decoder(&parallel_decoder, trace_id, map_info_num,
+                                  mem_map);
+  }
 
-/* FIXME: Do not initialize global variables in the function */
-static int alloc_trace_buf(void)
-{
-  trace_buf = mmap(NULL, DEFAULT_TRACE_SIZE, PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (!trace_buf) {
-    perror("mmap");
-    return -1;
+  if (multi_core_on) {
+    return reset_cpu_decoders(map_info_num);
   }
-  trace_buf_size = DEFAULT_TRACE_SIZE;
-  trace_buf_ptr = trace_buf;
-  decoded_trace_buf = trace_buf_ptr;
 
-  return 0;
+  return reset_one_decoder(decoder, trace_id, map_info_num);
 }
 
-/* FIXME: Make it better */
-static void free_trace_buf(void)
+/* TODO: Take cov_type as a argument. */
+static int run_decoder(void *buf, size_t buf_size)
 {
-  if (devices.etb) {
-    cs_empty_trace_buffer(devices.etb);
+  if (!decoder) {
+    return -1;
   }
 
-  if (trace_buf) {
-    munmap(trace_buf, trace_buf_size);
-    trace_buf_ptr = NULL;
-    decoded_trace_buf = NULL;
+  if (parallel_decode_on) {
+    return run_parallel_decoder(&parallel_decoder, buf, buf_size,
+                                coverage_buf.buf ? coverage_buf.buf
+                                                 : trace_bitmap);
   }
+
+  if (multi_core_on) {
+    return run_cpu_decoders(buf, buf_size);
+  }
+
+  return run_one_decoder(decoder, buf, buf_size);
 }
 
-static int export_trace(const char *trace_name, const char *trace_args_name)
+/* A chunk that does not continue the trace before it restarts the decoder,
+ * which then waits for an A-sync. */
+static int run_chunk_decoder(struct trace_chunk *chunk)
 {
-  int ret;
+  if (chunk->reset && reset_decoder(map_info, range_count) < 0) {
+    return -1;
+  }
+
+  return run_decoder(chunk->buf, chunk->len);
+}
+
+/* TODO: Take cov_type as a argument. */
+static libcsdec_t init_bitmap_decoder(unsigned char *bitmap, int map_info_num)
+{
+  libcsdec_t decoder;
+
+  switch (cov_type) {
+    case edge_cov:
+      decoder = libcsdec_init_edge(bitmap, trace_bitmap_size, map_info_num,
+                                   mem_img);
+      break;
+    case path_cov:
+      decoder = libcsdec_init_path(bitmap, trace_bitmap_size, map_info_num,
+                                   mem_img);
+      break;
+    default:
+      decoder = (libcsdec_t)NULL;
+      break;
+  }
+
+  return decoder;
+}
+
+static libcsdec_t init_decoder(struct map_info *map_info, int map_info_num)
+{
+  libcsdec_t decoder;
+  unsigned char *bitmap;
+  int i;
+
+  if (!trace_bitmap) {
+    trace_bitmap = malloc(trace_bitmap_size);
+    if (!trace_bitmap) {
+      perror("malloc");
+      decoder = (libcsdec_t)NULL;
+      goto exit;
+    }
+  }
+
+  if (!mem_img) {
+    mem_img = malloc(sizeof(struct libcsdec_memory_image) * map_info_num);
+    if (!mem_img) {
+      perror("malloc");
+      decoder = (libcsdec_t)NULL;
+      goto exit;
+    }
+    for (i = 0; i < map_info_num; i++) {
+      mem_img[i].data = map_info[i].buf;
+      mem_img[i].size =
+          (size_t)ALIGN_UP(map_info[i].end - map_info[i].start, PAGE_SIZE);
+    }
+  }
+
+  bitmap = trace_bitmap;
+  if (batch_coverage_on) {
+    /* Added to trace_bitmap at the end of each trace session. */
+    if (init_coverage_buf(&coverage_buf, trace_bitmap_size) < 0) {
+      fprintf(stderr, "init_coverage_buf() failed\n");
+      decoder = (libcsdec_t)NULL;
+      goto exit;
+    }
+    bitmap = coverage_buf.buf;
+  }
+
+  decoder = init_bitmap_decoder(bitmap, map_info_num);
+
+exit:
+  return decoder;
+}
+
+/* Set up the decoders of the other CPUs next to decoder, which decodes the
+ * first one. */
+static int init_cpu_decoders(void)
+{
+  struct cpu_decoder *cpu;
+  int i;
+
+  for (i = 0; i < nr_trace_cpus; i++) {
+    cpu = &cpu_decoders[i];
+    cpu->cpu = trace_cpus[i];
+    if ((cpu->trace_id = get_trace_id(board_name, cpu->cpu)) < 0) {
+      fprintf(stderr, "No trace ID for CPU #%d\n", cpu->cpu);
+      return -1;
+    }
+    if (i == 0) {
+      cpu->decoder = decoder;
+    } else if (init_coverage_buf(&cpu->coverage, trace_bitmap_size) < 0) {
+      fprintf(stderr, "init_coverage_buf() failed\n");
+      return -1;
+    } else {
+      cpu->decoder = init_bitmap_decoder(cpu->coverage.buf, range_count);
+    }
+    if (!cpu->decoder) {
+      fprintf(stderr, "init_decoder() failed\n");
+      return -1;
+    }
+    cpu->out.buf = cpu->block;
+    cpu->out.size = sizeof(cpu->block);
+    cpu->out.len = 0;
+  }
+
+  return 0;
+}
+
+/* TODO: Take cov_type as a argument. */
+static int fini_decoder(void)
+{
+  int i;
+
+  if (!decoder) {
+    return -1;
+  }
+
+  if (parallel_decode_on) {
+    fini_parallel_decoder(&parallel_decoder, coverage_buf.buf
+                                                 ? coverage_buf.buf
+                                                 : trace_bitmap);
+  }
+
+  finish_one_decoder(decoder);
+  for (i = 1; multi_core_on && i < nr_trace_cpus; i++) {
+    if (cpu_decoders[i].decoder) {
+      finish_one_decoder(cpu_decoders[i].decoder);
+      cpu_decoders[i].decoder = NULL;
+    }
+    flush_coverage_buf(&cpu_decoders[i].coverage, trace_bitmap);
+    fini_coverage_buf(&cpu_decoders[i].coverage);
+  }
+
+  if (coverage_buf.buf) {
+    flush_coverage_buf(&coverage_buf, trace_bitmap);
+    fini_coverage_buf(&coverage_buf);
+  }
+
+  return 0;
+}
+
+/* Append fetched trace to the trace file before the chunk or the ETR buffer
+ * it is in is reused. */
+static void export_trace_data(unsigned long seq, const void *buf, size_t len)
+{
+  if (!trace_export_on) {
+    return;
+  }
+  if (write_trace_file_chunk(&trace_file, seq, buf, len, buf, len, 0) < 0) {
+    trace_export_incomplete = true;
+  }
+}
+
+/* Finish the trace container. decoderargs.txt refers to the raw trace that
+ * cs-trace-extract produces from it. */
+static int export_trace(const char *trace_name, const char *raw_trace_name,
+                        const char *trace_args_name)
+{
+  int ret;
   char *cwd;
-  char trace_path[PATH_MAX];
+  char raw_trace_path[PATH_MAX];
   char decoder_args_path[PATH_MAX];
-  FILE *fp;
 
   ret = -1;
 
@@ -447,25 +1102,36 @@ static int export_trace(const char *trace_name, const char *trace_args_name)
     goto exit;
   }
 
-  memset(trace_path, 0, sizeof(trace_path));
+  memset(raw_trace_path, 0, sizeof(raw_trace_path));
   memset(decoder_args_path, 0, sizeof(decoder_args_path));
-  snprintf(trace_path, sizeof(trace_path), "%s/%s", cwd, trace_name);
+  snprintf(raw_trace_path, sizeof(raw_trace_path), "%s/%s", cwd,
+           raw_trace_name);
   snprintf(decoder_args_path, sizeof(decoder_args_path), "%s/%s", cwd,
            trace_args_name);
 
-  if (export_decoder_args(trace_id, trace_path, decoder_args_path, map_info,
-                          range_count) < 0) {
+  if (export_decoder_args(trace_id, raw_trace_path, decoder_args_path,
+                          map_info, range_count) < 0) {
     goto exit;
   }
 
-  fp = fopen(trace_path, "wb");
-  if (!fp) {
-    perror("fopen");
-    goto exit;
+  /* The chunks were appended as they were fetched. */
+  if (stream_export_on) {
+    if (stop_trace_writer(&trace_writer) < 0) {
+      fprintf(stderr, "Failed to stream trace to %s\n", trace_name);
+    }
+    if (registration_verbose > 0) {
+      fprintf(stderr, "Streamed %zu bytes of trace as %zu bytes\n",
+              trace_writer.bytes_in, trace_writer.bytes_out);
+    }
+  }
+  if (trace_export_incomplete) {
+    fprintf(stderr, "ERROR: Trace was lost. %s is incomplete\n", trace_name);
   }
 
-  fwrite(trace_buf, (size_t)((char *)trace_buf_ptr - (char *)trace_buf), 1, fp);
-  fclose(fp);
+  if (close_trace_file(&trace_file, map_info, range_count) < 0) {
+    fprintf(stderr, "close_trace_file() failed\n");
+    goto exit;
+  }
 
   ret = 0;
 
@@ -477,6 +1143,208 @@ exit:
   return ret;
 }
 
+/* Offset of the ETR RAM write pointer in the u-dma-buf region. */
+static size_t get_etr_write_offset(void)
+{
+  return (size_t)(cs_get_buffer_rwp(devices.etb) - etr_ram_addr);
+}
+
+static void add_etr_slice(size_t offset, size_t size)
+{
+  etr_slices[etr_slice_count].offset = offset;
+  etr_slices[etr_slice_count].size = size;
+  etr_slice_count++;
+}
+
+/* Collect [read pointer, RWP) of the ETR buffer as slices without copying.
+ * The sinks must be stopped so that the RWP does not move. The slices stay
+ * valid until the sinks are enabled again. */
+static int fetch_udmabuf_trace(void)
+{
+  size_t write_offset;
+  int i;
+
+  write_offset = get_etr_write_offset();
+  etr_slice_count =
+      get_udmabuf_slices(&etr_udmabuf, etr_read_offset, write_offset,
+                         cs_buffer_has_wrapped(devices.etb), etr_slices);
+  if (etr_slice_count > 0 && etr_slices[0].offset != etr_read_offset) {
+    fprintf(stderr, "WARNING: ETR buffer overflowed. Trace data lost\n");
+  }
+
+  etr_read_offset = write_offset;
+
+  for (i = 0; i < etr_slice_count; i++) {
+    if (sync_udmabuf_for_cpu(&etr_udmabuf, etr_slices[i].offset,
+                             etr_slices[i].size) < 0) {
+      fprintf(stderr, "sync_udmabuf_for_cpu() failed\n");
+      etr_slice_count = 0;
+      return -1;
+    }
+    export_trace_data(fetch_seq++,
+                      (char *)etr_udmabuf.buf + etr_slices[i].offset,
+                      etr_slices[i].size);
+  }
+
+  return 0;
+}
+
+static int decode_udmabuf_trace(void)
+{
+  int ret;
+  int i;
+
+  ret = 0;
+
+  for (i = 0; i < etr_slice_count; i++) {
+    if (ret == 0) {
+      ret = run_decoder((char *)etr_udmabuf.buf + etr_slices[i].offset,
+                        etr_slices[i].size);
+    }
+    /* Hand the slice back to the ETR even if decoding failed. */
+    if (sync_udmabuf_for_device(&etr_udmabuf, etr_slices[i].offset,
+                                etr_slices[i].size) < 0) {
+      fprintf(stderr, "sync_udmabuf_for_device() failed\n");
+      ret = -1;
+    }
+  }
+  etr_slice_count = 0;
+
+  return ret;
+}
+
+/* Add what the running ETR wrote since the last call to etr_write_count. The
+ * RWP alone cannot tell a whole lap between two calls from none. The sticky
+ * STS.Full flag is set once the RWP passes the end of the buffer, so a flag
+ * seen before the count gets there means the RWP went around once more than
+ * it shows. Past that point the flag stays set, and a lap within one call is
+ * left to the drain steps and the throttle to prevent. */
+static void update_etr_write_count(void)
+{
+  size_t write_offset;
+
+  write_offset = get_etr_write_offset();
+  etr_write_count += (write_offset + etr_udmabuf.size - etr_last_write_offset) %
+                     etr_udmabuf.size;
+  etr_last_write_offset = write_offset;
+
+  if (etr_start_offset + etr_write_count < etr_udmabuf.size &&
+      cs_buffer_has_wrapped(devices.etb)) {
+    etr_write_count += etr_udmabuf.size;
+  }
+}
+
+static void reset_etr_counts(void)
+{
+  etr_read_offset = get_etr_write_offset();
+  etr_last_write_offset = etr_read_offset;
+  etr_start_offset = etr_read_offset;
+  etr_write_count = 0;
+  etr_read_count = 0;
+}
+
+/* Bytes written by the running ETR but not consumed yet. More than the
+ * buffer size means that the ETR has lapped the decoder. */
+static size_t get_etr_backlog(void)
+{
+  update_etr_write_count();
+
+  return (size_t)(etr_write_count - etr_read_count);
+}
+
+/* Decode up to max_size bytes of live trace in place, whole formatter frames
+ * only. If the ETR has lapped the decoder, the trace it overwrote is lost,
+ * and reading resumes at the RWP with the decoder reset, which waits for the
+ * next A-sync. Returns the number of bytes consumed. */
+static ssize_t drain_udmabuf_trace(size_t max_size)
+{
+  size_t pending;
+  size_t tail_size;
+  uint64_t read_count;
+  int i;
+
+  pending = get_etr_backlog();
+  if (pending > etr_udmabuf.size) {
+    fprintf(stderr,
+            "WARNING: ETR buffer overflowed. %zu bytes of trace dropped\n",
+            pending);
+    etr_read_offset = etr_last_write_offset;
+    etr_read_count = etr_write_count;
+    return reset_decoder(map_info, range_count) < 0 ? -1 : 0;
+  }
+  if (pending > max_size) {
+    pending = max_size;
+  }
+  pending = ALIGN_DOWN(pending, FORMATTER_FRAME_SIZE);
+  if (pending == 0) {
+    return 0;
+  }
+
+  etr_slice_count = 0;
+  tail_size = etr_udmabuf.size - etr_read_offset;
+  if (pending > tail_size) {
+    add_etr_slice(etr_read_offset, tail_size);
+    add_etr_slice(0, pending - tail_size);
+  } else {
+    add_etr_slice(etr_read_offset, pending);
+  }
+
+  for (i = 0; i < etr_slice_count; i++) {
+    if (sync_udmabuf_for_cpu(&etr_udmabuf, etr_slices[i].offset,
+                             etr_slices[i].size) < 0) {
+      fprintf(stderr, "sync_udmabuf_for_cpu() failed\n");
+      etr_slice_count = 0;
+      return -1;
+    }
+    export_trace_data(fetch_seq++,
+                      (char *)etr_udmabuf.buf + etr_slices[i].offset,
+                      etr_slices[i].size);
+  }
+
+  etr_read_offset = (etr_read_offset + pending) % etr_udmabuf.size;
+  read_count = etr_read_count;
+  etr_read_count += pending;
+
+  if (decode_udmabuf_trace() < 0) {
+    return -1;
+  }
+
+  /* The slices were decoded in place, so the ETR must not have reached them
+   * in the meantime. */
+  if (get_etr_backlog() + pending > etr_udmabuf.size) {
+    fprintf(stderr, "WARNING: ETR lapped the decoder. Decoded trace from "
+                    "%llu may be corrupt\n",
+            (unsigned long long)read_count);
+    if (reset_decoder(map_info, range_count) < 0) {
+      return -1;
+    }
+  }
+
+  return (ssize_t)pending;
+}
+
+/* The broker programs the ETM when the client registers, so this is where
+ * configure_trace() would be called otherwise. Trace recorded between
+ * sessions is dropped. trace_mutex must be held. */
+static int enable_broker_trace(pid_t pid)
+{
+  if (is_first_trace) {
+    trace_cid = pid;
+    if (register_broker_client(&broker_client, trace_cpu, trace_id, pid,
+                               map_info, range_count) < 0) {
+      fprintf(stderr, "register_broker_client() failed\n");
+      return -1;
+    }
+    is_first_trace = false;
+  } else if (sync_broker_client(&broker_client) < 0) {
+    fprintf(stderr, "sync_broker_client() failed\n");
+    return -1;
+  }
+  discard_broker_client(&broker_client);
+
+  return 0;
+}
+
 static int enable_cs_trace(pid_t pid)
 {
   int ret;
@@ -485,9 +1353,18 @@ static int enable_cs_trace(pid_t pid)
 
   pthread_mutex_lock(&trace_mutex);
 
+  if (broker_name) {
+    ret = enable_broker_trace(pid);
+    goto exit;
+  }
+
   if (is_first_trace) {
+    trace_cid = pid;
+    trace_cids[0] = pid;
+    nr_trace_cids = pid != 0 ? 1 : 0;
     /* Do not specify traced PID in forkserver mode */
-    if (configure_trace(board, &devices, map_info, range_count, pid) < 0) {
+    if (configure_trace(board, &devices, map_info, range_count, trace_cids,
+                        nr_trace_cids) < 0) {
       fprintf(stderr, "configure_trace() failed\n");
       goto exit;
     }
@@ -498,6 +1375,17 @@ static int enable_cs_trace(pid_t pid)
     }
     is_first_trace = false;
   } else {
+    if (pid != 0 && pid != trace_cid) {
+      /* A new target process. Filter on it alone. */
+      trace_cid = pid;
+      trace_cids[0] = pid;
+      nr_trace_cids = 1;
+      if (update_trace_ranges(board, &devices, map_info, range_count,
+                              trace_cids, nr_trace_cids) < 0) {
+        fprintf(stderr, "update_trace_ranges() failed\n");
+        goto exit;
+      }
+    }
     /* Enable trace sinks only once ETMs enabled */
     if (enable_trace_sinks_only(&devices) < 0) {
       fprintf(stderr, "enable_trace_sinks_only() failed\n");
@@ -505,147 +1393,865 @@ static int enable_cs_trace(pid_t pid)
     }
   }
 
-  if (export_config) {
-    do_dump_config(board, &devices, 0);
-  }
+  if (zero_copy_on) {
+    /* Resume reading from the position the ETR writes next. */
+    reset_etr_counts();
+  }
+
+  if (export_config) {
+    do_dump_config(board, &devices, 0);
+  }
+
+  ret = 0;
+
+exit:
+  if (ret < 0 && !broker_name) {
+    cs_shutdown();
+  }
+  pthread_mutex_unlock(&trace_mutex);
+
+  return ret;
+}
+
+static int disable_cs_trace(bool disable_all)
+{
+  int ret;
+  int disable_trial;
+
+  pthread_mutex_lock(&trace_mutex);
+
+  if (broker_name) {
+    /* The ETM keeps running. Wait for what it recorded so far. */
+    if ((ret = sync_broker_client(&broker_client)) < 0) {
+      fprintf(stderr, "sync_broker_client() failed\n");
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    return ret;
+  }
+
+  disable_trial = 0;
+  while (disable_trial++ < TRACE_DISABLE_TRIAL) {
+    if (disable_all) {
+      if ((ret = disable_trace(board, &devices)) < 0) {
+        fprintf(stderr, "disable_trace() failed\n");
+      }
+    } else {
+      if ((ret = disable_trace_sinks_only(&devices)) < 0) {
+        fprintf(stderr, "disable_trace_sinks_only() failed\n");
+      }
+    }
+    if (!(ret < 0)) {
+      break;
+    }
+    usleep(TRACE_DISABLE_TRIAL_USLEEP);
+    cs_reset_error_count();
+  }
+
+  pthread_mutex_unlock(&trace_mutex);
+
+  return ret;
+}
+
+/* The pool is bounded by -m or AFLCS_TRACE_MEM. */
+static void report_trace_pool_exhausted(void)
+{
+  fprintf(stderr,
+          "ERROR: Trace pool of %zu bytes exhausted. Trace data dropped. "
+          "Raise the limit with -m or AFLCS_TRACE_MEM\n",
+          trace_pool_max_size);
+  trace_export_incomplete = true;
+}
+
+static void queue_fetched_chunk(struct trace_chunk *chunk)
+{
+  chunk->seq = fetch_seq++;
+  if (stream_export_on) {
+    if (decoding_on) {
+      /* Both the writer and the decoder release the chunk. */
+      hold_chunk(&trace_pool, chunk);
+      queue_filled_chunk(&trace_pool, chunk);
+    }
+    write_trace_chunk(&trace_writer, chunk);
+    return;
+  }
+
+  export_trace_data(chunk->seq, chunk->buf, chunk->len);
+  if (decoding_on) {
+    queue_filled_chunk(&trace_pool, chunk);
+  } else {
+    put_free_chunk(&trace_pool, chunk);
+  }
+}
+
+/* The writer thread and the decode workers recycle chunks, so wait for one
+ * instead of dropping, with trace_mutex released meanwhile. The caller must
+ * check again what there is to fetch. trace_mutex must be held. */
+static struct trace_chunk *get_fetch_chunk(void)
+{
+  struct trace_chunk *chunk;
+
+  chunk = get_free_chunk(&trace_pool, false);
+  if (chunk || !(stream_export_on || decode_workers > 0)) {
+    return chunk;
+  }
+
+  pthread_mutex_unlock(&trace_mutex);
+  chunk = get_free_chunk(&trace_pool, true);
+  pthread_mutex_lock(&trace_mutex);
+
+  return chunk;
+}
+
+/* Copy the trace delivered to the broker ring. Each chunk holds a whole ring.
+ * trace_mutex must be held. */
+static int fetch_broker_trace(void)
+{
+  struct trace_chunk *chunk;
+
+  if (get_broker_backlog(&broker_client) == 0) {
+    return 0;
+  }
+
+  chunk = get_fetch_chunk();
+  if (!chunk) {
+    report_trace_pool_exhausted();
+    discard_broker_client(&broker_client);
+    return -1;
+  }
+  if (get_broker_backlog(&broker_client) == 0) {
+    put_free_chunk(&trace_pool, chunk);
+    return 0;
+  }
+
+  chunk->len = read_broker_client(&broker_client, chunk->buf, chunk->size,
+                                  &chunk->reset);
+  queue_fetched_chunk(chunk);
+
+  return 0;
+}
+
+int fetch_trace(void)
+{
+  int ret;
+  cs_device_t etb;
+  int len;
+  struct trace_chunk *chunk;
+  int n;
+
+  ret = -1;
+
+  pthread_mutex_lock(&trace_mutex);
+
+  if (zero_copy_on) {
+    ret = fetch_udmabuf_trace();
+    goto exit;
+  }
+  if (broker_name) {
+    ret = fetch_broker_trace();
+    goto exit;
+  }
+
+  etb = devices.etb;
+  len = cs_get_buffer_unread_bytes(etb);
+  if (len <= 0) {
+    ret = 0;
+    goto exit;
+  }
+
+  chunk = get_fetch_chunk();
+  if (!chunk) {
+    report_trace_pool_exhausted();
+    cs_empty_trace_buffer(etb);
+    goto exit;
+  }
+  if ((len = cs_get_buffer_unread_bytes(etb)) <= 0) {
+    put_free_chunk(&trace_pool, chunk);
+    ret = 0;
+    goto exit;
+  }
+
+  /* The oldest trace has been overwritten, e.g. by a persistent iteration
+   * that does not fit in the ETR. */
+  if (cs_buffer_has_wrapped(etb)) {
+    fprintf(stderr, "WARNING: ETR buffer overflowed. Trace data lost\n");
+  }
+
+  n = cs_get_trace_data(etb, chunk->buf, chunk->size);
+  if (n <= 0) {
+    fprintf(stderr, "Failed to get trace\n");
+    put_free_chunk(&trace_pool, chunk);
+    cs_empty_trace_buffer(etb);
+    goto exit;
+  } else if (n < len) {
+    fprintf(stderr, "Got incomplete trace\n");
+  }
+  cs_empty_trace_buffer(etb);
+
+  chunk->len = (size_t)n;
+  queue_fetched_chunk(chunk);
+
+  ret = 0;
+
+exit:
+  pthread_mutex_unlock(&trace_mutex);
+  return ret;
+}
+
+/* Runs on a decode worker. Chunks of trace_stream come in fetch order. */
+static int decode_stream_chunk(void *ctx, struct trace_chunk *chunk)
+{
+  int ret;
+
+  ret = run_chunk_decoder(chunk);
+  put_free_chunk(&trace_pool, chunk);
+
+  return ret;
+}
+
+/* Runs on a decode worker. Chunks of a CPU come in fetch order. */
+static int decode_cpu_chunk(void *ctx, struct trace_chunk *chunk)
+{
+  struct cpu_decoder *cpu;
+  int ret;
+
+  cpu = ctx;
+  ret = run_one_decoder(cpu->decoder, chunk->buf, chunk->len);
+  put_free_chunk(&trace_pool, chunk);
+
+  return ret;
+}
+
+static void queue_cpu_chunks(void)
+{
+  struct cpu_decoder *cpu;
+  int i;
+
+  for (i = 0; i < nr_trace_cpus; i++) {
+    cpu = &cpu_decoders[i];
+    if (cpu->chunk) {
+      queue_decode_chunk(&decode_pool, &cpu->stream, cpu->chunk);
+      cpu->chunk = NULL;
+    }
+  }
+}
+
+/* A chunk sized for a whole fetch holds the re-framed trace of any one CPU
+ * in it. If the pool is dry, the chunks filled so far are queued and the
+ * workers drained, so that they free theirs. Returns NULL if the rest are
+ * still in use; ret is set if a worker failed. */
+static struct trace_chunk *get_cpu_chunk(struct trace_chunk *src, int *ret)
+{
+  struct trace_chunk *chunk;
+
+  chunk = get_free_chunk(&trace_pool, false);
+  if (!chunk) {
+    queue_cpu_chunks();
+    if (wait_decode_pool(&decode_pool) < 0) {
+      *ret = -1;
+    }
+    chunk = get_free_chunk(&trace_pool, false);
+  }
+  if (chunk) {
+    chunk->len = 0;
+    chunk->seq = src->seq;
+  }
+
+  return chunk;
+}
+
+/* Re-frame what the demultiplexer extracted for cpu, or the bytes it kept if
+ * flush is set, into the chunk of cpu. Without a chunk the workers are idle,
+ * so cpu is decoded here. */
+static int put_cpu_trace(struct cpu_decoder *cpu, struct trace_chunk *src,
+                         bool flush)
+{
+  unsigned char *out;
+  size_t len;
+  int ret;
+
+  ret = 0;
+
+  if (!cpu->chunk) {
+    cpu->chunk = get_cpu_chunk(src, &ret);
+  }
+  out = cpu->chunk ? (unsigned char *)cpu->chunk->buf + cpu->chunk->len
+                   : cpu_frames;
+  if (flush) {
+    len = flush_reframer(&cpu->reframer, out);
+  } else {
+    len = reframe_trace(&cpu->reframer, cpu->out.buf, cpu->out.len, out);
+    cpu->out.len = 0;
+  }
+
+  if (cpu->chunk) {
+    cpu->chunk->len += len;
+  } else if (len > 0 && run_one_decoder(cpu->decoder, cpu_frames, len) < 0) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+/* Split a fetched chunk by CPU on the decoder thread, and queue the trace of
+ * each CPU re-framed under its ID to the stream of its decoder. The CPUs are
+ * then decoded in parallel. */
+static int split_cpu_chunk(struct trace_chunk *src)
+{
+  const unsigned char *buf;
+  size_t offset;
+  size_t n;
+  int ret;
+  int i;
+
+  ret = 0;
+
+  buf = src->buf;
+  for (offset = 0; offset < src->len; offset += n) {
+    n = src->len - offset;
+    if (n > CPU_DEMUX_BLOCK) {
+      n = CPU_DEMUX_BLOCK;
+    }
+    demux_frames(&cpu_demux, &buf[offset], n);
+    for (i = 0; i < nr_trace_cpus; i++) {
+      if (cpu_decoders[i].out.len > 0 &&
+          put_cpu_trace(&cpu_decoders[i], src, false) < 0) {
+        ret = -1;
+      }
+    }
+  }
+
+  for (i = 0; i < nr_trace_cpus; i++) {
+    if (cpu_decoders[i].reframer.len > 0 &&
+        put_cpu_trace(&cpu_decoders[i], src, true) < 0) {
+      ret = -1;
+    }
+  }
+  queue_cpu_chunks();
+
+  put_free_chunk(&trace_pool, src);
+
+  return ret;
+}
+
+/* Decode the trace of a whole session, or replay the bitmap words of an
+ * identical trace decoded before. */
+static int decode_trace_memo(void)
+{
+  struct trace_memo_entry *entry;
+  struct trace_chunk *head;
+  struct trace_chunk **tail;
+  struct trace_chunk *chunk;
+  uint64_t hash;
+  size_t len;
+  int ret;
+
+  head = NULL;
+  tail = &head;
+  hash = map_generation;
+  len = 0;
+
+  while ((chunk = dequeue_filled_chunk(&trace_pool)) != NULL) {
+    hash = hash_trace(chunk->buf, chunk->len, hash);
+    len += chunk->len;
+    *tail = chunk;
+    tail = &chunk->next;
+  }
+  *tail = NULL;
+
+  entry = find_trace_memo(&trace_memo, hash, len, map_generation);
+
+  ret = 0;
+  while ((chunk = head) != NULL) {
+    head = chunk->next;
+    if (!entry && ret == 0) {
+      ret = run_chunk_decoder(chunk);
+    }
+    put_free_chunk(&trace_pool, chunk);
+  }
+
+  if (entry) {
+    replay_trace_memo(entry, trace_bitmap, trace_bitmap_size);
+    return 0;
+  }
+  if (ret < 0 || harvest_coverage_buf(&coverage_buf) < 0) {
+    return -1;
+  }
+  add_trace_memo(&trace_memo, hash, len, map_generation, &coverage_buf);
+  apply_coverage_buf(&coverage_buf, trace_bitmap);
+  clear_coverage_buf(&coverage_buf);
+
+  return 0;
+}
+
+int decode_trace(void)
+{
+  int ret;
+  struct trace_chunk *chunk;
+
+  if (zero_copy_on) {
+    ret = decode_udmabuf_trace();
+    /* The ETR goes on from its RWP, but its Full status would make the next
+     * fetch look like an overflow. */
+    pthread_mutex_lock(&trace_mutex);
+    clear_trace_sink_full(&devices);
+    pthread_mutex_unlock(&trace_mutex);
+    return ret;
+  }
+
+  ret = 0;
+
+  while ((chunk = dequeue_filled_chunk(&trace_pool)) != NULL) {
+    if (decode_workers > 0 && multi_core_on) {
+      if ((ret = split_cpu_chunk(chunk)) < 0) {
+        break;
+      }
+      continue;
+    }
+    if (decode_workers > 0) {
+      queue_decode_chunk(&decode_pool, &trace_stream, chunk);
+      continue;
+    }
+    ret = run_chunk_decoder(chunk);
+    put_free_chunk(&trace_pool, chunk);
+    if (ret < 0) {
+      break;
+    }
+  }
+
+  return ret;
+}
+
+void trace_suspend_resume_callback(void) { set_trace_state(suspended_state); }
+
+/* Bind the coverage bitmap to the node. A bitmap shared with AFL is only
+ * migrated if no other process has faulted it in yet. */
+static void bind_trace_bitmap(int node)
+{
+  size_t bitmap_size;
+
+  bitmap_size = ALIGN_UP((size_t)trace_bitmap_size, PAGE_SIZE);
+
+  if (!trace_bitmap) {
+    trace_bitmap = mmap(NULL, bitmap_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (trace_bitmap == MAP_FAILED) {
+      perror("mmap");
+      trace_bitmap = NULL;
+      return;
+    }
+  }
+
+  if (bind_memory_node(trace_bitmap, bitmap_size, node) < 0) {
+    fprintf(stderr, "WARNING: Failed to bind bitmap to node %d\n", node);
+  }
+}
+
+static void dump_numa_layout(FILE *stream)
+{
+  int i;
+
+  fprintf(stream, "NUMA: trace CPU #%d on node %d\n", trace_cpu, trace_node);
+  fprintf(stream, "NUMA: u-dma-buf 0x%lx on node %d\n", etr_ram_addr,
+          udmabuf_node);
+  fprintf(stream, "NUMA: decoder CPU #%d on node %d (target node %d)\n",
+          decoder_cpu, decoder_cpu >= 0 ? get_cpu_node(decoder_cpu) : -1,
+          decode_node);
+  if (trace_pool.free_list) {
+    fprintf(stream, "NUMA: trace chunks on node %d\n",
+            get_memory_node(trace_pool.free_list->buf));
+  }
+  if (trace_bitmap) {
+    fprintf(stream, "NUMA: bitmap on node %d\n",
+            get_memory_node(trace_bitmap));
+  }
+  for (i = 0; i < range_count; i++) {
+    fprintf(stream, "NUMA: %s image on node %d\n", map_info[i].path,
+            get_memory_node(map_info[i].buf));
+  }
+}
+
+/* Replace the decoders after the memory map changed. Called between trace
+ * sessions. */
+static int rebuild_decoder(void)
+{
+  fini_decoder();
+  free(mem_map);
+  mem_map = NULL;
+  free(mem_img);
+  mem_img = NULL;
+
+  decoder = init_decoder(map_info, range_count);
+  if (!decoder) {
+    fprintf(stderr, "init_decoder() failed\n");
+    return -1;
+  }
+  if (multi_core_on && init_cpu_decoders() < 0) {
+    return -1;
+  }
+  if (parallel_decode_on &&
+      init_parallel_decoder(&parallel_decoder, decode_jobs, trace_bitmap_size,
+                            range_count, mem_img) < 0) {
+    fprintf(stderr, "init_parallel_decoder() failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Pick up executable regions the child mapped since the last call. The
+ * running session is ended first, so that trace recorded so far is decoded
+ * against the map it was recorded with; a new one starts with the ETM filters
+ * and the decoders updated. */
+int update_trace_maps(pid_t pid)
+{
+  int count;
+  int ret;
+  bool tracing;
+
+  count = update_map_info(pid, map_info, range_count, RANGE_MAX,
+                          trace_modules);
+  if (count <= range_count) {
+    return count < 0 ? -1 : 0;
+  }
+
+  tracing = is_tracing();
+
+  if (tracing && (ret = stop_trace(false)) < 0) {
+    return ret;
+  }
+  if (tracing && !decoding_on) {
+    /* Keep what the sinks collected before they are enabled again. */
+    fetch_trace();
+  }
+
+  if (decoding_on && (decode_node >= 0 || preload_images_on) &&
+      load_map_images(&map_info[range_count], count - range_count,
+                      decode_node, preload_images_on) < 0) {
+    fprintf(stderr, "load_map_images() failed\n");
+    return -1;
+  }
+
+  range_count = count;
+  map_generation++;
+
+  if (registration_verbose > 0) {
+    dump_map_info(stderr, map_info, range_count);
+  }
+
+  if (decoding_on && rebuild_decoder() < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&trace_mutex);
+  ret = update_trace_ranges(board, &devices, map_info, range_count, trace_cids,
+                            nr_trace_cids);
+  pthread_mutex_unlock(&trace_mutex);
+  if (ret < 0) {
+    fprintf(stderr, "update_trace_ranges() failed\n");
+    return ret;
+  }
+
+  if (tracing) {
+    return start_trace(pid, trace_cid != 0);
+  }
+
+  return 0;
+}
+
+/* Reprogram the context ID filter of the ETMs within the session. The sinks
+ * keep running, so the trace they hold is kept: each ETM drains into them
+ * when it is disabled for programming, and starts again with an A-sync. Only
+ * what runs on a CPU while its ETM is being programmed is not traced, and
+ * the task that made the change is stopped meanwhile. */
+static int update_trace_cids(void)
+{
+  int ret;
+
+  pthread_mutex_lock(&trace_mutex);
+  ret = update_trace_ranges(board, &devices, map_info, range_count, trace_cids,
+                            nr_trace_cids);
+  pthread_mutex_unlock(&trace_mutex);
+  if (ret < 0) {
+    fprintf(stderr, "update_trace_ranges() failed\n");
+  }
+
+  return ret;
+}
+
+/* The traced process tree created thread or process id. */
+static int add_trace_cid(pid_t id)
+{
+  int i;
+
+  if (trace_cid == 0 || nr_trace_cids == 0) {
+    return 0;
+  }
+  for (i = 0; i < nr_trace_cids; i++) {
+    if (trace_cids[i] == id) {
+      return 0;
+    }
+  }
+  if (nr_trace_cids == TRACE_CIDS_MAX) {
+    fprintf(stderr, "WARNING: Too many tasks to filter by context ID. "
+                    "Not tracing %d\n",
+            id);
+    return 0;
+  }
+  trace_cids[nr_trace_cids++] = id;
+
+  return update_trace_cids();
+}
+
+/* Returns true if id was in the filter. The IDs of exited threads leave it
+ * with the next update. */
+static bool remove_trace_cid(pid_t id)
+{
+  int i;
+
+  for (i = 1; i < nr_trace_cids; i++) {
+    if (trace_cids[i] == id) {
+      trace_cids[i] = trace_cids[--nr_trace_cids];
+      return true;
+    }
+  }
+
+  return false;
+}
 
-  ret = 0;
+/* Options the tracer sets on the child once it has been exec'd. */
+int get_trace_ptrace_options(void)
+{
+  int options;
 
-exit:
-  if (ret < 0) {
-    cs_shutdown();
+  options = 0;
+  if (follow_maps_on) {
+    options |= PTRACE_O_TRACESECCOMP | PTRACE_O_TRACESYSGOOD;
+  }
+  if (multi_core_on || follow_fork_on) {
+    options |= PTRACE_O_TRACECLONE;
+  }
+  if (follow_fork_on) {
+    options |= PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC;
   }
-  pthread_mutex_unlock(&trace_mutex);
 
-  return ret;
+  return options;
 }
 
-static int disable_cs_trace(bool disable_all)
+static struct traced_task *find_traced_task(pid_t tid)
 {
-  int ret;
-  int disable_trial;
-
-  pthread_mutex_lock(&trace_mutex);
+  int i;
 
-  disable_trial = 0;
-  while (disable_trial++ < TRACE_DISABLE_TRIAL) {
-    if (disable_all) {
-      if ((ret = disable_trace(board, &devices)) < 0) {
-        fprintf(stderr, "disable_trace() failed\n");
-      }
-    } else {
-      if ((ret = disable_trace_sinks_only(&devices)) < 0) {
-        fprintf(stderr, "disable_trace_sinks_only() failed\n");
-      }
-    }
-    if (!(ret < 0)) {
-      break;
+  for (i = 0; i < nr_traced_tasks; i++) {
+    if (traced_tasks[i].tid == tid) {
+      return &traced_tasks[i];
     }
-    usleep(TRACE_DISABLE_TRIAL_USLEEP);
-    cs_reset_error_count();
   }
 
-  pthread_mutex_unlock(&trace_mutex);
+  return NULL;
+}
 
-  return ret;
+static struct traced_task *add_traced_task(pid_t tid, bool starting)
+{
+  struct traced_task *task;
+
+  if (nr_traced_tasks >= TRACE_TASKS_MAX) {
+    return NULL;
+  }
+  task = &traced_tasks[nr_traced_tasks++];
+  task->tid = tid;
+  task->starting = starting;
+
+  return task;
 }
 
-int fetch_trace(void)
+static void remove_traced_task(pid_t tid)
 {
-  int ret;
-  cs_device_t etb;
-  int len;
-  size_t buf_remain;
-  void *new_trace_buf;
-  size_t new_trace_buf_size;
-  int n;
+  struct traced_task *task;
 
-  ret = -1;
+  if ((task = find_traced_task(tid))) {
+    *task = traced_tasks[--nr_traced_tasks];
+  }
+}
 
-  pthread_mutex_lock(&trace_mutex);
+/* Resume the task the decoder thread stopped, once it has resumed the trace.
+ * The tracee is in a ptrace stop, which SIGCONT does not end. */
+static void resume_held_task(void)
+{
+  if (held_tid == 0) {
+    return;
+  }
 
-  etb = devices.etb;
-  len = cs_get_buffer_unread_bytes(etb);
+  while (atomic_load_explicit(&trace_state, memory_order_acquire) ==
+         suspended_state) {
+    futex_wait((uint32_t *)&trace_state, suspended_state);
+  }
 
-  trace_buf_ptr = (void *)ALIGN_UP((unsigned long)trace_buf_ptr, 0x8);
+  ptrace(PTRACE_CONT, held_tid, NULL, NULL);
+  held_tid = 0;
+}
 
-  buf_remain =
-      trace_buf_size - (size_t)((char *)trace_buf_ptr - (char *)trace_buf);
-  /* No space left in trace_buf. */
-  if ((size_t)len > buf_remain) {
-    new_trace_buf_size = trace_buf_size * 2;
-    new_trace_buf = mremap(trace_buf, trace_buf_size, new_trace_buf_size, 0);
+/* Wait for the child like waitpid(), but return only when it exits, stops
+ * on entry to or exit from an executable mmap(), or stops on the SIGSTOP the
+ * decoder thread sent to suspend it. Other stops are handled here: ptrace
+ * events are resumed, and signals are delivered to the task.
+ *
+ * In multi-core and follow-fork modes its threads, and with follow-fork its
+ * child processes, are traced as well: each new one is added to the context
+ * ID filter and resumed, and stops of others than pid are handled here. A
+ * child that execs another program leaves the filter, since its code no
+ * longer matches the traced images.
+ *
+ * A new task starts with a SIGSTOP, which may be reported before the event
+ * of the task that created it. Only that stop is resumed here. A later
+ * SIGSTOP of any task may be the one of the decoder thread. */
+pid_t wait_trace_child(pid_t pid, int *wstatus)
+{
+  struct traced_task *task;
+  siginfo_t info;
+  unsigned long msg;
+  pid_t tid;
+  int event;
+  int sig;
+
+  resume_held_task();
+
+  while ((tid = waitpid(multi_core_on || follow_fork_on ? -1 : pid, wstatus,
+                        __WALL)) > 0) {
+    if (WIFEXITED(*wstatus) || WIFSIGNALED(*wstatus)) {
+      if (tid == pid) {
+        break;
+      }
+      remove_trace_cid(tid);
+      remove_traced_task(tid);
+      continue;
+    }
+    if (!WIFSTOPPED(*wstatus)) {
+      continue;
+    }
 
-    if (!new_trace_buf) {
-      perror("mremap");
-      goto exit;
+    sig = WSTOPSIG(*wstatus);
+    event = sig == SIGTRAP ? *wstatus >> 16 : 0;
+    if (event == PTRACE_EVENT_CLONE || event == PTRACE_EVENT_FORK ||
+        event == PTRACE_EVENT_VFORK) {
+      if (ptrace(PTRACE_GETEVENTMSG, tid, NULL, &msg) == 0) {
+        if (add_trace_cid((pid_t)msg) < 0) {
+          fprintf(stderr, "add_trace_cid() failed\n");
+        }
+        if (!find_traced_task((pid_t)msg)) {
+          add_traced_task((pid_t)msg, true);
+        }
+      }
+    } else if (event == PTRACE_EVENT_EXEC) {
+      if (tid != pid && remove_trace_cid(tid) && update_trace_cids() < 0) {
+        fprintf(stderr, "update_trace_cids() failed\n");
+      }
+    }
+    if (tid == pid &&
+        (is_exec_map_stop(*wstatus) || sig == (SIGTRAP | 0x80))) {
+      break;
     }
-    decoded_trace_buf =
-        (void *)((char *)new_trace_buf +
-                 ((char *)decoded_trace_buf - (char *)trace_buf));
-    trace_buf_ptr = (void *)((char *)new_trace_buf +
-                             ((char *)trace_buf_ptr - (char *)trace_buf));
-    trace_buf = new_trace_buf;
-    trace_buf_size = new_trace_buf_size;
-    buf_remain = (size_t)((char *)trace_buf_ptr - (char *)trace_buf);
-  }
 
-  n = cs_get_trace_data(etb, trace_buf_ptr, buf_remain);
-  if (n <= 0) {
-    fprintf(stderr, "Failed to get trace\n");
-  } else if (n < len) {
-    fprintf(stderr, "Got incomplete trace\n");
+    if (sig == SIGSTOP && tid != pid) {
+      if (!(task = find_traced_task(tid))) {
+        /* Stopped before its creator reported it. */
+        add_traced_task(tid, false);
+        sig = 0;
+      } else if (task->starting) {
+        task->starting = false;
+        sig = 0;
+      }
+    }
+    if (sig == SIGSTOP &&
+        atomic_exchange_explicit(&trace_stop_sent, false,
+                                 memory_order_acq_rel)) {
+      /* Held until the decoder thread resumes the trace. */
+      held_tid = tid;
+      break;
+    }
+    if (sig == SIGSTOP && ptrace(PTRACE_GETSIGINFO, tid, NULL, &info) < 0 &&
+        errno == EINVAL) {
+      /* A group-stop. The signal has been delivered already. */
+      sig = 0;
+    }
+    if (event != 0 || sig == (SIGTRAP | 0x80)) {
+      sig = 0;
+    }
+    ptrace(PTRACE_CONT, tid, NULL, sig);
   }
-  cs_empty_trace_buffer(etb);
-  trace_buf_ptr = (void *)((char *)trace_buf_ptr + n);
 
-  ret = 0;
-
-exit:
-  pthread_mutex_unlock(&trace_mutex);
-  return ret;
+  return tid;
 }
 
-int decode_trace(void)
+/* The child stopped on entry to an executable mmap(). Let the syscall
+ * complete and update the trace maps. Returns -1 with wstatus set if the
+ * child exited first. */
+int follow_exec_map(pid_t pid, int *wstatus)
 {
-  int ret;
-  void *buf;
-  size_t buf_size;
-
-  buf = decoded_trace_buf;
-  buf_size = (size_t)((char *)trace_buf_ptr - (char *)buf);
+  struct mmap_params params;
+  char path[PATH_MAX];
 
-  ret = run_decoder(buf, buf_size);
-  if (ret < 0) {
-    goto exit;
+  if (registration_verbose > 1 && get_mmap_params(pid, &params) == 0) {
+    memset(path, 0, sizeof(path));
+    read_pid_fd_path(pid, params.fd, path, sizeof(path) - 1);
+    fprintf(stderr, "Executable mapping of %s\n", path);
   }
 
-  decoded_trace_buf = (void *)((char *)buf + buf_size);
+  if (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) < 0) {
+    perror("ptrace");
+    return -1;
+  }
 
-exit:
+  while (wait_trace_child(pid, wstatus) == pid) {
+    if (WIFSTOPPED(*wstatus) && WSTOPSIG(*wstatus) == (SIGTRAP | 0x80)) {
+      if (update_trace_maps(pid) < 0) {
+        fprintf(stderr, "update_trace_maps() failed\n");
+      }
+      ptrace(PTRACE_CONT, pid, NULL, NULL);
+      return 0;
+    }
+    if (WIFSTOPPED(*wstatus) && WSTOPSIG(*wstatus) == SIGSTOP) {
+      trace_suspend_resume_callback();
+      continue;
+    }
+    break;
+  }
 
-  return ret;
+  return -1;
 }
 
-void trace_suspend_resume_callback(void) { set_trace_state(suspended_state); }
-
 /* Start trace session. CoreSight and decoder must be initialized. */
 int start_trace(pid_t pid, bool use_pid_trace)
 {
   int ret;
 
-  if ((ret = set_cpu_affinity(trace_cpu, pid)) < 0) {
+  if (multi_core_on) {
+    /* Threads created later inherit the set. */
+    if ((ret = set_cpu_list_affinity(trace_cpus, nr_trace_cpus, pid)) < 0) {
+      fprintf(stderr, "set_cpu_list_affinity() failed\n");
+      goto exit;
+    }
+  } else if ((ret = set_cpu_affinity(trace_cpu, pid)) < 0) {
     fprintf(stderr, "set_cpu_affinity() failed\n");
     goto exit;
   }
 
-  alloc_trace_buf();
-
   if (decoding_on && ((ret = reset_decoder(map_info, range_count)) < 0)) {
     fprintf(stderr, "reset_decoder() failed\n");
     goto exit;
   }
 
+  /* A process that passed the start point leaves the ETMs started. */
+  if (etm_start_addr != 0 && !is_first_trace && pid != child_pid &&
+      (ret = rearm_trace_start(board, &devices)) < 0) {
+    fprintf(stderr, "rearm_trace_start() failed\n");
+    goto exit;
+  }
+
+  /* Tasks left over by the previous child are not waited for again. */
+  if (pid != child_pid) {
+    nr_traced_tasks = 0;
+  }
+  atomic_store_explicit(&trace_stop_sent, false, memory_order_relaxed);
   child_pid = pid;
   if ((ret = enable_cs_trace(use_pid_trace ? pid : 0)) < 0) {
     fprintf(stderr, "enable_cs_trace() failed\n");
@@ -673,37 +2279,173 @@ int stop_trace(bool disable_all)
 
   set_trace_state(ready_state);
 
-  /* FIXME: Hang with condition trace_state == ready_state && trace_event ==
-   * stop_event */
-  pthread_mutex_lock(&trace_decoder_mutex);
-  while (!decoder_ready) {
-    pthread_cond_wait(&trace_decoder_cond, &trace_decoder_mutex);
+  /* The decoder thread sees the stop event of every session it started, so
+   * this cannot miss the end of the session. */
+  if (decoding_on) {
+    wait_trace_sessions();
   }
-  pthread_mutex_unlock(&trace_decoder_mutex);
 
 exit:
   return ret;
 }
 
+static int do_registration_cached(struct cs_devices_t *devices)
+{
+  return replay_topology(&board_topology, devices);
+}
+
+/* Register the board from the topology cache, and fall back to its own
+ * registration function, which walks the ROM tables, on a miss. That run is
+ * recorded and stored for the next ones. A cache that no longer matches the
+ * hardware is removed. */
+static int setup_cached_board(const struct board *known_board)
+{
+  static struct board cached_boards[2];
+
+  init_topology(&board_topology, known_board->hardware, known_board->n_cpu);
+  if (load_topology(&board_topology, topology_cache_path) == 0) {
+    cached_boards[0] = *known_board;
+    cached_boards[0].do_registration = do_registration_cached;
+    if (setup_named_board(board_name, &board, &devices, cached_boards) == 0) {
+      return 0;
+    }
+    remove_topology(topology_cache_path);
+    cs_shutdown();
+    memset(&devices, 0, sizeof(devices));
+    init_topology(&board_topology, known_board->hardware,
+                  known_board->n_cpu);
+  }
+
+  record_topology(&board_topology);
+  if (setup_named_board(board_name, &board, &devices, known_boards) < 0) {
+    record_topology(NULL);
+    return -1;
+  }
+  record_topology(NULL);
+
+  if (capture_topology(&board_topology, &devices, trace_id_rules) < 0) {
+    fprintf(stderr, "INFO: Board topology cannot be cached\n");
+  } else if (store_topology(&board_topology, topology_cache_path) < 0) {
+    fprintf(stderr, "store_topology() failed\n");
+  }
+
+  return 0;
+}
+
+int setup_trace_board(void)
+{
+  const struct board *known_board;
+
+  if (topology_cache_path) {
+    for (known_board = known_boards; known_board->hardware; known_board++) {
+      if (strcmp(known_board->hardware, board_name) == 0) {
+        return setup_cached_board(known_board);
+      }
+    }
+  }
+
+  return setup_named_board(board_name, &board, &devices, known_boards);
+}
+
+/* In broker mode the sinks are shared and never stop, and the broker
+ * programs the address filters once, so the caller must not follow maps. */
+static void disable_broker_features(void)
+{
+  if (zero_copy_on || continuous_on) {
+    fprintf(stderr, "INFO: Zero-copy mode requires owning the sinks. "
+                    "Disabled\n");
+    zero_copy_on = false;
+    continuous_on = false;
+  }
+  if (trace_start_point || persistent_start != 0 || persistent_end != 0) {
+    fprintf(stderr, "INFO: Start and stop points require owning the sinks. "
+                    "Disabled\n");
+    trace_start_point = NULL;
+    persistent_start = 0;
+    persistent_end = 0;
+  }
+  if (follow_fork_on) {
+    fprintf(stderr, "INFO: Following forks requires owning the sinks. "
+                    "Disabled\n");
+    follow_fork_on = false;
+  }
+  export_config = false;
+}
+
+/* Multi-core mode owns the sinks and splits the trace of a session by CPU
+ * as it is decoded. */
+static void disable_multi_core_features(void)
+{
+  if (zero_copy_on || continuous_on) {
+    fprintf(stderr, "INFO: Zero-copy mode traces one CPU only. Disabled\n");
+    zero_copy_on = false;
+    continuous_on = false;
+  }
+  if (decode_jobs > 1) {
+    fprintf(stderr, "INFO: Parallel decoding traces one CPU only. "
+                    "Disabled\n");
+    decode_jobs = 1;
+  }
+  if (trace_memo_size > 0) {
+    fprintf(stderr, "INFO: Trace memoization traces one CPU only. "
+                    "Disabled\n");
+    trace_memo_size = 0;
+  }
+}
+
 /* Initialize trace. Called on the first time and only once. */
 int init_trace(pid_t parent_pid, pid_t pid)
 {
   int ret;
+  int i;
   int preferred_cpu;
-  int decoder_cpu;
+  struct rusage usage_before;
+  struct rusage usage_after;
 
   ret = -1;
 
   pthread_mutex_init(&trace_mutex, NULL);
-  pthread_mutex_init(&trace_state_mutex, NULL);
-  pthread_mutex_init(&trace_event_mutex, NULL);
-  pthread_cond_init(&trace_event_cond, NULL);
 
-  pthread_mutex_init(&trace_decoder_mutex, NULL);
-  pthread_cond_init(&trace_decoder_cond, NULL);
+  if (nr_trace_cpus > 1 && broker_name) {
+    fprintf(stderr, "INFO: The trace broker serves one CPU per client. "
+                    "Tracing CPU #%d only\n",
+            trace_cpus[0]);
+    nr_trace_cpus = 1;
+  }
+  if (nr_trace_cpus > 0) {
+    trace_cpu = trace_cpus[0];
+  }
+  if (nr_trace_cpus > 1) {
+    multi_core_on = true;
+    disable_multi_core_features();
+  }
+
+  if (broker_name) {
+    if (open_broker_client(&broker_client, broker_name) < 0) {
+      fprintf(stderr, "open_broker_client() failed\n");
+      goto exit;
+    }
+    /* One fetch takes at most a whole ring. */
+    etr_ram_size = broker_client.ring_size;
+    disable_broker_features();
+  } else if (get_udmabuf_info(udmabuf_num, &etr_ram_addr, &etr_ram_size) <
+             0) {
+    fprintf(stderr, "Failed to get u-dma-buf info\n");
+    goto exit;
+  }
+
+  if (numa_on && !broker_name) {
+    udmabuf_node = get_phys_addr_node(etr_ram_addr);
+  }
 
   if (trace_cpu < 0) {
-    if ((preferred_cpu = get_preferred_cpu(parent_pid)) < 0) {
+    preferred_cpu = -1;
+    if (numa_on && udmabuf_node >= 0) {
+      /* Keep the tracee on the node the ETR writes to. */
+      preferred_cpu = get_preferred_node_cpu(parent_pid, udmabuf_node);
+    }
+    if (preferred_cpu < 0 &&
+        (preferred_cpu = get_preferred_cpu(parent_pid)) < 0) {
       fprintf(stderr, "INFO: Failed to get preferred CPU\n");
       /* Some boards is not supported by get_preferred_cpu() */
       if ((preferred_cpu = find_free_cpu() < 0)) {
@@ -714,18 +2456,143 @@ int init_trace(pid_t parent_pid, pid_t pid)
     trace_cpu = preferred_cpu >= 0 ? preferred_cpu : DEFAULT_TRACE_CPU;
   }
 
-  if (get_udmabuf_info(udmabuf_num, &etr_ram_addr, &etr_ram_size) < 0) {
-    fprintf(stderr, "Failed to get u-dma-buf info\n");
+  if (numa_on) {
+    trace_node = get_cpu_node(trace_cpu);
+    decode_node = udmabuf_node >= 0 ? udmabuf_node : trace_node;
+  }
+
+  if (continuous_on) {
+    /* The decoder chases the RWP through the u-dma-buf mapping. */
+    zero_copy_on = true;
+  }
+
+  if (zero_copy_on) {
+    if (!decoding_on) {
+      fprintf(stderr, "INFO: Zero-copy mode requires decoding. Disabled\n");
+      zero_copy_on = false;
+      continuous_on = false;
+    } else if (open_udmabuf(udmabuf_num, &etr_udmabuf) < 0) {
+      fprintf(stderr, "open_udmabuf() failed\n");
+      goto exit;
+    }
+  }
+
+  if (decoding_on && decode_jobs > 1) {
+    if (cov_type != edge_cov) {
+      fprintf(stderr, "Parallel decoding supports edge coverage only\n");
+      goto exit;
+    }
+    parallel_decode_on = true;
+    /* Without periodic A-syncs there is nowhere to split a trace. */
+    if (etm_sync_period == 0) {
+      etm_sync_period = DEFAULT_PARALLEL_SYNC_PERIOD;
+    }
+  }
+
+  if (trace_memo_size > 0) {
+    if (!decoding_on) {
+      trace_memo_size = 0;
+    } else if (zero_copy_on || decode_workers > 0) {
+      fprintf(stderr,
+              "INFO: Trace memoization requires copy mode without decode "
+              "workers. Disabled\n");
+      trace_memo_size = 0;
+    } else {
+      /* Memo entries are harvested from the private bitmap. */
+      batch_coverage_on = true;
+    }
+  }
+
+  if (decode_workers > 0 && (!decoding_on || zero_copy_on)) {
+    if (decoding_on) {
+      fprintf(stderr, "INFO: Decode workers require copy mode. Disabled\n");
+    }
+    decode_workers = 0;
+  }
+
+  /* Chunks of one stream are decoded in order, one worker at a time, so
+   * workers beyond the number of streams would only idle. */
+  if (decode_workers > (multi_core_on ? nr_trace_cpus : 1)) {
+    decode_workers = multi_core_on ? nr_trace_cpus : 1;
+    fprintf(stderr,
+            "INFO: One decode worker per traced CPU at most. Using %d\n",
+            decode_workers);
+  }
+
+  /* After the ETR laps the decoder in continuous mode, the reset decoder
+   * resumes at the next A-sync. */
+  if (continuous_on && etm_sync_period == 0) {
+    etm_sync_period = DEFAULT_CONTINUOUS_SYNC_PERIOD;
+  }
+
+  if (etm_sync_period != 0 && (etm_sync_period < ETM_SYNC_PERIOD_MIN ||
+                               etm_sync_period > ETM_SYNC_PERIOD_MAX)) {
+    fprintf(stderr, "Invalid sync period: %d\n", etm_sync_period);
     goto exit;
   }
 
-  if ((range_count = setup_map_info(pid, map_info, RANGE_MAX)) < 0) {
+  if (!zero_copy_on) {
+    /* Each chunk holds a whole ETR buffer, so one fetch fits in one chunk.
+     * In multi-core mode it holds the trace of one CPU in it re-framed. */
+    if (init_trace_pool(&trace_pool,
+                        ALIGN_UP(multi_core_on ? REFRAMED_SIZE(etr_ram_size)
+                                               : etr_ram_size,
+                                 PAGE_SIZE),
+                        DEFAULT_TRACE_POOL_PREALLOC, trace_pool_max_size,
+                        decode_node) < 0) {
+      fprintf(stderr, "init_trace_pool() failed\n");
+      goto exit;
+    }
+  }
+
+  range_count = setup_map_info(pid, map_info, RANGE_MAX, trace_modules);
+  if (range_count < 0) {
     fprintf(stderr, "setup_map_info() failed\n");
     goto exit;
   }
 
-  if (setup_named_board(board_name, &board, &devices, known_boards) < 0) {
-    fprintf(stderr, "setup_named_board() failed\n");
+  /* Without following maps, libraries that ld.so maps after exec are never
+   * added. */
+  if (trace_modules && !follow_maps_on &&
+      !has_traced_modules(map_info, range_count, trace_modules)) {
+    fprintf(stderr,
+            "Modules of '%s' are not mapped when tracing starts. Follow "
+            "maps with -L or AFLCS_FOLLOW_MAPS to trace libraries\n",
+            trace_modules);
+    goto exit;
+  }
+
+  /* Both would program the start comparator of the ETMs. */
+  if (trace_start_point && (persistent_start != 0 || persistent_end != 0)) {
+    fprintf(stderr, "A trace start point cannot be combined with a "
+                    "persistent loop\n");
+    goto exit;
+  }
+
+  if (persistent_start != 0 && persistent_end != 0) {
+    etm_start_addr = resolve_trace_addr(persistent_start);
+    etm_stop_addr = resolve_trace_addr(persistent_end);
+    if (registration_verbose > 0) {
+      fprintf(stderr, "Persistent loop: 0x%lx-0x%lx\n", etm_start_addr,
+              etm_stop_addr);
+    }
+  }
+
+  if (trace_start_point) {
+    if (resolve_trace_point(trace_start_point, &etm_start_addr) < 0) {
+      fprintf(stderr, "Failed to resolve trace start point '%s'\n",
+              trace_start_point);
+      goto exit;
+    }
+    if (registration_verbose > 0) {
+      fprintf(stderr, "Trace start point: 0x%lx\n", etm_start_addr);
+    }
+  }
+
+  /* The broker owns the board. The ETM is set up when the first session
+   * registers this client. */
+  if (!broker_name && setup_trace_board() < 0) {
+    fprintf(stderr, "setup_trace_board() failed\n");
     goto exit;
   }
 
@@ -733,12 +2600,101 @@ int init_trace(pid_t parent_pid, pid_t pid)
     goto exit;
   }
 
+  if (stream_export_on && (zero_copy_on || !trace_export_on)) {
+    if (trace_export_on) {
+      fprintf(stderr, "INFO: Streaming export requires copy mode. Disabled\n");
+    }
+    stream_export_on = false;
+  }
+#ifndef HAVE_ZSTD
+  if (stream_export_on) {
+    fprintf(stderr, "INFO: Built without zstd. Streamed trace is written "
+                    "uncompressed\n");
+  }
+#endif
+  /* Trace is appended as it is fetched, since the chunks are recycled and
+   * the ETR buffer is reused. */
+  if (trace_export_on) {
+    if (open_trace_file(&trace_file, DEFAULT_TRACE_NAME, trace_id,
+                        board_name) < 0) {
+      fprintf(stderr, "open_trace_file() failed\n");
+      goto exit;
+    }
+    if (stream_export_on &&
+        start_trace_writer(&trace_writer, &trace_file, &trace_pool) < 0) {
+      fprintf(stderr, "start_trace_writer() failed\n");
+      goto exit;
+    }
+  }
+
+  if (decoding_on && (decode_node >= 0 || preload_images_on)) {
+    getrusage(RUSAGE_SELF, &usage_before);
+    if (load_map_images(map_info, range_count, decode_node,
+                        preload_images_on) < 0) {
+      fprintf(stderr, "load_map_images() failed\n");
+      goto exit;
+    }
+    getrusage(RUSAGE_SELF, &usage_after);
+    if (registration_verbose > 0) {
+      fprintf(stderr, "Loading images faulted %ld pages (%ld major)\n",
+              (usage_after.ru_minflt - usage_before.ru_minflt) +
+                  (usage_after.ru_majflt - usage_before.ru_majflt),
+              usage_after.ru_majflt - usage_before.ru_majflt);
+    }
+  }
+
+  if (decoding_on && decode_node >= 0) {
+    bind_trace_bitmap(decode_node);
+  }
+
   if (decoding_on) {
     decoder = init_decoder(map_info, range_count);
     if (!decoder) {
       fprintf(stderr, "init_decoder() failed\n");
       goto exit;
     }
+    if (multi_core_on && init_cpu_decoders() < 0) {
+      fprintf(stderr, "init_cpu_decoders() failed\n");
+      goto exit;
+    }
+    if (parallel_decode_on &&
+        init_parallel_decoder(&parallel_decoder, decode_jobs,
+                              trace_bitmap_size, range_count, mem_img) < 0) {
+      fprintf(stderr, "init_parallel_decoder() failed\n");
+      goto exit;
+    }
+    if (trace_memo_size > 0 &&
+        init_trace_memo(&trace_memo, TRACE_MEMO_ENTRIES, trace_memo_size) <
+            0) {
+      fprintf(stderr, "init_trace_memo() failed\n");
+      goto exit;
+    }
+    if (decode_workers > 0) {
+      if (init_decode_pool(&decode_pool, decode_workers,
+                           multi_core_on ? nr_trace_cpus : 1) < 0) {
+        fprintf(stderr, "Failed to start decode workers\n");
+        goto exit;
+      }
+      /* In multi-core mode each CPU is a stream of its own. */
+      for (i = 0; multi_core_on && i < nr_trace_cpus; i++) {
+        if (add_decode_stream(&decode_pool, &cpu_decoders[i].stream,
+                              &cpu_decoders[i], decode_cpu_chunk) < 0) {
+          fprintf(stderr, "Failed to start decode workers\n");
+          goto exit;
+        }
+      }
+      if (!multi_core_on && add_decode_stream(&decode_pool, &trace_stream,
+                                              NULL, decode_stream_chunk) < 0) {
+        fprintf(stderr, "Failed to start decode workers\n");
+        goto exit;
+      }
+      for (i = 0; decode_node >= 0 && i < decode_pool.nr_workers; i++) {
+        if (set_pthread_node_affinity(decode_node,
+                                      decode_pool.workers[i].thread) < 0) {
+          fprintf(stderr, "set_pthread_node_affinity() failed\n");
+        }
+      }
+    }
     ret = pthread_create(&decoder_thread, NULL, decoder_worker, NULL);
     if (ret != 0) {
       fprintf(stderr, "pthread_create() failed: %d\n", ret);
@@ -749,21 +2705,34 @@ int init_trace(pid_t parent_pid, pid_t pid)
      * Marvell ThunderX2. The tracee process and the decoder thread should be
      * in the same CPU core group. DEFAULT_DECODER_CPU fallback is -1.
      */
-    if ((decoder_cpu = get_preferred_cpu(pid)) < 0) {
+    if (decode_node >= 0) {
+      decoder_cpu = get_preferred_node_cpu(pid, decode_node);
+    } else {
+      decoder_cpu = get_preferred_cpu(pid);
+    }
+    if (decoder_cpu < 0) {
       decoder_cpu = DEFAULT_DECODER_CPU;
     }
     if (decoder_cpu >= 0) {
       if (set_pthread_cpu_affinity(decoder_cpu, decoder_thread) < 0) {
         fprintf(stderr, "set_pthread_cpu_affinity() failed");
       }
+    } else if (decode_node >= 0) {
+      if (set_pthread_node_affinity(decode_node, decoder_thread) < 0) {
+        fprintf(stderr, "set_pthread_node_affinity() failed\n");
+      }
     }
   }
 
+  if (numa_on && registration_verbose > 0) {
+    dump_numa_layout(stderr);
+  }
+
   set_trace_state(ready_state);
   ret = 0;
 
 exit:
-  if (ret != 0) {
+  if (ret != 0 && !broker_name) {
     cs_shutdown();
   }
 
@@ -777,11 +2746,27 @@ void fini_trace(void)
     /* Cancel decoder_thread. Assuming stop singal is sent prior to it. */
     set_trace_state(fini_state);
     pthread_join(decoder_thread, NULL);
+    if (decode_workers > 0) {
+      wait_decode_pool(&decode_pool);
+      if (registration_verbose > 0) {
+        dump_decode_pool_stats(stderr, &decode_pool);
+      }
+      fini_decode_pool(&decode_pool);
+    }
+    if (trace_memo.entries) {
+      if (registration_verbose > 0) {
+        dump_trace_memo_stats(stderr, &trace_memo);
+      }
+      fini_trace_memo(&trace_memo);
+    }
   } else {
     fetch_trace();
   }
 
-  export_trace(DEFAULT_TRACE_NAME, DEFAULT_TRACE_ARGS_NAME);
+  if (trace_export_on) {
+    export_trace(DEFAULT_TRACE_NAME, DEFAULT_RAW_TRACE_NAME,
+                 DEFAULT_TRACE_ARGS_NAME);
+  }
 
   if (registration_verbose > 0) {
     dump_map_info(stderr, map_info, range_count);
@@ -789,15 +2774,21 @@ void fini_trace(void)
 
   fini_decoder();
 
-  free_trace_buf();
+  if (devices.etb) {
+    cs_empty_trace_buffer(devices.etb);
+  }
+
+  fini_trace_pool(&trace_pool);
 
-  cs_shutdown();
+  if (zero_copy_on) {
+    close_udmabuf(&etr_udmabuf);
+  }
 
-  pthread_cond_destroy(&trace_decoder_cond);
-  pthread_mutex_destroy(&trace_decoder_mutex);
+  if (broker_name) {
+    close_broker_client(&broker_client);
+  } else {
+    cs_shutdown();
+  }
 
-  pthread_cond_destroy(&trace_event_cond);
-  pthread_mutex_destroy(&trace_event_mutex);
-  pthread_mutex_destroy(&trace_state_mutex);
   pthread_mutex_destroy(&trace_mutex);
 }
@@ -20,6 +20,15 @@
 
 const bool return_stack = false;
 
+/* TRCSYNCPR.PERIOD: an A-sync every 2^N bytes of trace, or 0 for none. */
+int etm_sync_period = 0;
+
+/* ViewInst start and stop points, or 0 for none. Trace is off from the stop
+ * point, or from the start of each process, until the start point is
+ * executed. */
+unsigned long etm_start_addr = 0;
+unsigned long etm_stop_addr = 0;
+
 extern unsigned long etr_ram_addr;
 extern size_t etr_ram_size;
 extern int registration_verbose;
@@ -41,6 +50,50 @@ void cs_etb_flush_and_wait_stop(struct cs_devices_t *devices)
   }
 }
 
+/* Make a manual flush leave the sink capturing, or stop it. */
+void set_trace_stop_on_flush(struct cs_devices_t *devices, bool stop)
+{
+  unsigned int ffcr_val;
+
+  ffcr_val = cs_device_read(devices->etb, CS_ETB_FLFMT_CTRL);
+  if (stop) {
+    ffcr_val |= CS_ETB_FLFMT_CTRL_StopFl;
+  } else {
+    ffcr_val &= ~CS_ETB_FLFMT_CTRL_StopFl;
+  }
+  cs_device_write(devices->etb, CS_ETB_FLFMT_CTRL, ffcr_val);
+}
+
+/* Clear the sticky Full status of the stopped ETR. Its RWP and buffer are
+ * left as they are. */
+void clear_trace_sink_full(struct cs_devices_t *devices)
+{
+  unsigned int sts_val;
+
+  sts_val = cs_device_read(devices->etb, CS_ETB_STATUS);
+  cs_device_write(devices->etb, CS_ETB_STATUS, sts_val & ~CS_ETB_STATUS_Full);
+}
+
+/* Push the trace held in the ETF and the formatter out to the ETR without
+ * stopping capture. Stop on flush must be off. */
+int flush_trace_sinks(struct cs_devices_t *devices)
+{
+  unsigned int ffcr_val;
+
+  ffcr_val = cs_device_read(devices->etb, CS_ETB_FLFMT_CTRL);
+  cs_device_write(devices->etb, CS_ETB_FLFMT_CTRL,
+                  ffcr_val | CS_ETB_FLFMT_CTRL_FOnMan);
+  /* FOnMan reads as 1 until the flush completes. */
+  if (cs_device_wait(devices->etb, CS_ETB_FLFMT_CTRL,
+                     CS_ETB_FLFMT_CTRL_FOnMan, CS_REG_WAITBITS_ALL_0, 0,
+                     &ffcr_val) != 0) {
+    fprintf(stderr, "Manual flush not completed. FFCR: 0x%08x\n", ffcr_val);
+    return -1;
+  }
+
+  return 0;
+}
+
 void show_etm_config(cs_device_t etm)
 {
   cs_etmv4_config_t t4config; /* ETMv4 config */
@@ -57,44 +110,150 @@ void show_etm_config(cs_device_t etm)
   cs_etm_config_print_ex(etm, p_config);
 }
 
-static void set_etmv4_addr_range(struct map_info *range,
-                                 struct _adrcmp *addr_comp,
-                                 unsigned int acc_type_ex)
+#define ETMV4_ADDR_RANGE_MAX (ETMv4_NUM_ADDR_COMP_MAX / 2)
+
+struct addr_range {
+  unsigned long start;
+  unsigned long end;
+};
+
+static void set_etmv4_addr_comp(unsigned long addr, struct _adrcmp *addr_comp,
+                                unsigned int acc_type_ex)
 {
   const unsigned int acc_type =
       CS_ETMV4_ACATR_ExEL0_S | CS_ETMV4_ACATR_ExEL1_S | CS_ETMV4_ACATR_ExEL2_S |
       CS_ETMV4_ACATR_ExEL1_NS | CS_ETMV4_ACATR_ExEL2_NS | acc_type_ex;
 
+  addr_comp->acvr_l = addr & 0xFFFFFFFF;
+  addr_comp->acvr_h = (addr >> 32) & 0xFFFFFFFF;
+  addr_comp->acatr_l = acc_type;
+}
+
+static void set_etmv4_addr_range(struct addr_range *range,
+                                 struct _adrcmp *addr_comp,
+                                 unsigned int acc_type_ex)
+{
   if (!range || !addr_comp) {
     return;
   }
 
-  addr_comp[0].acvr_l = range->start & 0xFFFFFFFF;
-  addr_comp[0].acvr_h = (range->start >> 32) & 0xFFFFFFFF;
-  addr_comp[0].acatr_l = acc_type;
-  addr_comp[1].acvr_l = range->end & 0xFFFFFFFF;
-  addr_comp[1].acvr_h = (range->end >> 32) & 0xFFFFFFFF;
-  addr_comp[1].acatr_l = acc_type;
+  set_etmv4_addr_comp(range->start, &addr_comp[0], acc_type_ex);
+  set_etmv4_addr_comp(range->end, &addr_comp[1], acc_type_ex);
+}
+
+/* Address range count last warned about, to warn once per overflow. */
+static int range_overflow_count = 0;
+
+/* Fit the traced ranges into max comparator pairs. Overlapping and touching
+ * ranges are joined. Ranges past those that fit are not traced, since
+ * merging neighbours would trace the code between them too, for which the
+ * decoder has no image. */
+static int merge_addr_ranges(struct map_info *range, int range_count,
+                             struct addr_range *merged, int max)
+{
+  int dropped;
+  int count;
+  int i;
+  int j;
+
+  count = 0;
+  dropped = 0;
+  for (i = 0; i < range_count; i++) {
+    for (j = 0; j < count; j++) {
+      if (range[i].start <= merged[j].end &&
+          range[i].end >= merged[j].start) {
+        break;
+      }
+    }
+    if (j < count) {
+      if (range[i].start < merged[j].start) {
+        merged[j].start = range[i].start;
+      }
+      if (range[i].end > merged[j].end) {
+        merged[j].end = range[i].end;
+      }
+      continue;
+    }
+    if (count == max) {
+      dropped++;
+      continue;
+    }
+    merged[count].start = range[i].start;
+    merged[count].end = range[i].end;
+    count++;
+  }
+
+  if (dropped > 0 && count + dropped != range_overflow_count) {
+    fprintf(stderr,
+            "WARNING: %d address ranges exceed the %d the ETM can match. "
+            "Not tracing the last %d\n",
+            count + dropped, max, dropped);
+    range_overflow_count = count + dropped;
+  }
+
+  return count;
 }
 
+/* TRCRSCTLRn.GROUP of the context ID comparators. */
+#define ETMV4_RS_GROUP_CID (0x6 << 16)
+/* The resource selector that ORs the context ID comparators. Resources 0 and
+ * 1 are fixed to FALSE and TRUE. */
+#define ETMV4_RS_CID 2
+
+/* Context ID count last warned about, to warn once per overflow. */
+static int cid_overflow_count = 0;
+
 static int configure_etmv4_addr_range_cid(cs_device_t etm,
                                           struct map_info *range,
-                                          int range_count, unsigned long cid)
+                                          int range_count, const pid_t *cids,
+                                          int cid_count)
 {
   cs_etmv4_config_t tconfig;
+  struct addr_range merged[ETMV4_ADDR_RANGE_MAX];
+  int merged_count;
+  int max_ranges;
+  int max_cids;
   int error_count;
-  size_t cididx;
+  size_t cididx = 0;
   size_t addridx;
+  unsigned int acc_type_ex;
+  bool start_stop;
+  int i;
 
   /* default settings are trace everything - already set. */
   cs_etm_config_init_ex(etm, &tconfig);
   tconfig.flags = CS_ETMC_TRACE_ENABLE | CS_ETMC_CONFIG | CS_ETMC_EVENTSELECT;
   cs_etm_config_get_ex(etm, &tconfig);
 
+  /* More than one context ID is matched by a resource selector over the
+   * context ID comparators, which needs a selector pair beyond the fixed
+   * one. IDs past those the ETM can match exactly are not traced, since
+   * matching more would trace other processes too. Comparators of exited
+   * IDs are reused by later updates. */
+  if (cid_count > 1) {
+    max_cids = tconfig.scv4->idr4.bits.numcidc;
+    if (max_cids > ETMv4_NUM_CXID_COMP_MAX) {
+      max_cids = ETMv4_NUM_CXID_COMP_MAX;
+    }
+    if (tconfig.scv4->idr4.bits.numrspair == 0) {
+      max_cids = 1;
+    }
+    if (cid_count > max_cids) {
+      if (cid_count != cid_overflow_count) {
+        fprintf(stderr,
+                "WARNING: %d context IDs exceed the %d the ETM can match. "
+                "Not tracing the last %d\n",
+                cid_count, max_cids, cid_count - max_cids);
+        cid_overflow_count = cid_count;
+      }
+      cid_count = max_cids;
+    }
+  }
+
   if (tconfig.scv4->idr2.bits.vmidsize > 0)
     /* XXX: VMID trace must be disabled to use context ID trace only. */
     tconfig.configr.bits.vmid = 0;
-  if (tconfig.scv4->idr2.bits.cidsize > 0 && cid > 0) {
+  if (tconfig.scv4->idr2.bits.cidsize > 0 && cid_count > 0) {
     tconfig.configr.bits.cid = 1; /* context ID trace enable. */
   } else {
     tconfig.configr.bits.cid = 0; /* context ID trace disable. */
@@ -102,22 +261,76 @@ static int configure_etmv4_addr_range_cid(cs_device_t etm,
 
   if (return_stack) tconfig.configr.bits.rs = 1; /* set the return stack */
 
-  if (cid > 0) {
-    cididx = 0;
-    tconfig.cxid_comps[cididx].cidcvr_l = cid & 0xFFFFFFFF;
-    tconfig.cxid_comps[cididx].cidcvr_h = (cid >> 32) & 0xFFFFFFFF;
-    tconfig.cidcctlr0 &= ~(1 << cididx);
-    tconfig.cxid_comps_acc_mask |= (1 << cididx);
+  for (i = 0; i < cid_count; i++) {
+    tconfig.cxid_comps[i].cidcvr_l = (unsigned long)cids[i] & 0xFFFFFFFF;
+    tconfig.cxid_comps[i].cidcvr_h = 0;
+    if (i < 4) {
+      tconfig.cidcctlr0 &= ~(0xffU << (i * 8));
+    } else {
+      tconfig.cidcctlr1 &= ~(0xffU << ((i - 4) * 8));
+    }
+    tconfig.cxid_comps_acc_mask |= (1 << i);
     tconfig.flags |= CS_ETMC_CXID_COMP;
   }
 
-  addridx = 0;
-  /* XXX: Assuming range[0] is the tracee itself. */
-  /* Set and enable Context ID filtering */
-  set_etmv4_addr_range(&range[0], &tconfig.addr_comps[addridx],
-                       cid > 0 ? (cididx << 4) | (0x1 << 2) : 0);
-  tconfig.addr_comps_acc_mask |= 0x3 << addridx;
-  tconfig.viiectlr |= 1 << (addridx / 2);
+  /* TRCVICTLR.EVENT: the resource that gates ViewInst. */
+  tconfig.victlr &= ~0xffU;
+  if (cid_count > 1) {
+    tconfig.rsctlr[ETMV4_RS_CID] = ETMV4_RS_GROUP_CID | ((1U << cid_count) - 1);
+    tconfig.rsctlr_acc_mask |= 1U << ETMV4_RS_CID;
+    tconfig.flags |= CS_ETMC_RES_SEL;
+    tconfig.victlr |= ETMV4_RS_CID;
+  } else {
+    tconfig.victlr |= 0x1; /* Always true. */
+  }
+
+  /* Use as many address comparator pairs as the ETM implements. */
+  max_ranges = tconfig.scv4->idr4.bits.numacpairs;
+  if (max_ranges > ETMV4_ADDR_RANGE_MAX) {
+    max_ranges = ETMV4_ADDR_RANGE_MAX;
+  }
+  if (max_ranges == 0) {
+    fprintf(stderr, "ETM has no address comparators\n");
+    return -1;
+  }
+  /* The start and stop points take the last pair as single comparators. */
+  start_stop = etm_start_addr != 0;
+  if (start_stop && --max_ranges == 0) {
+    fprintf(stderr, "ETM has no address comparators for start/stop points\n");
+    return -1;
+  }
+  merged_count = merge_addr_ranges(range, range_count, merged, max_ranges);
+
+  /* Set and enable Context ID filtering. A single context ID qualifies the
+   * address comparators themselves. */
+  acc_type_ex = cid_count == 1 ? (cididx << 4) | (0x1 << 2) : 0;
+  tconfig.viiectlr &= ~0xffU; /* Drop the include ranges set before. */
+  for (i = 0; i < merged_count; i++) {
+    addridx = i * 2;
+    set_etmv4_addr_range(&merged[i], &tconfig.addr_comps[addridx],
+                         acc_type_ex);
+    tconfig.addr_comps_acc_mask |= 0x3 << addridx;
+    tconfig.viiectlr |= 1 << (addridx / 2);
+  }
+
+  if (start_stop) {
+    addridx = max_ranges * 2;
+    set_etmv4_addr_comp(etm_start_addr, &tconfig.addr_comps[addridx],
+                        acc_type_ex);
+    tconfig.addr_comps_acc_mask |= 0x1 << addridx;
+    /* TRCVISSCTLR: START[15:0] and STOP[31:16] select single comparators. */
+    tconfig.vissctlr = 1U << addridx;
+    if (etm_stop_addr != 0) {
+      set_etmv4_addr_comp(etm_stop_addr, &tconfig.addr_comps[addridx + 1],
+                          acc_type_ex);
+      tconfig.addr_comps_acc_mask |= 0x1 << (addridx + 1);
+      tconfig.vissctlr |= 1U << (addridx + 1 + 16);
+    }
+    tconfig.victlr &= ~(1U << 9); /* SSSTATUS: stopped until the start. */
+  } else {
+    tconfig.vissctlr = 0;
+    tconfig.victlr |= 1U << 9; /* SSSTATUS: started. */
+  }
 
   tconfig.flags |= CS_ETMC_ADDR_COMP;
 
@@ -174,14 +387,15 @@ int init_etm(cs_device_t dev)
   v4config.eventctlr1r = 0;
   /* config */
   v4config.stallcrlr = (1 << 13); /* NOOVERFLOW */
-  v4config.syncpr = 0;            /* no sync */
+  v4config.syncpr = etm_sync_period; /* periodic sync */
   cs_etm_config_put_ex(dev, &v4config);
 
   return 0;
 }
 
 int configure_trace(const struct board *board, struct cs_devices_t *devices,
-                    struct map_info *range, int range_count, pid_t pid)
+                    struct map_info *range, int range_count, const pid_t *cids,
+                    int cid_count)
 {
   int i, r, error_count;
 
@@ -214,7 +428,7 @@ int configure_trace(const struct board *board, struct cs_devices_t *devices,
     if (CS_ETMVERSION_MAJOR(cs_etm_get_version(devices->ptm[i])) >=
         CS_ETMVERSION_ETMv4) {
       r = configure_etmv4_addr_range_cid(devices->ptm[i], range, range_count,
-                                         (unsigned long)pid);
+                                         cids, cid_count);
     } else {
       fprintf(stderr, "Unsupported ETM for CPU #%d\n", i);
       continue;
@@ -238,6 +452,98 @@ int configure_trace(const struct board *board, struct cs_devices_t *devices,
   return 0;
 }
 
+/* Reprogram the address range and context ID filters of the ETM of cpu. The
+ * ETM is disabled while it is programmed. */
+int update_cpu_trace_ranges(const struct board *board,
+                            struct cs_devices_t *devices, int cpu,
+                            struct map_info *range, int range_count,
+                            const pid_t *cids, int cid_count)
+{
+  int r;
+
+  if (!board || !devices || cpu < 0 || cpu >= board->n_cpu) {
+    return -1;
+  }
+
+  if (CS_ETMVERSION_MAJOR(cs_etm_get_version(devices->ptm[cpu])) <
+      CS_ETMVERSION_ETMv4) {
+    return 0;
+  }
+  cs_trace_disable(devices->ptm[cpu]);
+  r = configure_etmv4_addr_range_cid(devices->ptm[cpu], range, range_count,
+                                     cids, cid_count);
+  cs_trace_enable(devices->ptm[cpu]);
+
+  return r;
+}
+
+/* Reprogram the address range and context ID filters of configured ETMs.
+ * Each ETM is disabled while it is programmed, so the sinks may keep
+ * running. */
+int update_trace_ranges(const struct board *board,
+                        struct cs_devices_t *devices, struct map_info *range,
+                        int range_count, const pid_t *cids, int cid_count)
+{
+  int i, r, error_count;
+
+  if (!board || !devices) {
+    return -1;
+  }
+
+  for (i = 0; i < board->n_cpu; ++i) {
+    r = update_cpu_trace_ranges(board, devices, i, range, range_count, cids,
+                                cid_count);
+    if (r != 0) return r;
+  }
+
+  cs_checkpoint();
+
+  error_count = cs_error_count();
+  if (error_count > 0) {
+    fprintf(stderr, "%u errors reported when updating trace ranges\n",
+            error_count);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Put the ViewInst start/stop logic of configured ETMs back into the stopped
+ * state, so that a new process is traced from the start point on. The sinks
+ * must be disabled. */
+int rearm_trace_start(const struct board *board, struct cs_devices_t *devices)
+{
+  cs_etmv4_config_t tconfig;
+  int i, error_count;
+
+  if (!board || !devices) {
+    return -1;
+  }
+
+  for (i = 0; i < board->n_cpu; ++i) {
+    if (CS_ETMVERSION_MAJOR(cs_etm_get_version(devices->ptm[i])) <
+        CS_ETMVERSION_ETMv4) {
+      continue;
+    }
+    cs_trace_disable(devices->ptm[i]);
+    cs_etm_config_init_ex(devices->ptm[i], &tconfig);
+    tconfig.flags = CS_ETMC_TRACE_ENABLE;
+    cs_etm_config_get_ex(devices->ptm[i], &tconfig);
+    tconfig.victlr &= ~(1U << 9); /* SSSTATUS: stopped until the start. */
+    cs_etm_config_put_ex(devices->ptm[i], &tconfig);
+    cs_trace_enable(devices->ptm[i]);
+  }
+
+  error_count = cs_error_count();
+  if (error_count > 0) {
+    fprintf(stderr, "%u errors reported when rearming trace start\n",
+            error_count);
+    return -1;
+  }
+
+  return 0;
+}
+
 int enable_trace(const struct board *board, struct cs_devices_t *devices)
 {
   int i, error_count;
@@ -0,0 +1,222 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "coverage.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * libcsdec increments the bitmap it was given for every edge, so the edges
+ * themselves cannot be intercepted. Instead the decoder is given an anonymous
+ * mapping of the bitmap size. Pages it never writes stay unpopulated, which
+ * mincore() tells apart, so a flush only scans the pages the decoder has
+ * touched. The mapping opts out of transparent huge pages, which would make
+ * a single write populate 2 MiB. A page the decoder only read maps the zero
+ * page and looks resident as well, but scanning it finds nothing to add.
+ * The nonzero words of the scanned pages are collected in ascending order and
+ * then added to the real bitmap eight counters at a time. Only those words
+ * are zeroed again, so the pages stay resident and the decoder does not fault
+ * them in on the next round. The scan therefore covers every page touched
+ * since the mapping was created, which settles once the hot edges are known.
+ */
+
+#define COVERAGE_PREFETCH_DISTANCE 8
+
+static size_t page_size;
+
+int init_coverage_buf(struct coverage_buf *cov, size_t size)
+{
+  size_t nr_pages;
+  void *buf;
+
+  if (!cov || size == 0) {
+    return -1;
+  }
+
+  if (page_size == 0) {
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+  }
+
+  memset(cov, 0, sizeof(struct coverage_buf));
+  cov->map_size = size;
+  cov->size = (size + page_size - 1) & ~(page_size - 1);
+  nr_pages = cov->size / page_size;
+
+  buf = mmap(NULL, cov->size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  cov->buf = (unsigned char *)buf;
+  if (madvise(buf, cov->size, MADV_NOHUGEPAGE) < 0) {
+    perror("madvise");
+  }
+
+  cov->resident = malloc(nr_pages);
+  cov->touched = malloc(sizeof(uint32_t) * (cov->size / sizeof(uint64_t)));
+  if (!cov->resident || !cov->touched) {
+    perror("malloc");
+    fini_coverage_buf(cov);
+    return -1;
+  }
+
+  return 0;
+}
+
+void fini_coverage_buf(struct coverage_buf *cov)
+{
+  if (!cov) {
+    return;
+  }
+
+  if (cov->buf) {
+    munmap(cov->buf, cov->size);
+  }
+  free(cov->resident);
+  free(cov->touched);
+  memset(cov, 0, sizeof(struct coverage_buf));
+}
+
+/* Collect the indices of the nonzero words of the touched pages into
+ * cov->touched, in ascending order. */
+int harvest_coverage_buf(struct coverage_buf *cov)
+{
+  const uint64_t *words;
+  size_t words_per_page;
+  size_t nr_pages;
+  size_t p;
+  size_t w;
+
+  nr_pages = cov->size / page_size;
+  words_per_page = page_size / sizeof(uint64_t);
+  words = (const uint64_t *)cov->buf;
+  cov->nr_touched = 0;
+
+  if (mincore(cov->buf, cov->size, cov->resident) < 0) {
+    perror("mincore");
+    return -1;
+  }
+
+  for (p = 0; p < nr_pages; p++) {
+    if (!(cov->resident[p] & 1)) {
+      continue;
+    }
+    for (w = p * words_per_page; w < (p + 1) * words_per_page; w++) {
+      if (words[w]) {
+        cov->touched[cov->nr_touched++] = (uint32_t)w;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Add the harvested words of cov to bitmap, or subtract them with sub. */
+static void merge_coverage_buf(struct coverage_buf *cov, unsigned char *bitmap,
+                               bool sub)
+{
+  const uint64_t *src;
+  size_t nr_words;
+  size_t i;
+  size_t j;
+  uint64_t dst;
+  uint32_t w;
+
+  src = (const uint64_t *)cov->buf;
+  nr_words = cov->map_size / sizeof(uint64_t);
+
+  for (i = 0; i < cov->nr_touched; i++) {
+    if (i + COVERAGE_PREFETCH_DISTANCE < cov->nr_touched) {
+      __builtin_prefetch(
+          bitmap + (size_t)cov->touched[i + COVERAGE_PREFETCH_DISTANCE] *
+                       sizeof(uint64_t),
+          1);
+    }
+    w = cov->touched[i];
+    if (w < nr_words) {
+      memcpy(&dst, bitmap + (size_t)w * sizeof(uint64_t), sizeof(dst));
+      dst = sub ? sub_coverage_counters(dst, src[w])
+                : add_coverage_counters(dst, src[w]);
+      memcpy(bitmap + (size_t)w * sizeof(uint64_t), &dst, sizeof(dst));
+    } else {
+      /* Trailing bytes of a bitmap that is not a multiple of words. */
+      for (j = (size_t)w * sizeof(uint64_t); j < cov->map_size; j++) {
+        if (sub) {
+          bitmap[j] -= cov->buf[j];
+        } else {
+          bitmap[j] += cov->buf[j];
+        }
+      }
+    }
+  }
+}
+
+/* Add the harvested words of cov to bitmap. */
+void apply_coverage_buf(struct coverage_buf *cov, unsigned char *bitmap)
+{
+  merge_coverage_buf(cov, bitmap, false);
+}
+
+/* Zero the words found by the last harvest. */
+void clear_coverage_buf(struct coverage_buf *cov)
+{
+  size_t nr_words;
+  size_t i;
+  uint32_t w;
+
+  nr_words = cov->map_size / sizeof(uint64_t);
+  for (i = 0; i < cov->nr_touched; i++) {
+    w = cov->touched[i];
+    if (w < nr_words) {
+      memset(cov->buf + (size_t)w * sizeof(uint64_t), 0, sizeof(uint64_t));
+    } else {
+      memset(cov->buf + (size_t)w * sizeof(uint64_t), 0,
+             cov->map_size - (size_t)w * sizeof(uint64_t));
+    }
+  }
+  cov->nr_touched = 0;
+}
+
+/* Add the counters of cov to bitmap and clear cov. Returns the number of
+ * bitmap words updated. */
+size_t flush_coverage_buf(struct coverage_buf *cov, unsigned char *bitmap)
+{
+  size_t nr_touched;
+
+  if (!cov || !cov->buf || harvest_coverage_buf(cov) < 0) {
+    return 0;
+  }
+
+  apply_coverage_buf(cov, bitmap);
+  nr_touched = cov->nr_touched;
+  clear_coverage_buf(cov);
+
+  return nr_touched;
+}
+
+/* Subtract the counters of cov from bitmap and clear cov, undoing what a
+ * flush of the same counters would add. */
+size_t retract_coverage_buf(struct coverage_buf *cov, unsigned char *bitmap)
+{
+  size_t nr_touched;
+
+  if (!cov || !cov->buf || harvest_coverage_buf(cov) < 0) {
+    return 0;
+  }
+
+  merge_coverage_buf(cov, bitmap, true);
+  nr_touched = cov->nr_touched;
+  clear_coverage_buf(cov);
+
+  return nr_touched;
+}
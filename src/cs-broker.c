@@ -0,0 +1,476 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include <sys/types.h>
+
+#include "csaccess.h"
+#include "csregistration.h"
+#include "csregisters.h"
+
+#include "common.h"
+#include "config.h"
+#include "trace-broker.h"
+#include "utils.h"
+
+#define BROKER_IDLE_USLEEP 20
+/* Dead clients are looked for once in this many idle loops. */
+#define BROKER_REAP_INTERVAL 1024
+#define BROKER_TRACE_ID_MAX 0x6f
+/* A client decoder restarts at the next A-sync after a gap in its ring, so
+ * the ETMs must emit them periodically. */
+#define BROKER_SYNC_PERIOD 14
+#define BROKER_SYNC_PERIOD_MIN 8
+#define BROKER_SYNC_PERIOD_MAX 20
+
+extern int registration_verbose;
+extern int etm_sync_period;
+
+extern char *board_name;
+extern const struct board *board;
+extern struct cs_devices_t devices;
+extern int udmabuf_num;
+extern unsigned long etr_ram_addr;
+extern size_t etr_ram_size;
+
+static volatile sig_atomic_t broker_stop = 0;
+static char *shm_name = TRACE_BROKER_DEFAULT_NAME;
+static size_t ring_size = TRACE_BROKER_DEFAULT_RING_SIZE;
+static struct trace_broker broker;
+static struct deformat_demux demux;
+static struct broker_stream streams[TRACE_BROKER_CLIENTS_MAX];
+static struct udmabuf etr_udmabuf;
+static size_t etr_read_offset = 0;
+/* Bytes the ETR has written and the broker has consumed. The RWP alone cannot
+ * tell a lap from a short backlog. */
+static uint64_t etr_write_count = 0;
+static uint64_t etr_read_count = 0;
+static size_t etr_last_write_offset = 0;
+
+static void handle_stop_signal(int sig) { broker_stop = 1; }
+
+/* Enable the sinks and leave every ETM disabled until a client asks for its
+ * CPU. A flush must not stop the sinks, which are shared. */
+static int setup_broker_sink(void)
+{
+  int i;
+
+  if (get_udmabuf_info(udmabuf_num, &etr_ram_addr, &etr_ram_size) < 0) {
+    fprintf(stderr, "Failed to get u-dma-buf info\n");
+    return -1;
+  }
+  if (open_udmabuf(udmabuf_num, &etr_udmabuf) < 0) {
+    fprintf(stderr, "open_udmabuf() failed\n");
+    return -1;
+  }
+  if (setup_trace_board() < 0) {
+    fprintf(stderr, "setup_trace_board() failed\n");
+    return -1;
+  }
+  if (configure_trace(board, &devices, NULL, 0, NULL, 0) < 0) {
+    fprintf(stderr, "configure_trace() failed\n");
+    return -1;
+  }
+  if (enable_trace(board, &devices) < 0) {
+    fprintf(stderr, "enable_trace() failed\n");
+    return -1;
+  }
+  for (i = 0; i < board->n_cpu; i++) {
+    cs_trace_disable(devices.ptm[i]);
+  }
+  set_trace_stop_on_flush(&devices, false);
+  init_deformat_demux(&demux);
+
+  etr_read_offset = (size_t)(cs_get_buffer_rwp(devices.etb) - etr_ram_addr);
+  etr_last_write_offset = etr_read_offset;
+
+  return 0;
+}
+
+static bool is_broker_request_valid(int index)
+{
+  struct broker_slot *slot;
+  struct broker_slot *other;
+  int i;
+
+  slot = &broker.shm->slots[index];
+  if (slot->cpu < 0 || slot->cpu >= board->n_cpu || slot->trace_id <= 0 ||
+      slot->trace_id > BROKER_TRACE_ID_MAX || slot->range_count < 0 ||
+      slot->range_count > RANGE_MAX) {
+    return false;
+  }
+
+  for (i = 0; i < TRACE_BROKER_CLIENTS_MAX; i++) {
+    other = &broker.shm->slots[i];
+    if (i == index || atomic_load(&other->state) != broker_slot_active) {
+      continue;
+    }
+    if (other->cpu == slot->cpu || other->trace_id == slot->trace_id) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Program the ETM of the client's CPU under its trace ID. */
+static int activate_broker_slot(int index)
+{
+  struct map_info range[RANGE_MAX];
+  struct broker_slot *slot;
+  pid_t cid;
+  int i;
+
+  slot = &broker.shm->slots[index];
+  memset(range, 0, sizeof(range));
+  for (i = 0; i < slot->range_count; i++) {
+    range[i].start = slot->ranges[i].start;
+    range[i].end = slot->ranges[i].end;
+  }
+
+  cs_trace_disable(devices.ptm[slot->cpu]);
+  if (cs_set_trace_source_id(devices.ptm[slot->cpu], slot->trace_id) < 0) {
+    return -1;
+  }
+  cid = slot->cid;
+  if (update_cpu_trace_ranges(board, &devices, slot->cpu, range,
+                              slot->range_count, &cid, cid > 0 ? 1 : 0) < 0) {
+    fprintf(stderr, "update_cpu_trace_ranges() failed\n");
+    cs_trace_disable(devices.ptm[slot->cpu]);
+    return -1;
+  }
+
+  init_broker_stream(&streams[index]);
+  set_deformat_stream(&demux, slot->trace_id, &streams[index].out);
+
+  return 0;
+}
+
+static void release_broker_slot(int index)
+{
+  struct broker_slot *slot;
+
+  slot = &broker.shm->slots[index];
+  cs_trace_disable(devices.ptm[slot->cpu]);
+  set_deformat_stream(&demux, slot->trace_id, NULL);
+  if (registration_verbose > 0) {
+    dump_broker_slot(stderr, slot);
+  }
+  set_broker_slot_state(slot, broker_slot_free);
+}
+
+static void service_broker_slots(bool reap)
+{
+  struct broker_slot *slot;
+  uint32_t state;
+  int i;
+
+  for (i = 0; i < TRACE_BROKER_CLIENTS_MAX; i++) {
+    slot = &broker.shm->slots[i];
+    state = atomic_load_explicit(&slot->state, memory_order_acquire);
+    if (state == broker_slot_ready) {
+      if (!is_broker_request_valid(i) || activate_broker_slot(i) < 0) {
+        set_broker_slot_state(slot, broker_slot_rejected);
+        continue;
+      }
+      if (registration_verbose > 0) {
+        fprintf(stderr, "Client %d registered CPU #%d with ID 0x%x\n",
+                slot->pid, slot->cpu, slot->trace_id);
+      }
+      set_broker_slot_state(slot, broker_slot_active);
+    } else if (state == broker_slot_closing) {
+      release_broker_slot(i);
+    } else if (state == broker_slot_active && reap && kill(slot->pid, 0) < 0 &&
+               errno == ESRCH) {
+      release_broker_slot(i);
+    }
+  }
+}
+
+static void demux_etr_slice(size_t offset, size_t size)
+{
+  if (sync_udmabuf_for_cpu(&etr_udmabuf, offset, size) < 0) {
+    fprintf(stderr, "sync_udmabuf_for_cpu() failed\n");
+  }
+  demux_broker_trace(&broker, &demux, streams,
+                     (unsigned char *)etr_udmabuf.buf + offset, size);
+  if (sync_udmabuf_for_device(&etr_udmabuf, offset, size) < 0) {
+    fprintf(stderr, "sync_udmabuf_for_device() failed\n");
+  }
+}
+
+/* Add what the ETR wrote since the last call to etr_write_count. The RWP must
+ * move less than a whole buffer between calls, which the broker loop keeps
+ * so by polling without blocking. */
+static void update_etr_write_count(void)
+{
+  size_t write_offset;
+
+  write_offset = (size_t)(cs_get_buffer_rwp(devices.etb) - etr_ram_addr);
+  etr_write_count += (write_offset + etr_udmabuf.size - etr_last_write_offset) %
+                     etr_udmabuf.size;
+  etr_last_write_offset = write_offset;
+}
+
+/* The ETR overwrote trace the broker had not read, so every active client
+ * misses a part of its trace. Reading resumes at the RWP. */
+static void drop_broker_sink(void)
+{
+  int i;
+
+  etr_read_offset = etr_last_write_offset;
+  etr_read_count = etr_write_count;
+  reset_deformat_demux(&demux);
+  for (i = 0; i < TRACE_BROKER_CLIENTS_MAX; i++) {
+    if (atomic_load_explicit(&broker.shm->slots[i].state,
+                             memory_order_acquire) == broker_slot_active) {
+      drop_broker_stream(&broker, &streams[i], i);
+    }
+  }
+}
+
+/* Demultiplex the whole formatter frames the ETR wrote since the last call,
+ * in place. The STS.Full flag is sticky while the ETR runs, so a lap is told
+ * by the byte counts instead. Returns the number of bytes consumed. */
+static size_t drain_broker_sink(void)
+{
+  size_t pending;
+  size_t tail_size;
+
+  update_etr_write_count();
+  pending = (size_t)(etr_write_count - etr_read_count);
+  if (pending > etr_udmabuf.size) {
+    fprintf(stderr,
+            "WARNING: ETR buffer overflowed. %zu bytes of trace dropped\n",
+            pending);
+    drop_broker_sink();
+    return 0;
+  }
+  pending = ALIGN_DOWN(pending, FORMATTER_FRAME_SIZE);
+  if (pending == 0) {
+    return 0;
+  }
+
+  tail_size = etr_udmabuf.size - etr_read_offset;
+  if (pending > tail_size) {
+    demux_etr_slice(etr_read_offset, tail_size);
+    demux_etr_slice(0, pending - tail_size);
+  } else {
+    demux_etr_slice(etr_read_offset, pending);
+  }
+  etr_read_offset = (etr_read_offset + pending) % etr_udmabuf.size;
+  etr_read_count += pending;
+
+  /* The slices were demultiplexed in place, so the ETR must not have reached
+   * them in the meantime. */
+  update_etr_write_count();
+  if (etr_write_count - etr_read_count + pending > etr_udmabuf.size) {
+    fprintf(stderr, "WARNING: ETR lapped the broker. Trace dropped\n");
+    drop_broker_sink();
+  }
+
+  return pending;
+}
+
+/* Answer the flush requests made so far with one flush of the sinks. */
+static bool service_broker_flushes(void)
+{
+  uint32_t req[TRACE_BROKER_CLIENTS_MAX];
+  struct broker_slot *slot;
+  bool pending;
+  int i;
+
+  pending = false;
+  for (i = 0; i < TRACE_BROKER_CLIENTS_MAX; i++) {
+    slot = &broker.shm->slots[i];
+    req[i] = atomic_load_explicit(&slot->flush_req, memory_order_acquire);
+    if (atomic_load_explicit(&slot->state, memory_order_acquire) ==
+            broker_slot_active &&
+        req[i] !=
+            atomic_load_explicit(&slot->flush_ack, memory_order_relaxed)) {
+      pending = true;
+    }
+  }
+  if (!pending) {
+    return false;
+  }
+
+  if (flush_trace_sinks(&devices) < 0) {
+    fprintf(stderr, "flush_trace_sinks() failed\n");
+  }
+  while (drain_broker_sink() > 0) {
+  }
+
+  for (i = 0; i < TRACE_BROKER_CLIENTS_MAX; i++) {
+    slot = &broker.shm->slots[i];
+    if (atomic_load_explicit(&slot->state, memory_order_acquire) !=
+            broker_slot_active ||
+        req[i] ==
+            atomic_load_explicit(&slot->flush_ack, memory_order_relaxed)) {
+      continue;
+    }
+    flush_broker_stream(&broker, &streams[i], i);
+    ack_broker_flush(slot, req[i]);
+  }
+
+  return true;
+}
+
+static void run_broker(void)
+{
+  unsigned long idle_loops;
+  bool busy;
+
+  idle_loops = 0;
+  while (!broker_stop) {
+    service_broker_slots(idle_loops % BROKER_REAP_INTERVAL ==
+                         BROKER_REAP_INTERVAL - 1);
+    busy = drain_broker_sink() > 0;
+    busy |= service_broker_flushes();
+    if (!busy) {
+      idle_loops++;
+      usleep(BROKER_IDLE_USLEEP);
+    }
+  }
+}
+
+static void usage(char *argv0)
+{
+  fprintf(stderr, "Usage: %s [OPTIONS]\n", argv0);
+  fprintf(stderr, "CoreSight trace broker sharing one trace sink\n");
+  fprintf(stderr, "[OPTIONS]\n");
+  fprintf(stderr, "  -b, --board=NAME\t\tspecify board name (default: %s)\n",
+          board_name);
+  fprintf(stderr,
+          "  -n, --name=NAME\t\tshared memory name of the broker (default: "
+          "%s)\n",
+          shm_name);
+  fprintf(stderr,
+          "  -r, --ring-size=SIZE\t\ttrace ring of each client (default: "
+          "0x%zx)\n",
+          ring_size);
+  fprintf(stderr,
+          "  -u, --udmabuf=INT\t\tspecify u-dma-buf device number to use "
+          "(default: %d)\n",
+          udmabuf_num);
+  fprintf(stderr,
+          "  -y, --sync-period=INT\t\temit an A-sync every 2^INT bytes "
+          "of trace, 8-20 (default: %d)\n",
+          etm_sync_period);
+  fprintf(stderr,
+          "  -v, --verbose[=INT]\t\tverbose output level (default: %d)\n",
+          registration_verbose);
+  fprintf(stderr, "  -h, --help\t\t\tshow this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const struct option long_options[] = {
+      {"board", required_argument, NULL, 'b'},
+      {"name", required_argument, NULL, 'n'},
+      {"ring-size", required_argument, NULL, 'r'},
+      {"udmabuf", required_argument, NULL, 'u'},
+      {"sync-period", required_argument, NULL, 'y'},
+      {"verbose", optional_argument, NULL, 'v'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  struct sigaction sa;
+  int opt;
+  int option_index;
+  int ret;
+  int i;
+
+  registration_verbose = 0;
+  etm_sync_period = BROKER_SYNC_PERIOD;
+
+  while ((opt = getopt_long(argc, argv, "b:n:r:u:y:v::h", long_options,
+                            &option_index)) != -1) {
+    switch (opt) {
+      case 'b':
+        board_name = optarg;
+        break;
+      case 'n':
+        shm_name = optarg;
+        break;
+      case 'r':
+        ring_size = strtoul(optarg, NULL, 0);
+        break;
+      case 'u':
+        udmabuf_num = atoi(optarg);
+        break;
+      case 'y':
+        etm_sync_period = atoi(optarg);
+        break;
+      case 'v':
+        if (optarg) {
+          registration_verbose = atoi(optarg);
+        } else {
+          registration_verbose = 1;
+        }
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+        break;
+    }
+  }
+
+  if (etm_sync_period < BROKER_SYNC_PERIOD_MIN ||
+      etm_sync_period > BROKER_SYNC_PERIOD_MAX) {
+    fprintf(stderr, "Invalid sync period: %d\n", etm_sync_period);
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  ret = EXIT_FAILURE;
+
+  if (setup_broker_sink() < 0) {
+    goto exit;
+  }
+  if (create_trace_broker(&broker, shm_name, ring_size) < 0) {
+    fprintf(stderr, "create_trace_broker() failed\n");
+    goto exit;
+  }
+
+  run_broker();
+
+  for (i = 0; i < TRACE_BROKER_CLIENTS_MAX; i++) {
+    if (atomic_load(&broker.shm->slots[i].state) == broker_slot_active) {
+      release_broker_slot(i);
+    }
+  }
+  ret = EXIT_SUCCESS;
+
+exit:
+  destroy_trace_broker(&broker);
+  if (board) {
+    disable_trace(board, &devices);
+  }
+  if (etr_udmabuf.buf) {
+    close_udmabuf(&etr_udmabuf);
+  }
+  cs_shutdown();
+
+  return ret;
+}
@@ -0,0 +1,327 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+/*
+ * LD_PRELOAD shim for targets of cs-proxy.
+ *
+ * Shared-memory test cases: afl-fuzz writes each test case to a shared
+ * mapping instead of its .cur_input file, so a target that reads stdin or a
+ * file given with @@ is handed an in-memory copy of the mapping instead:
+ *
+ *   - stdin is replaced once with a memfd that holds the test case. With a
+ *     forkserver, the forkserver copies the next test case into it before
+ *     each fork, so its children only inherit it;
+ *   - open() and fopen() of AFLCS_SHMEM_FILE, or of any file named
+ *     .cur_input if unset, open the same memfd from its start.
+ *
+ * Mailbox forkserver: if cs-proxy passes a forkserver mailbox, the shim runs
+ * the forkserver itself and talks to cs-proxy through the mailbox instead of
+ * pipes. It forks from the constructor, so cs-proxy passes no mailbox to a
+ * target in deferred or persistent mode.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "afl/config.h"
+#include "afl/types.h"
+
+#include "fsrv-mailbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#define AFLCS_FORKSRV_FD (FORKSRV_FD - 3)
+#define AFL_CUR_INPUT ".cur_input"
+
+static u8 *shmem_fuzz = NULL;
+static const char *shmem_file = NULL;
+
+static int input_fd = -1;
+static u8 *input_map = NULL;
+static u32 input_len = 0;
+static bool is_forkserver = false;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+
+static void map_shmem_fuzz(void)
+{
+  char *id_str;
+
+  if (!(id_str = getenv(SHM_FUZZ_ENV_VAR))) {
+    return;
+  }
+
+#ifdef USEMMAP
+  int shm_fd;
+  void *map;
+
+  if ((shm_fd = shm_open(id_str, O_RDONLY, 0600)) < 0) {
+    perror("shm_open");
+    return;
+  }
+  map = mmap(NULL, MAX_FILE + sizeof(u32), PROT_READ, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return;
+  }
+  shmem_fuzz = (u8 *)map;
+#else
+  void *map;
+
+  map = shmat(atoi(id_str), NULL, SHM_RDONLY);
+  if (map == (void *)-1) {
+    perror("shmat");
+    return;
+  }
+  shmem_fuzz = (u8 *)map;
+#endif
+}
+
+/* Copy the current test case into the memfd and rewind it. The memfd is
+ * only resized when the length changes. */
+static void load_shmem_input(void)
+{
+  u32 len;
+
+  memcpy(&len, shmem_fuzz, sizeof(len));
+  if (len > MAX_FILE) {
+    len = MAX_FILE;
+  }
+  if (len != input_len) {
+    if (ftruncate(input_fd, (off_t)len) < 0) {
+      perror("ftruncate");
+      return;
+    }
+    input_len = len;
+  }
+  memcpy(input_map, shmem_fuzz + sizeof(u32), len);
+  lseek(input_fd, 0, SEEK_SET);
+}
+
+/* Set up the memfd and make it stdin. */
+static int init_shmem_input(void)
+{
+  void *map;
+
+  if ((input_fd = memfd_create("aflcs-input", MFD_CLOEXEC)) < 0) {
+    perror("memfd_create");
+    return -1;
+  }
+  map = mmap(NULL, MAX_FILE, PROT_READ | PROT_WRITE, MAP_SHARED, input_fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    close(input_fd);
+    input_fd = -1;
+    return -1;
+  }
+  input_map = (u8 *)map;
+  load_shmem_input();
+  dup2(input_fd, STDIN_FILENO);
+
+  return 0;
+}
+
+/* Runs before every fork() of the process. Only the forkserver loads the next
+ * test case; processes that its children fork keep theirs. */
+static void prepare_fork(void)
+{
+  if (is_forkserver) {
+    load_shmem_input();
+  }
+}
+
+static void child_fork(void)
+{
+  is_forkserver = false;
+}
+
+/* Open the memfd again, with an offset of its own. */
+static int open_shmem_input(int flags)
+{
+  char path[32];
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", input_fd);
+
+  return real_open(path, O_RDONLY | (flags & O_CLOEXEC));
+}
+
+static int is_shmem_input(const char *path)
+{
+  const char *base;
+
+  if (input_fd < 0 || !path) {
+    return 0;
+  }
+  if (shmem_file) {
+    return !strcmp(path, shmem_file);
+  }
+  base = strrchr(path, '/');
+
+  return !strcmp(base ? base + 1 : path, AFL_CUR_INPUT);
+}
+
+/* Same as the forkserver of AFL++ CoreSight mode, but over the mailbox: each
+ * child stops itself before running, so that cs-proxy can start tracing, and
+ * every stop and the exit of the child are reported. Only returns in the
+ * children. */
+static void run_mailbox_forkserver(int fd)
+{
+  struct fsrv_mailbox *box;
+  pid_t proxy_pid;
+  pid_t child_pid;
+  u32 was_killed;
+  int status;
+
+  unsetenv(FSRV_MAILBOX_ENV);
+  if (!(box = open_fsrv_mailbox(fd))) {
+    return;
+  }
+  proxy_pid = getppid();
+
+  /* Phone home, without options. */
+  if (post_mailbox(&box->st, 0) < 0) {
+    _exit(1);
+  }
+
+  while (1) {
+    if (take_mailbox(&box->ctl, &was_killed, proxy_pid) < 0) {
+      _exit(0);
+    }
+
+    child_pid = fork();
+    if (child_pid < 0) {
+      perror("fork");
+      _exit(1);
+    }
+    if (!child_pid) {
+      close_fsrv_mailbox(box);
+      close(fd);
+      raise(SIGSTOP);
+      return;
+    }
+
+    /* The initial stop is not reported. */
+    if (waitpid(child_pid, &status, WUNTRACED) < 0 ||
+        post_mailbox(&box->st, (u32)child_pid) < 0) {
+      _exit(1);
+    }
+
+    do {
+      if (waitpid(child_pid, &status, WUNTRACED) < 0) {
+        perror("waitpid");
+        _exit(1);
+      }
+      if (post_mailbox(&box->st, (u32)status) < 0) {
+        _exit(1);
+      }
+    } while (WIFSTOPPED(status));
+  }
+}
+
+__attribute__((constructor)) static void init_preload(void)
+{
+  char *ptr;
+
+  real_open = dlsym(RTLD_NEXT, "open");
+  real_openat = dlsym(RTLD_NEXT, "openat");
+  real_fopen = dlsym(RTLD_NEXT, "fopen");
+
+  ptr = getenv(FSRV_MAILBOX_ENV);
+
+  map_shmem_fuzz();
+  if (shmem_fuzz) {
+    shmem_file = getenv("AFLCS_SHMEM_FILE");
+
+    /* The forkserver of the target forks one child per test case. Without
+     * one, cs-proxy starts this process for a single test case. */
+    if (init_shmem_input() == 0 &&
+        (ptr || fcntl(AFLCS_FORKSRV_FD, F_GETFD) >= 0)) {
+      is_forkserver = true;
+      pthread_atfork(prepare_fork, NULL, child_fork);
+    }
+  }
+
+  if (ptr) {
+    run_mailbox_forkserver(atoi(ptr));
+  }
+}
+
+int open(const char *path, int flags, ...)
+{
+  va_list ap;
+  mode_t mode;
+
+  if (is_shmem_input(path)) {
+    return open_shmem_input(flags);
+  }
+
+  mode = 0;
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+
+  return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+  va_list ap;
+  mode_t mode;
+
+  if (is_shmem_input(path)) {
+    return open_shmem_input(flags);
+  }
+
+  mode = 0;
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+
+  return real_openat(dirfd, path, flags, mode);
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+  FILE *fp;
+  int fd;
+
+  if (!is_shmem_input(path)) {
+    return real_fopen(path, mode);
+  }
+
+  if ((fd = open_shmem_input(0)) < 0) {
+    return NULL;
+  }
+  if (!(fp = fdopen(fd, mode))) {
+    close(fd);
+  }
+
+  return fp;
+}
+
+FILE *fopen64(const char *path, const char *mode)
+    __attribute__((alias("fopen")));
@@ -14,6 +14,7 @@
 
 #include "config.h"
 #include "common.h"
+#include "fsrv-mailbox.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,8 +40,13 @@ char *__afl_proxy_name = AFLCS_PROXY_NAME;
 s32 fsrv_pid = -1;
 s32 proxy_ctl_fd = -1;
 s32 proxy_st_fd = -1;
+struct fsrv_mailbox *fsrv_mailbox = NULL;
+u8 mailbox_on = 0;
 u8 first_run = 1;
 u8 no_forksrv = 0;
+u8 shmem_fuzz_on = 0;
+/* Stopped persistent child whose next iteration is already being traced. */
+s32 persistent_pid = -1;
 
 #ifdef EXEC_COUNT
 u32 exec_count = 0;
@@ -49,6 +55,27 @@ u32 exec_count = 0;
 /* TODO: Remove extern variables. */
 extern int udmabuf_num;
 extern bool decoding_on;
+extern bool zero_copy_on;
+extern bool continuous_on;
+extern size_t trace_pool_max_size;
+extern bool numa_on;
+extern bool preload_images_on;
+extern int decode_jobs;
+extern int decode_workers;
+extern bool batch_coverage_on;
+extern size_t trace_memo_size;
+extern char *topology_cache_path;
+extern char *trace_modules;
+extern bool follow_maps_on;
+extern bool follow_fork_on;
+extern bool persistent_on;
+extern unsigned long persistent_start;
+extern unsigned long persistent_end;
+extern char *trace_start_point;
+extern char *broker_name;
+extern int trace_cpus[];
+extern int nr_trace_cpus;
+extern int etm_sync_period;
 extern unsigned char *trace_bitmap;
 extern unsigned int trace_bitmap_size;
 extern cov_type_t cov_type;
@@ -140,15 +167,73 @@ static void __afl_map_shm(void)
   }
 }
 
+/* Shared-memory test cases. afl-fuzz delivers them through the mapping named
+ * by SHM_FUZZ_ENV_VAR, which the target reads with cs-preload.so. The proxy
+ * only negotiates the option, since the target inherits the name. */
+
+static u32 __afl_shmem_fuzz_option(void)
+{
+  if (!shmem_fuzz_on) return 0;
+
+  if (!getenv(SHM_FUZZ_ENV_VAR)) {
+    WARNF("%s is not set. Shared-memory test cases disabled",
+          SHM_FUZZ_ENV_VAR);
+    shmem_fuzz_on = 0;
+    return 0;
+  }
+
+  return FS_OPT_SHDMEM_FUZZ;
+}
+
+static void __afl_accept_shmem_fuzz(u32 status)
+{
+  u32 reply;
+
+  if (!(status & FS_OPT_SHDMEM_FUZZ)) return;
+
+  /* afl-fuzz answers with the options it accepted. */
+  if (read(FORKSRV_FD, &reply, 4) != 4) {
+    PFATAL("read() failed");
+  }
+  if ((reply & (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ)) !=
+      (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ)) {
+    FATAL("afl-fuzz rejected shared-memory test cases");
+  }
+}
+
 /* Fork server logic. */
 
+/* The forkserver of the target is reached through the pipes, or through the
+ * mailbox if it was started with one. */
+
+static s32 __afl_fsrv_write(u32 val)
+{
+  if (fsrv_mailbox) return post_mailbox(&fsrv_mailbox->ctl, val);
+
+  return write(proxy_ctl_fd, &val, 4) == 4 ? 0 : -1;
+}
+
+static s32 __afl_fsrv_read(u32 *val)
+{
+  if (fsrv_mailbox) return take_mailbox(&fsrv_mailbox->st, val, fsrv_pid);
+
+  return read(proxy_st_fd, val, 4) == 4 ? 0 : -1;
+}
+
 static void __afl_start_forkserver(char *argv[])
 {
   u8 tmp[4] = {0, 0, 0, 0};
   u32 status = 0;
+  u32 options = 0;
   int st_pipe[2], ctl_pipe[2];
+  int mailbox_fd = -1;
+  char mailbox_env[16];
 
-  if (pipe(st_pipe) || pipe(ctl_pipe)) {
+  if (mailbox_on) {
+    if (!(fsrv_mailbox = create_fsrv_mailbox(&mailbox_fd))) {
+      FATAL("Failed to create the forkserver mailbox");
+    }
+  } else if (pipe(st_pipe) || pipe(ctl_pipe)) {
     PFATAL("pipe() failed");
   }
 
@@ -160,17 +245,25 @@ static void __afl_start_forkserver(char *argv[])
   if (!fsrv_pid) {
     /* Child Process */
 
-    if (dup2(ctl_pipe[0], AFLCS_FORKSRV_FD) < 0) {
-      PFATAL("dup2() failed");
-    }
-    if (dup2(st_pipe[1], AFLCS_FORKSRV_FD + 1) < 0) {
-      PFATAL("dup2() failed");
-    }
+    /* With the mailbox, the forkserver of cs-preload.so takes over, and the
+     * forkserver of an instrumented target finds no pipes and stays out of
+     * the way. */
+    if (fsrv_mailbox) {
+      snprintf(mailbox_env, sizeof(mailbox_env), "%d", mailbox_fd);
+      setenv(FSRV_MAILBOX_ENV, mailbox_env, 1);
+    } else {
+      if (dup2(ctl_pipe[0], AFLCS_FORKSRV_FD) < 0) {
+        PFATAL("dup2() failed");
+      }
+      if (dup2(st_pipe[1], AFLCS_FORKSRV_FD + 1) < 0) {
+        PFATAL("dup2() failed");
+      }
 
-    close(ctl_pipe[0]);
-    close(ctl_pipe[1]);
-    close(st_pipe[0]);
-    close(st_pipe[1]);
+      close(ctl_pipe[0]);
+      close(ctl_pipe[1]);
+      close(st_pipe[0]);
+      close(st_pipe[1]);
+    }
 
     close(FORKSRV_FD);
     close(FORKSRV_FD + 1);
@@ -182,22 +275,31 @@ static void __afl_start_forkserver(char *argv[])
 
   /* Parent Process */
 
-  close(ctl_pipe[0]);
-  close(st_pipe[1]);
+  if (fsrv_mailbox) {
+    close(mailbox_fd);
+  } else {
+    close(ctl_pipe[0]);
+    close(st_pipe[1]);
 
-  proxy_ctl_fd = ctl_pipe[1];
-  proxy_st_fd = st_pipe[0];
+    proxy_ctl_fd = ctl_pipe[1];
+    proxy_st_fd = st_pipe[0];
+  }
 
-  if (read(proxy_st_fd, &tmp, 4) != 4) {
+  if (__afl_fsrv_read(&status) < 0) {
     PFATAL("read() failed");
   }
-  memcpy(&status, tmp, 4);
+  memcpy(tmp, &status, 4);
 
   if (!status) {
     if (trace_bitmap_size <= FS_OPT_MAX_MAPSIZE)
       status |= (FS_OPT_SET_MAPSIZE(trace_bitmap_size) | FS_OPT_MAPSIZE);
+    options = __afl_shmem_fuzz_option();
+    status |= options;
     if (status) status |= (FS_OPT_ENABLED);
     memcpy(tmp, &status, 4);
+  } else if (shmem_fuzz_on) {
+    WARNF("Target negotiates its own options. Shared-memory test cases "
+          "disabled");
   }
 
   /* Phone home and tell the parent that we're OK. */
@@ -205,6 +307,8 @@ static void __afl_start_forkserver(char *argv[])
   if (write(FORKSRV_FD + 1, tmp, 4) != 4) {
     PFATAL("write() failed");
   }
+
+  __afl_accept_shmem_fuzz(options);
 }
 
 static u32 __afl_next_testcase(void)
@@ -213,17 +317,22 @@ static u32 __afl_next_testcase(void)
 
   /* Wait for parent by reading from the pipe. Abort if read fails. */
   if (read(FORKSRV_FD, &was_killed, 4) != 4) return 1;
-  if (write(proxy_ctl_fd, &was_killed, 4) != 4) return -1;
+  if (__afl_fsrv_write(was_killed) < 0) return -1;
 
   /* Wait for child by reading from the pipe. Abort if read fails. */
-  if (read(proxy_st_fd, &child_pid, 4) != 4) return -1;
+  if (__afl_fsrv_read((u32 *)&child_pid) < 0) return -1;
 
   if (unlikely(first_run)) {
     if (init_trace(fsrv_pid, child_pid) < 0) return -1;
     first_run = 0;
   }
 
-  start_trace(child_pid, false);
+  if (child_pid != persistent_pid) {
+    /* The stopped child was killed instead, and a new one forked. */
+    if (persistent_pid != -1 && stop_trace(false) < 0) return -1;
+    start_trace(child_pid, false);
+  }
+  persistent_pid = -1;
 
   /* report that we are starting the target */
   if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) return -1;
@@ -245,12 +354,20 @@ static s32 __afl_fauxsrv_execv(char *argv[])
 {
   u8 tmp[4] = {0, 0, 0, 0};
   int status = 0;
+  u32 options;
+  int ptrace_options;
   s32 was_killed, child_pid;
 
+  options = __afl_shmem_fuzz_option();
+  if (options) options |= FS_OPT_ENABLED;
+  memcpy(tmp, &options, 4);
+
   /* Phone home and tell the parent that we're OK. */
 
   if (write(FORKSRV_FD + 1, tmp, 4) != 4) return -1;
 
+  __afl_accept_shmem_fuzz(options);
+
   while (1) {
     /* Wait for parent by reading from the pipe. Abort if read fails. */
     if (read(FORKSRV_FD, &was_killed, 4) != 4) return -1;
@@ -274,6 +391,9 @@ static s32 __afl_fauxsrv_execv(char *argv[])
       if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
         PFATAL("ptrace failed");
       }
+      if (follow_maps_on && install_exec_map_filter() < 0) {
+        FATAL("Failed to install the mmap filter");
+      }
 
       execvp(argv[0], argv);
 
@@ -284,6 +404,10 @@ static s32 __afl_fauxsrv_execv(char *argv[])
     waitpid(child_pid, &status, 0);
     if (WIFSTOPPED(status) && WSTOPSIG(status) == PTRACE_EVENT_VFORK_DONE) {
       init_trace(getpid(), child_pid);
+      /* init_trace() settles the modes the options depend on. */
+      if ((ptrace_options = get_trace_ptrace_options()) != 0) {
+        ptrace(PTRACE_SETOPTIONS, child_pid, NULL, ptrace_options);
+      }
       start_trace(child_pid, true);
       ptrace(PTRACE_CONT, child_pid, NULL, NULL);
     }
@@ -293,7 +417,11 @@ static s32 __afl_fauxsrv_execv(char *argv[])
 
     /* Handle child process suspend/resume */
     while (1) {
-      waitpid(child_pid, &status, 0);
+      wait_trace_child(child_pid, &status);
+      if (is_exec_map_stop(status) &&
+          follow_exec_map(child_pid, &status) == 0) {
+        continue;
+      }
       if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP) {
         trace_suspend_resume_callback();
       } else {
@@ -320,6 +448,7 @@ static s32 __afl_fauxsrv_execv(char *argv[])
 int main(int argc, char *argv[])
 {
   s32 status;
+  s32 child_pid;
   int i;
   char **argvp;
   char *ptr;
@@ -363,33 +492,157 @@ int main(int argc, char *argv[])
     }
   }
 
+  if ((ptr = getenv("AFLCS_TRACE_MODULES")) != NULL) {
+    trace_modules = ptr;
+  }
+
+  if (getenv("AFLCS_FOLLOW_MAPS")) {
+    follow_maps_on = true;
+  }
+
+  if (getenv("AFLCS_FOLLOW_FORK")) {
+    follow_fork_on = true;
+  }
+
+  if (getenv("AFLCS_SHMEM_FUZZ")) {
+    shmem_fuzz_on = 1;
+  }
+
+  if (getenv("AFLCS_MAILBOX")) {
+    mailbox_on = 1;
+  }
+
+  if (getenv("AFLCS_PERSISTENT")) {
+    persistent_on = true;
+  }
+
+  if ((ptr = getenv("AFLCS_PERSISTENT_START")) != NULL) {
+    persistent_start = strtoul(ptr, NULL, 0);
+  }
+
+  if ((ptr = getenv("AFLCS_PERSISTENT_END")) != NULL) {
+    persistent_end = strtoul(ptr, NULL, 0);
+  }
+
+  if ((ptr = getenv("AFLCS_TRACE_START")) != NULL) {
+    trace_start_point = ptr;
+  }
+
+  if ((ptr = getenv("AFLCS_BROKER")) != NULL) {
+    broker_name = ptr;
+  }
+
+  if ((ptr = getenv("AFLCS_CPUS")) != NULL) {
+    nr_trace_cpus = parse_cpu_arg(ptr, trace_cpus, TRACE_CPUS_MAX);
+    if (nr_trace_cpus < 0) {
+      FATAL("Error: invalid CPU list '%s'", ptr);
+    }
+  }
+
   if ((ptr = getenv("AFLCS_UDMABUF")) != NULL) {
     udmabuf_num = atoi(ptr);
   }
 
+  if (getenv("AFLCS_ZERO_COPY")) {
+    zero_copy_on = true;
+  }
+
+  if (getenv("AFLCS_CONTINUOUS")) {
+    continuous_on = true;
+  }
+
+  if (getenv("AFLCS_NUMA")) {
+    numa_on = true;
+  }
+
+  if (getenv("AFLCS_PRELOAD_IMAGES")) {
+    preload_images_on = true;
+  }
+
+  if ((ptr = getenv("AFLCS_TRACE_MEM")) != NULL) {
+    trace_pool_max_size = strtoul(ptr, NULL, 0);
+  }
+
+  if ((ptr = getenv("AFLCS_DECODE_JOBS")) != NULL) {
+    decode_jobs = atoi(ptr);
+  }
+
+  if ((ptr = getenv("AFLCS_DECODE_WORKERS")) != NULL) {
+    decode_workers = atoi(ptr);
+  }
+
+  if (getenv("AFLCS_BATCH_COVERAGE")) {
+    batch_coverage_on = true;
+  }
+
+  if ((ptr = getenv("AFLCS_TRACE_MEMO")) != NULL) {
+    trace_memo_size = strtoul(ptr, NULL, 0);
+  }
+
+  if ((ptr = getenv("AFLCS_TOPOLOGY_CACHE")) != NULL) {
+    topology_cache_path = ptr;
+  }
+
+  if ((ptr = getenv("AFLCS_SYNC_PERIOD")) != NULL) {
+    etm_sync_period = atoi(ptr);
+  }
+
+  /* The mailbox forkserver forks from the constructor of cs-preload.so,
+   * before the target can reach a deferred start or a persistent loop. */
+  if (mailbox_on && (persistent_on || trace_start_point ||
+                     getenv(PERSIST_ENV_VAR) || getenv(DEFER_ENV_VAR))) {
+    WARNF("The forkserver mailbox does not support persistent or deferred "
+          "mode. Use pipes");
+    mailbox_on = 0;
+  }
+
+  if (broker_name && follow_maps_on) {
+    WARNF("Following maps requires owning the trace sinks. Disabled");
+    follow_maps_on = false;
+  }
+
   /* then we initialize the shared memory map and start the forkserver */
   __afl_map_shm();
 
   if (no_forksrv) {
+    if (persistent_on) {
+      WARNF("Persistent mode requires the forkserver. Disabled");
+      persistent_on = false;
+    }
     return __afl_fauxsrv_execv(argvp);
   }
 
+  /* The children of the forkserver are traced without a context ID filter,
+   * so their own children are traced anyway. */
+  if (follow_fork_on) {
+    WARNF("Following forks requires AFLCS_NO_FORKSRV. Disabled");
+    follow_fork_on = false;
+  }
+
   __afl_start_forkserver(argvp);
 
-  while (__afl_next_testcase() > 0) {
+  while ((child_pid = __afl_next_testcase()) > 0) {
     /* Handle child process suspend/resume */
     while (1) {
-      if (read(proxy_st_fd, &status, 4) != 4) return -1;
-      if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP) {
+      if (__afl_fsrv_read((u32 *)&status) < 0) return -1;
+      if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP &&
+          !persistent_on) {
         trace_suspend_resume_callback();
       } else {
-        /* Child process has exited. */
+        /* Child process has exited, or finished a persistent iteration. */
         break;
       }
     }
 
     if (stop_trace(false) < 0) return -1;
 
+    /* Start tracing the next iteration before the bitmap of this one is
+     * reported, since the forkserver resumes the child by itself. */
+    if (persistent_on && WIFSTOPPED(status)) {
+      if (start_trace(child_pid, false) < 0) return -1;
+      persistent_pid = child_pid;
+    }
+
     /* report the test case is done and wait for the next */
     if (__afl_end_testcase(status) < 0) return -1;
 
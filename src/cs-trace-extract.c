@@ -0,0 +1,221 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+
+#include "trace-file.h"
+
+#define DEFAULT_RAW_TRACE_NAME "cstrace.bin"
+
+static void usage(char *argv0)
+{
+  fprintf(stderr, "Usage: %s [OPTIONS] TRACE [OUTPUT]\n", argv0);
+  fprintf(stderr,
+          "Extract raw CoreSight trace from a cs-trace container (default "
+          "output: %s)\n",
+          DEFAULT_RAW_TRACE_NAME);
+  fprintf(stderr, "[OPTIONS]\n");
+  fprintf(stderr, "  -l, --list\t\t\tlist the header and the chunk index\n");
+  fprintf(stderr,
+          "  -r, --range=FIRST[:LAST]\textract chunks FIRST to LAST "
+          "(default: all)\n");
+  fprintf(stderr,
+          "  -s, --sync\t\t\tstart at the first A-sync in the range\n");
+  fprintf(stderr, "  -h, --help\t\t\tshow this help\n");
+}
+
+static void list_trace_file(const struct trace_file *file)
+{
+  const struct trace_file_chunk *chunk;
+  size_t i;
+
+  printf("board: %s\n", file->header->board);
+  printf("trace ID: 0x%x\n", file->header->trace_id);
+  for (i = 0; i < file->map_count; i++) {
+    printf("map[%zu]: 0x%lx-0x%lx 0x%lx %s\n", i,
+           (unsigned long)file->maps[i].start,
+           (unsigned long)file->maps[i].end,
+           (unsigned long)file->maps[i].offset, file->maps[i].path);
+  }
+  printf("chunks: %zu\n", file->chunk_count);
+  for (i = 0; i < file->chunk_count; i++) {
+    chunk = &file->index[i];
+    printf("chunk[%zu]: seq %lu raw 0x%lx+0x%lx stored 0x%lx", i,
+           (unsigned long)chunk->seq, (unsigned long)chunk->raw_offset,
+           (unsigned long)chunk->raw_size, (unsigned long)chunk->data_size);
+    if (chunk->sync_offset != TRACE_FILE_NO_SYNC) {
+      printf(" sync +0x%lx (ID 0x%x)", (unsigned long)chunk->sync_offset,
+             chunk->sync_id);
+    }
+    printf("%s%s\n",
+           chunk->flags & TRACE_CHUNK_ASYNC_START ? " async-start" : "",
+           chunk->flags & TRACE_CHUNK_ZSTD ? " zstd" : "");
+  }
+}
+
+static int extract_trace_file(const struct trace_file *file, size_t first,
+                              size_t last, bool sync, const char *path)
+{
+  unsigned char frame[FORMATTER_FRAME_SIZE];
+  const struct trace_file_chunk *chunk;
+  unsigned char *buf;
+  size_t buf_size;
+  size_t skip;
+  ssize_t len;
+  FILE *fp;
+  size_t i;
+  int ret;
+
+  ret = -1;
+  buf = NULL;
+  buf_size = 0;
+
+  if (sync) {
+    while (first <= last && file->index[first].sync_offset ==
+                                TRACE_FILE_NO_SYNC) {
+      first++;
+    }
+    if (first > last) {
+      fprintf(stderr, "No A-sync in the range\n");
+      return -1;
+    }
+  }
+
+  fp = fopen(path, "wb");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  /* The ID in effect at the A-sync was set by a frame that is cut off. */
+  if (sync) {
+    make_resync_frame(frame, file->index[first].sync_id);
+    if (fwrite(frame, 1, sizeof(frame), fp) != sizeof(frame)) {
+      perror("fwrite");
+      goto exit;
+    }
+  }
+
+  for (i = first; i <= last; i++) {
+    chunk = &file->index[i];
+    if (chunk->raw_size > buf_size) {
+      free(buf);
+      buf_size = chunk->raw_size;
+      if (!(buf = malloc(buf_size))) {
+        perror("malloc");
+        goto exit;
+      }
+    }
+    if ((len = read_trace_file_chunk(file, i, buf, buf_size)) < 0) {
+      fprintf(stderr, "Failed to read chunk %zu\n", i);
+      goto exit;
+    }
+    skip = sync && i == first ? chunk->sync_offset : 0;
+    if (fwrite(buf + skip, 1, (size_t)len - skip, fp) != (size_t)len - skip) {
+      perror("fwrite");
+      goto exit;
+    }
+  }
+
+  ret = 0;
+
+exit:
+  free(buf);
+  fclose(fp);
+
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  const struct option long_options[] = {
+      {"list", no_argument, NULL, 'l'},
+      {"range", required_argument, NULL, 'r'},
+      {"sync", no_argument, NULL, 's'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  struct trace_file file;
+  const char *output;
+  char *end;
+  bool list;
+  bool sync;
+  unsigned long first;
+  unsigned long last;
+  int opt;
+  int option_index;
+  int ret;
+
+  list = false;
+  sync = false;
+  first = 0;
+  last = ULONG_MAX;
+
+  while ((opt = getopt_long(argc, argv, "lr:sh", long_options,
+                            &option_index)) != -1) {
+    switch (opt) {
+      case 'l':
+        list = true;
+        break;
+      case 'r':
+        first = strtoul(optarg, &end, 0);
+        last = *end == ':' ? strtoul(end + 1, NULL, 0) : first;
+        break;
+      case 's':
+        sync = true;
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+        break;
+    }
+  }
+
+  if (argc <= optind) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  output = argc > optind + 1 ? argv[optind + 1] : DEFAULT_RAW_TRACE_NAME;
+
+  if (map_trace_file(&file, argv[optind]) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  if (list) {
+    list_trace_file(&file);
+    unmap_trace_file(&file);
+    return 0;
+  }
+
+  if (file.chunk_count == 0) {
+    fprintf(stderr, "No trace in %s\n", argv[optind]);
+    unmap_trace_file(&file);
+    exit(EXIT_FAILURE);
+  }
+  if (last >= file.chunk_count) {
+    last = file.chunk_count - 1;
+  }
+  if (first > last) {
+    fprintf(stderr, "Invalid chunk range\n");
+    unmap_trace_file(&file);
+    exit(EXIT_FAILURE);
+  }
+
+  ret = extract_trace_file(&file, first, last, sync, output);
+  unmap_trace_file(&file);
+
+  return ret < 0 ? EXIT_FAILURE : 0;
+}
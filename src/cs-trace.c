@@ -40,7 +40,26 @@ extern int registration_verbose;
 extern char *board_name;
 extern int udmabuf_num;
 extern bool decoding_on;
+extern bool zero_copy_on;
+extern bool continuous_on;
+extern size_t trace_pool_max_size;
+extern bool numa_on;
+extern bool preload_images_on;
+extern bool stream_export_on;
+extern bool trace_export_on;
+extern int decode_jobs;
+extern int decode_workers;
+extern bool batch_coverage_on;
+extern size_t trace_memo_size;
+extern char *topology_cache_path;
+extern char *trace_modules;
+extern bool follow_maps_on;
+extern bool follow_fork_on;
+extern int etm_sync_period;
+extern char *trace_start_point;
 extern int trace_cpu;
+extern int trace_cpus[];
+extern int nr_trace_cpus;
 extern bool export_config;
 extern cov_type_t cov_type;
 
@@ -55,23 +74,35 @@ void child(char *argv[])
   if (ret < 0) {
     perror("ptrace");
   }
+  if (follow_maps_on && install_exec_map_filter() < 0) {
+    fprintf(stderr, "install_exec_map_filter() failed\n");
+    exit(EXIT_FAILURE);
+  }
   execvp(argv[0], argv);
 }
 
 void parent(pid_t pid, int *child_status)
 {
   int wstatus;
+  int options;
 
   waitpid(pid, &wstatus, 0);
   if (WIFSTOPPED(wstatus) && WSTOPSIG(wstatus) == PTRACE_EVENT_VFORK_DONE) {
     init_trace(getpid(), pid);
+    /* init_trace() settles the modes the options depend on. */
+    if ((options = get_trace_ptrace_options()) != 0) {
+      ptrace(PTRACE_SETOPTIONS, pid, NULL, options);
+    }
     start_trace(pid, true);
     ptrace(PTRACE_CONT, pid, NULL, NULL);
   }
 
   while (1) {
-    waitpid(pid, &wstatus, 0);
-    if (WIFEXITED(wstatus)) {
+    wait_trace_child(pid, &wstatus);
+    if (is_exec_map_stop(wstatus) && follow_exec_map(pid, &wstatus) == 0) {
+      continue;
+    }
+    if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
       stop_trace(true);
       fini_trace();
       break;
@@ -93,13 +124,55 @@ static void usage(char *argv0)
   fprintf(stderr, "  -b, --board=NAME\t\tspecify board name (default: %s)\n",
           board_name);
   fprintf(stderr,
-          "  -c, --cpu=INT\t\t\tbind traced process to CPU (default: %d)\n",
+          "  -B, --batch-coverage\t\tadd decoded coverage to the bitmap "
+          "once per trace (default: off)\n");
+  fprintf(stderr,
+          "  -c, --cpu=LIST\t\tbind traced process to CPUs such as 2-5,8, "
+          "each traced and decoded on its own (default: %d)\n",
           trace_cpu);
   fprintf(stderr,
           "  -d, --decoding={edge,path}\tenable trace decoding (default: "
           "off)\n");
+  fprintf(stderr,
+          "  -C, --continuous\t\tdecode while the ETR keeps running "
+          "(default: off)\n");
   fprintf(stderr, "  -e, --export\t\t\tenable exporting config (default: %d)\n",
           export_config);
+  fprintf(stderr,
+          "  -F, --follow-fork\t\ttrace the child processes of the target "
+          "too (default: off)\n");
+  fprintf(stderr,
+          "  -j, --jobs=INT\t\t\tdecode one trace on INT threads, edge "
+          "coverage only (default: %d)\n",
+          decode_jobs);
+  fprintf(stderr,
+          "  -L, --follow-maps\t\tadd code the target maps at run time "
+          "(default: off)\n");
+  fprintf(stderr,
+          "  -m, --trace-mem=SIZE\t\tupper bound of trace buffer memory "
+          "(default: 0x%lx)\n",
+          trace_pool_max_size);
+  fprintf(stderr,
+          "  -M, --memo=SIZE\t\treplay the coverage of repeated traces "
+          "from up to SIZE bytes of cache (default: off)\n");
+  fprintf(stderr,
+          "  -n, --numa\t\t\tplace trace memory and decoder on the "
+          "u-dma-buf NUMA node (default: off)\n");
+  fprintf(stderr,
+          "  -p, --preload-images\t\tload decoder images into locked huge "
+          "pages (default: off)\n");
+  fprintf(stderr,
+          "  -s, --stream\t\t\twrite trace on a thread while tracing, "
+          "compressed if built with zstd (default: off)\n");
+  fprintf(stderr,
+          "  -S, --start-point=ADDR|SYMBOL\tstart trace in each process when "
+          "it reaches ADDR or SYMBOL (default: off)\n");
+  fprintf(stderr,
+          "  -T, --topology-cache=FILE\tregister the board from the "
+          "topology recorded in FILE (default: off)\n");
+  fprintf(stderr,
+          "  -t, --trace-modules=LIST\ttrace the comma-separated modules, "
+          "\"main\" for the executable (default: main)\n");
   fprintf(stderr,
           "  -u, --udmabuf=INT\t\tspecify u-dma-buf device number to use "
           "(default: %d)",
@@ -107,6 +180,17 @@ static void usage(char *argv0)
   fprintf(stderr,
           "  -v, --verbose[=INT]\t\tverbose output level (default: %d)\n",
           registration_verbose);
+  fprintf(stderr,
+          "  -w, --decode-workers=INT\tdecode fetched trace on INT worker "
+          "threads, 0 for the tracing thread (default: %d)\n",
+          decode_workers);
+  fprintf(stderr,
+          "  -y, --sync-period=INT\t\temit an A-sync every 2^INT bytes "
+          "of trace, 8-20 or 0 for none (default: %d)\n",
+          etm_sync_period);
+  fprintf(stderr,
+          "  -z, --zero-copy\t\tdecode directly from u-dma-buf (default: "
+          "off)\n");
   fprintf(stderr, "  -h, --help\t\t\tshow this help\n");
 }
 
@@ -114,11 +198,27 @@ int main(int argc, char *argv[])
 {
   const struct option long_options[] = {
       {"board", required_argument, NULL, 'b'},
+      {"batch-coverage", no_argument, NULL, 'B'},
       {"cpu", required_argument, NULL, 'c'},
+      {"continuous", no_argument, NULL, 'C'},
       {"decoding", required_argument, NULL, 'd'},
       {"export", no_argument, NULL, 'e'},
+      {"follow-fork", no_argument, NULL, 'F'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"follow-maps", no_argument, NULL, 'L'},
+      {"trace-mem", required_argument, NULL, 'm'},
+      {"memo", required_argument, NULL, 'M'},
+      {"numa", no_argument, NULL, 'n'},
+      {"preload-images", no_argument, NULL, 'p'},
+      {"stream", no_argument, NULL, 's'},
+      {"start-point", required_argument, NULL, 'S'},
+      {"trace-modules", required_argument, NULL, 't'},
+      {"topology-cache", required_argument, NULL, 'T'},
       {"udmabuf", required_argument, NULL, 'u'},
       {"verbose", optional_argument, NULL, 'v'},
+      {"decode-workers", required_argument, NULL, 'w'},
+      {"sync-period", required_argument, NULL, 'y'},
+      {"zero-copy", no_argument, NULL, 'z'},
       {"help", no_argument, NULL, 'h'},
       {0, 0, 0, 0},
   };
@@ -130,6 +230,8 @@ int main(int argc, char *argv[])
 
   argvp = NULL;
   registration_verbose = 0;
+  /* cstrace.cst is written whenever the target exits. */
+  trace_export_on = true;
   trace_bitmap_size = DEFAULT_TRACE_BITMAP_SIZE;
 
   if (argc < 3) {
@@ -137,14 +239,26 @@ int main(int argc, char *argv[])
     exit(EXIT_SUCCESS);
   }
 
-  while ((opt = getopt_long(argc, argv, "b:c:d:ev::h", long_options,
-                            &option_index)) != -1) {
+  while ((opt = getopt_long(argc, argv,
+                            "b:Bc:Cd:eFj:Lm:M:npsS:t:T:u:v::w:y:zh",
+                            long_options, &option_index)) != -1) {
     switch (opt) {
       case 'b':
         board_name = optarg;
         break;
+      case 'B':
+        batch_coverage_on = true;
+        break;
       case 'c':
-        trace_cpu = atoi(optarg);
+        nr_trace_cpus = parse_cpu_arg(optarg, trace_cpus, TRACE_CPUS_MAX);
+        if (nr_trace_cpus < 0) {
+          fprintf(stderr, "Invalid CPU list '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        trace_cpu = trace_cpus[0];
+        break;
+      case 'C':
+        continuous_on = true;
         break;
       case 'd':
         if (!strcmp(optarg, "edge")) {
@@ -160,6 +274,39 @@ int main(int argc, char *argv[])
       case 'e':
         export_config = true;
         break;
+      case 'F':
+        follow_fork_on = true;
+        break;
+      case 'j':
+        decode_jobs = atoi(optarg);
+        break;
+      case 'L':
+        follow_maps_on = true;
+        break;
+      case 'm':
+        trace_pool_max_size = strtoul(optarg, NULL, 0);
+        break;
+      case 'M':
+        trace_memo_size = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        numa_on = true;
+        break;
+      case 'p':
+        preload_images_on = true;
+        break;
+      case 's':
+        stream_export_on = true;
+        break;
+      case 'S':
+        trace_start_point = optarg;
+        break;
+      case 't':
+        trace_modules = optarg;
+        break;
+      case 'T':
+        topology_cache_path = optarg;
+        break;
       case 'u':
         udmabuf_num = atoi(optarg);
         break;
@@ -170,6 +317,15 @@ int main(int argc, char *argv[])
           registration_verbose = 1;
         }
         break;
+      case 'w':
+        decode_workers = atoi(optarg);
+        break;
+      case 'y':
+        etm_sync_period = atoi(optarg);
+        break;
+      case 'z':
+        zero_copy_on = true;
+        break;
       case 'h':
         usage(argv[0]);
         exit(EXIT_SUCCESS);
@@ -0,0 +1,241 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "decode-pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+static uint64_t get_monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Pick a stream with queued chunks that no other worker is decoding. The
+ * search starts past the stream picked last, so that busy streams do not
+ * starve the others. Called with pool->mutex held. */
+static struct decode_stream *pick_stream(struct decode_pool *pool)
+{
+  struct decode_stream *stream;
+  int i;
+
+  for (i = 0; i < pool->nr_streams; i++) {
+    stream = pool->streams[(pool->next_stream + i) % pool->nr_streams];
+    if (stream->head && !stream->busy) {
+      pool->next_stream = (pool->next_stream + i + 1) % pool->nr_streams;
+      return stream;
+    }
+  }
+
+  return NULL;
+}
+
+static void *decode_pool_worker(void *arg)
+{
+  struct decode_pool_worker *worker;
+  struct decode_pool *pool;
+  struct decode_stream *stream;
+  struct trace_chunk *chunk;
+  uint64_t start;
+  int ret;
+
+  worker = (struct decode_pool_worker *)arg;
+  pool = worker->pool;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    stream = pick_stream(pool);
+    if (!stream) {
+      if (pool->stopping) {
+        break;
+      }
+      pthread_cond_wait(&pool->work_cond, &pool->mutex);
+      continue;
+    }
+
+    chunk = stream->head;
+    stream->head = chunk->next;
+    if (!stream->head) {
+      stream->tail = NULL;
+    }
+    chunk->next = NULL;
+    stream->busy = true;
+    pthread_mutex_unlock(&pool->mutex);
+
+    start = get_monotonic_ns();
+    ret = stream->decode(stream->ctx, chunk);
+    worker->busy_ns += get_monotonic_ns() - start;
+    worker->chunks++;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (ret < 0) {
+      stream->error = ret;
+    }
+    stream->busy = false;
+    pool->pending--;
+    if (stream->head) {
+      /* Let an idle worker continue the stream if this one moves on. */
+      pthread_cond_signal(&pool->work_cond);
+    }
+    if (pool->pending == 0) {
+      pthread_cond_broadcast(&pool->idle_cond);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+int init_decode_pool(struct decode_pool *pool, int nr_workers,
+                     int max_streams)
+{
+  int ret;
+  int i;
+
+  if (!pool || nr_workers < 1 || max_streams < 1) {
+    return -1;
+  }
+
+  memset(pool, 0, sizeof(struct decode_pool));
+  pool->workers = calloc(nr_workers, sizeof(struct decode_pool_worker));
+  pool->streams = calloc(max_streams, sizeof(struct decode_stream *));
+  if (!pool->workers || !pool->streams) {
+    perror("calloc");
+    free(pool->workers);
+    free(pool->streams);
+    return -1;
+  }
+  pool->max_streams = max_streams;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->idle_cond, NULL);
+
+  for (i = 0; i < nr_workers; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    ret = pthread_create(&pool->workers[i].thread, NULL, decode_pool_worker,
+                         &pool->workers[i]);
+    if (ret != 0) {
+      fprintf(stderr, "pthread_create() failed: %d\n", ret);
+      fini_decode_pool(pool);
+      return -1;
+    }
+    pool->nr_workers++;
+  }
+
+  return 0;
+}
+
+/* Join all workers. Queued chunks are decoded first. */
+void fini_decode_pool(struct decode_pool *pool)
+{
+  int i;
+
+  if (!pool || !pool->workers) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (i = 0; i < pool->nr_workers; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+
+  pthread_cond_destroy(&pool->idle_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->workers);
+  free(pool->streams);
+  memset(pool, 0, sizeof(struct decode_pool));
+}
+
+/* Register a stream. Any idle worker decodes its next chunk. */
+int add_decode_stream(struct decode_pool *pool, struct decode_stream *stream,
+                      void *ctx,
+                      int (*decode)(void *ctx, struct trace_chunk *chunk))
+{
+  if (!pool || !stream || !decode) {
+    return -1;
+  }
+
+  memset(stream, 0, sizeof(struct decode_stream));
+  stream->ctx = ctx;
+  stream->decode = decode;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->nr_streams >= pool->max_streams) {
+    pthread_mutex_unlock(&pool->mutex);
+    return -1;
+  }
+  pool->streams[pool->nr_streams++] = stream;
+  pthread_mutex_unlock(&pool->mutex);
+
+  return 0;
+}
+
+/* Queue a chunk for decoding. The stream's decode callback owns it. */
+void queue_decode_chunk(struct decode_pool *pool, struct decode_stream *stream,
+                        struct trace_chunk *chunk)
+{
+  chunk->next = NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (stream->tail) {
+    stream->tail->next = chunk;
+  } else {
+    stream->head = chunk;
+  }
+  stream->tail = chunk;
+  pool->pending++;
+  pthread_cond_signal(&pool->work_cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Wait until every queued chunk has been decoded. Returns -1 if any decode
+ * failed since the last call. */
+int wait_decode_pool(struct decode_pool *pool)
+{
+  int ret;
+  int i;
+
+  ret = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->idle_cond, &pool->mutex);
+  }
+  for (i = 0; i < pool->nr_streams; i++) {
+    if (pool->streams[i]->error < 0) {
+      ret = -1;
+      pool->streams[i]->error = 0;
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return ret;
+}
+
+void dump_decode_pool_stats(FILE *stream, struct decode_pool *pool)
+{
+  struct decode_pool_worker *worker;
+  int i;
+
+  for (i = 0; i < pool->nr_workers; i++) {
+    worker = &pool->workers[i];
+    fprintf(stream, "Decode worker #%d: %lu chunks, busy %.3f s\n", i,
+            worker->chunks, (double)worker->busy_ns / 1000000000.0);
+  }
+}
@@ -0,0 +1,501 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#include "deformat.h"
+
+#include <string.h>
+
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(DEFORMAT_SCALAR)
+#include <arm_neon.h>
+#define DEFORMAT_NEON
+#endif
+
+void init_deformatter(struct deformatter *deformatter)
+{
+  deformatter->cur_id = FORMATTER_ID_NULL;
+}
+
+/* Unpack one 16-byte formatter frame and copy the bytes of trace_id to out.
+ * out must hold FORMATTER_FRAME_DATA_MAX bytes. Returns the number of bytes
+ * copied. */
+size_t deformat_frame(struct deformatter *deformatter, int trace_id,
+                      const unsigned char *frame, unsigned char *out)
+{
+  unsigned char aux;
+  unsigned char b;
+  size_t len;
+  int i;
+
+  aux = frame[FORMATTER_FRAME_SIZE - 1];
+  len = 0;
+
+  for (i = 0; i < FORMATTER_FRAME_SIZE - 2; i += 2) {
+    b = frame[i];
+    if (b & 1) {
+      /* ID change. If the aux bit is set, the following data byte still
+       * belongs to the previous ID. */
+      if (aux & (1 << (i / 2))) {
+        if (deformatter->cur_id == trace_id) {
+          out[len++] = frame[i + 1];
+        }
+        deformatter->cur_id = (b >> 1) & 0x7f;
+      } else {
+        deformatter->cur_id = (b >> 1) & 0x7f;
+        if (deformatter->cur_id == trace_id) {
+          out[len++] = frame[i + 1];
+        }
+      }
+    } else if (deformatter->cur_id == trace_id) {
+      out[len++] = b | ((aux >> (i / 2)) & 1);
+      out[len++] = frame[i + 1];
+    }
+  }
+
+  /* Byte 14 has no following data byte. An ID here applies to the next
+   * frame. */
+  b = frame[FORMATTER_FRAME_SIZE - 2];
+  if (b & 1) {
+    deformatter->cur_id = (b >> 1) & 0x7f;
+  } else if (deformatter->cur_id == trace_id) {
+    out[len++] = b | ((aux >> 7) & 1);
+  }
+
+  return len;
+}
+
+/* A frame of null ID data that switches to id for the next frame, so that a
+ * deformatter started at a frame where id is in effect gets it right. */
+void make_resync_frame(unsigned char *frame, int id)
+{
+  int i;
+
+  memset(frame, 0, FORMATTER_FRAME_SIZE);
+  for (i = 0; i < FORMATTER_FRAME_SIZE - 2; i += 2) {
+    frame[i] = (FORMATTER_ID_NULL << 1) | 1;
+  }
+  frame[FORMATTER_FRAME_SIZE - 2] = (unsigned char)((id << 1) | 1);
+}
+
+void init_async_scanner(struct async_scanner *scanner, int trace_id)
+{
+  memset(scanner, 0, sizeof(*scanner));
+  init_deformatter(&scanner->deformatter);
+  scanner->trace_id = trace_id;
+}
+
+/* Scan the next formatted buffer for ETMv4 A-syncs of trace_id, and fill pos
+ * with up to max of them that end in it. An A-sync is only taken if it starts
+ * at least min_gap bytes after the one taken before. Returns the number
+ * found. */
+static size_t scan_async_frames(struct async_scanner *scanner,
+                                const unsigned char *buf, size_t size,
+                                size_t min_gap, struct async_pos *pos,
+                                size_t max)
+{
+  unsigned char data[FORMATTER_FRAME_DATA_MAX];
+  size_t buf_seen;
+  size_t offset;
+  size_t len;
+  size_t count;
+  size_t i;
+  int frame_id;
+
+  count = 0;
+  buf_seen = scanner->seen;
+
+  for (offset = 0; offset + FORMATTER_FRAME_SIZE <= size;
+       offset += FORMATTER_FRAME_SIZE) {
+    frame_id = scanner->deformatter.cur_id;
+    len = deformat_frame(&scanner->deformatter, scanner->trace_id,
+                         &buf[offset], data);
+    for (i = 0; i < len; i++, scanner->seen++) {
+      if (data[i] == 0x00) {
+        if (scanner->zeros == 0) {
+          scanner->run.offset = scanner->offset + offset;
+          scanner->run.cur_id = frame_id;
+          scanner->run.at_start = scanner->seen == buf_seen;
+        }
+        scanner->zeros++;
+        continue;
+      }
+      if (data[i] == ETM4_ASYNC_END && scanner->zeros >= ETM4_ASYNC_ZEROS &&
+          scanner->run.offset >= scanner->next_offset && count < max) {
+        pos[count++] = scanner->run;
+        scanner->next_offset =
+            scanner->run.offset + (min_gap ? min_gap : FORMATTER_FRAME_SIZE);
+      }
+      scanner->zeros = 0;
+    }
+  }
+  scanner->offset += size;
+
+  return count;
+}
+
+/* Scan the formatted buffer for ETMv4 A-syncs of trace_id. Each pos entry
+ * gets the offset of the frame where an A-sync starts and the ID in effect at
+ * that frame, so a deformatter can be resumed there. An A-sync is only taken
+ * if it starts at least min_gap bytes after the previous one, the buffer start
+ * counting as one, and at most max are taken. The deformatter state is
+ * advanced to the end of the scanned frames. Returns the number found. */
+size_t scan_async(struct deformatter *deformatter, int trace_id,
+                  const unsigned char *buf, size_t size, size_t min_gap,
+                  struct async_pos *pos, size_t max)
+{
+  struct async_scanner scanner;
+  size_t count;
+
+  init_async_scanner(&scanner, trace_id);
+  scanner.deformatter = *deformatter;
+  scanner.next_offset = min_gap;
+  count = scan_async_frames(&scanner, buf, size, min_gap, pos, max);
+  *deformatter = scanner.deformatter;
+
+  return count;
+}
+
+/* Scan the next buffer of a stream for ETMv4 A-syncs of trace_id, like
+ * scan_async() but with offsets from the start of the stream. An A-sync that
+ * starts in an earlier buffer and ends in this one is found as well.
+ * pos->at_start is set if the A-sync is the first data of trace_id in the
+ * buffer where it starts. */
+size_t scan_async_stream(struct async_scanner *scanner,
+                         const unsigned char *buf, size_t size,
+                         struct async_pos *pos, size_t max)
+{
+  return scan_async_frames(scanner, buf, size, 0, pos, max);
+}
+
+void init_deformat_demux(struct deformat_demux *demux)
+{
+  memset(demux, 0, sizeof(*demux));
+  init_deformatter(&demux->deformatter);
+}
+
+/* Forget the frame in progress and the current ID after a gap in the input,
+ * keeping the streams. */
+void reset_deformat_demux(struct deformat_demux *demux)
+{
+  demux->partial_len = 0;
+  init_deformatter(&demux->deformatter);
+}
+
+/* Bytes of trace_id go to stream from now on, or are dropped if it is NULL. */
+void set_deformat_stream(struct deformat_demux *demux, int trace_id,
+                         struct deformat_stream *stream)
+{
+  if (trace_id > FORMATTER_ID_NULL && trace_id < FORMATTER_ID_COUNT) {
+    demux->streams[trace_id] = stream;
+  }
+}
+
+static inline bool is_fsync(const unsigned char *buf)
+{
+  return buf[0] == 0xff && buf[1] == 0xff && buf[2] == 0xff && buf[3] == 0x7f;
+}
+
+static inline void put_stream_byte(struct deformat_stream *stream,
+                                   unsigned char b)
+{
+  if (!stream) {
+    return;
+  }
+  if (stream->len < stream->size) {
+    stream->buf[stream->len++] = b;
+  } else {
+    stream->dropped++;
+  }
+}
+
+/* The frame changes IDs. Same rules as deformat_frame(), for all IDs. */
+static void demux_mixed_frame(struct deformat_demux *demux,
+                              const unsigned char *frame)
+{
+  struct deformat_stream **streams;
+  unsigned char aux;
+  unsigned char b;
+  int cur_id;
+  int i;
+
+  streams = demux->streams;
+  cur_id = demux->deformatter.cur_id;
+  aux = frame[FORMATTER_FRAME_SIZE - 1];
+
+  for (i = 0; i < FORMATTER_FRAME_SIZE - 2; i += 2) {
+    b = frame[i];
+    if (b & 1) {
+      if (aux & (1 << (i / 2))) {
+        put_stream_byte(streams[cur_id], frame[i + 1]);
+        cur_id = (b >> 1) & 0x7f;
+      } else {
+        cur_id = (b >> 1) & 0x7f;
+        put_stream_byte(streams[cur_id], frame[i + 1]);
+      }
+    } else {
+      put_stream_byte(streams[cur_id], b | ((aux >> (i / 2)) & 1));
+      put_stream_byte(streams[cur_id], frame[i + 1]);
+    }
+  }
+
+  b = frame[FORMATTER_FRAME_SIZE - 2];
+  if (b & 1) {
+    cur_id = (b >> 1) & 0x7f;
+  } else {
+    put_stream_byte(streams[cur_id], b | ((aux >> 7) & 1));
+  }
+
+  demux->deformatter.cur_id = cur_id;
+}
+
+#ifdef DEFORMAT_NEON
+
+static const uint8_t id_bit_mask[FORMATTER_FRAME_SIZE] = {
+    1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0,
+};
+static const uint8_t aux_bit_mask[FORMATTER_FRAME_SIZE] = {
+    1, 0, 2, 0, 4, 0, 8, 0, 16, 0, 32, 0, 64, 0, 128, 0,
+};
+
+/* Handles a frame without ID changes, which is all data of the current ID.
+ * Returns false if the frame changes IDs. */
+static inline bool demux_plain_frame(struct deformat_demux *demux,
+                                     const unsigned char *frame)
+{
+  struct deformat_stream *stream;
+  uint8x16_t v;
+  uint8x16_t lsb;
+  int i;
+
+  v = vld1q_u8(frame);
+  if (vmaxvq_u8(vandq_u8(v, vld1q_u8(id_bit_mask))) != 0) {
+    return false;
+  }
+
+  stream = demux->streams[demux->deformatter.cur_id];
+  if (!stream) {
+    demux->skipped++;
+    return true;
+  }
+
+  /* Put the aux bits back into the even bytes. Byte 15 is not data. */
+  lsb = vtstq_u8(vdupq_n_u8(frame[FORMATTER_FRAME_SIZE - 1]),
+                 vld1q_u8(aux_bit_mask));
+  v = vorrq_u8(v, vandq_u8(lsb, vdupq_n_u8(1)));
+  if (stream->len + FORMATTER_FRAME_SIZE <= stream->size) {
+    vst1q_u8(&stream->buf[stream->len], v);
+    stream->len += FORMATTER_FRAME_DATA_MAX;
+  } else {
+    for (i = 0; i < FORMATTER_FRAME_DATA_MAX; i++) {
+      put_stream_byte(stream, vgetq_lane_u8(v, 0));
+      v = vextq_u8(v, v, 1);
+    }
+  }
+
+  return true;
+}
+
+#else /* !DEFORMAT_NEON */
+
+static inline bool demux_plain_frame(struct deformat_demux *demux,
+                                     const unsigned char *frame)
+{
+  struct deformat_stream *stream;
+  unsigned char aux;
+  unsigned char *out;
+  int i;
+
+  for (i = 0; i < FORMATTER_FRAME_SIZE - 1; i += 2) {
+    if (frame[i] & 1) {
+      return false;
+    }
+  }
+
+  stream = demux->streams[demux->deformatter.cur_id];
+  if (!stream) {
+    demux->skipped++;
+    return true;
+  }
+
+  aux = frame[FORMATTER_FRAME_SIZE - 1];
+  if (stream->len + FORMATTER_FRAME_DATA_MAX <= stream->size) {
+    out = &stream->buf[stream->len];
+    for (i = 0; i < FORMATTER_FRAME_SIZE - 2; i += 2) {
+      out[i] = frame[i] | ((aux >> (i / 2)) & 1);
+      out[i + 1] = frame[i + 1];
+    }
+    out[FORMATTER_FRAME_SIZE - 2] = frame[FORMATTER_FRAME_SIZE - 2] |
+                                    ((aux >> 7) & 1);
+    stream->len += FORMATTER_FRAME_DATA_MAX;
+  } else {
+    for (i = 0; i < FORMATTER_FRAME_DATA_MAX; i++) {
+      put_stream_byte(stream, frame[i] | ((i & 1) ? 0 : (aux >> (i / 2)) & 1));
+    }
+  }
+
+  return true;
+}
+
+#endif /* DEFORMAT_NEON */
+
+static inline void demux_one_frame(struct deformat_demux *demux,
+                                   const unsigned char *frame)
+{
+  demux->frames++;
+  if (!demux_plain_frame(demux, frame)) {
+    demux_mixed_frame(demux, frame);
+  }
+}
+
+/* Feed bytes to the partial frame left by the last call. Returns the number
+ * of bytes taken. */
+static size_t fill_partial_frame(struct deformat_demux *demux,
+                                 const unsigned char *buf, size_t size)
+{
+  size_t offset;
+  size_t n;
+
+  offset = 0;
+  while (demux->partial_len > 0 && offset < size) {
+    n = FORMATTER_FRAME_SIZE - demux->partial_len;
+    if (n > size - offset) {
+      n = size - offset;
+    }
+    memcpy(&demux->partial[demux->partial_len], &buf[offset], n);
+    demux->partial_len += n;
+    offset += n;
+
+    if (demux->partial_len >= FORMATTER_FSYNC_SIZE &&
+        is_fsync(demux->partial)) {
+      demux->fsyncs++;
+      demux->partial_len -= FORMATTER_FSYNC_SIZE;
+      memmove(demux->partial, &demux->partial[FORMATTER_FSYNC_SIZE],
+              demux->partial_len);
+      continue;
+    }
+    if (demux->partial_len == FORMATTER_FRAME_SIZE) {
+      demux_one_frame(demux, demux->partial);
+      demux->partial_len = 0;
+    }
+  }
+
+  return offset;
+}
+
+/* Append the data in buf to the streams of their source IDs. Frame syncs
+ * between frames are skipped. Frames that do not change IDs are handled
+ * whole, and dropped at once if their ID has no stream. */
+void demux_frames(struct deformat_demux *demux, const unsigned char *buf,
+                  size_t size)
+{
+  size_t offset;
+
+  offset = fill_partial_frame(demux, buf, size);
+
+  while (offset + FORMATTER_FRAME_SIZE <= size) {
+    if (is_fsync(&buf[offset])) {
+      demux->fsyncs++;
+      offset += FORMATTER_FSYNC_SIZE;
+      continue;
+    }
+    demux_one_frame(demux, &buf[offset]);
+    offset += FORMATTER_FRAME_SIZE;
+  }
+
+  /* Trailing frame syncs are complete, a trailing frame is not. */
+  while (offset + FORMATTER_FSYNC_SIZE <= size && is_fsync(&buf[offset])) {
+    demux->fsyncs++;
+    offset += FORMATTER_FSYNC_SIZE;
+  }
+  if (offset < size) {
+    memcpy(demux->partial, &buf[offset], size - offset);
+    demux->partial_len = size - offset;
+  }
+}
+
+/*
+ * Pack len bytes of trace_id into a frame. Byte 0 switches to trace_id and
+ * the rest carry data only, so a frame holds up to FORMATTER_PACK_DATA bytes
+ * and decodes without the frames before it. A short frame ends with a switch
+ * to the null ID. If that switch falls on a data byte, the byte moves after
+ * it and the aux bit keeps it under trace_id.
+ */
+void pack_frame(int trace_id, const unsigned char *data, size_t len,
+                unsigned char *frame)
+{
+  unsigned char aux;
+  size_t pos;
+  size_t i;
+
+  memset(frame, 0, FORMATTER_FRAME_SIZE);
+  frame[0] = (trace_id << 1) | 1;
+  aux = 0;
+
+  for (i = 0; i < len; i++) {
+    pos = i + 1;
+    if (pos & 1) {
+      frame[pos] = data[i];
+    } else {
+      frame[pos] = data[i] & ~1;
+      aux |= (data[i] & 1) << (pos / 2);
+    }
+  }
+
+  if (len < FORMATTER_PACK_DATA) {
+    pos = len + 1;
+    if (pos & 1) {
+      frame[pos] = data[len - 1];
+      frame[pos - 1] = (FORMATTER_ID_NULL << 1) | 1;
+      aux |= 1 << ((pos - 1) / 2);
+    } else {
+      frame[pos] = (FORMATTER_ID_NULL << 1) | 1;
+    }
+  }
+
+  frame[FORMATTER_FRAME_SIZE - 1] = aux;
+}
+
+void init_reframer(struct reframer *reframer, int trace_id)
+{
+  reframer->trace_id = trace_id;
+  reframer->len = 0;
+}
+
+/* Pack the bytes in buf into whole frames at out, after those kept from the
+ * last call. Bytes short of a frame are kept. Returns the bytes written. */
+size_t reframe_trace(struct reframer *reframer, const unsigned char *buf,
+                     size_t size, unsigned char *out)
+{
+  size_t offset;
+  size_t written;
+  size_t n;
+
+  written = 0;
+  for (offset = 0; offset < size; offset += n) {
+    n = FORMATTER_PACK_DATA - reframer->len;
+    if (n > size - offset) {
+      n = size - offset;
+    }
+    memcpy(&reframer->data[reframer->len], &buf[offset], n);
+    reframer->len += n;
+    if (reframer->len == FORMATTER_PACK_DATA) {
+      pack_frame(reframer->trace_id, reframer->data, reframer->len,
+                 &out[written]);
+      written += FORMATTER_FRAME_SIZE;
+      reframer->len = 0;
+    }
+  }
+
+  return written;
+}
+
+/* Pack the kept bytes into a short frame at out. Returns the bytes written. */
+size_t flush_reframer(struct reframer *reframer, unsigned char *out)
+{
+  if (reframer->len == 0) {
+    return 0;
+  }
+  pack_frame(reframer->trace_id, reframer->data, reframer->len, out);
+  reframer->len = 0;
+
+  return FORMATTER_FRAME_SIZE;
+}
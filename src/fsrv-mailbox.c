@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "fsrv-mailbox.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <linux/futex.h>
+
+/* Most answers arrive within a few microseconds, so spin before sleeping. */
+#define FSRV_MAILBOX_SPIN 1024
+/* A sleeping consumer checks this often whether its peer is still alive. */
+#define FSRV_MAILBOX_PEER_CHECK_NS (100 * 1000 * 1000)
+
+#if defined(__aarch64__)
+#define cpu_relax() __asm__ volatile("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ volatile("" ::: "memory")
+#endif
+
+/* Returns a shared mapping of a new memfd, which is left open without
+ * FD_CLOEXEC so that an exec'd forkserver can map it too. */
+struct fsrv_mailbox *create_fsrv_mailbox(int *fd)
+{
+  struct fsrv_mailbox *box;
+  void *map;
+
+  *fd = memfd_create("aflcs-mailbox", 0);
+  if (*fd < 0) {
+    perror("memfd_create");
+    return NULL;
+  }
+  if (ftruncate(*fd, sizeof(struct fsrv_mailbox)) < 0) {
+    perror("ftruncate");
+    close(*fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, sizeof(struct fsrv_mailbox), PROT_READ | PROT_WRITE,
+             MAP_SHARED, *fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    close(*fd);
+    return NULL;
+  }
+
+  box = (struct fsrv_mailbox *)map;
+  box->magic = FSRV_MAILBOX_MAGIC;
+
+  return box;
+}
+
+struct fsrv_mailbox *open_fsrv_mailbox(int fd)
+{
+  struct fsrv_mailbox *box;
+  void *map;
+
+  map = mmap(NULL, sizeof(struct fsrv_mailbox), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  box = (struct fsrv_mailbox *)map;
+  if (box->magic != FSRV_MAILBOX_MAGIC) {
+    fprintf(stderr, "Invalid forkserver mailbox\n");
+    munmap(map, sizeof(struct fsrv_mailbox));
+    return NULL;
+  }
+
+  return box;
+}
+
+void close_fsrv_mailbox(struct fsrv_mailbox *box)
+{
+  if (box) {
+    munmap(box, sizeof(struct fsrv_mailbox));
+  }
+}
+
+int post_mailbox(struct mailbox_queue *queue, uint32_t val)
+{
+  uint32_t tail;
+
+  tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) >=
+      FSRV_MAILBOX_SLOTS) {
+    fprintf(stderr, "Forkserver mailbox overflow\n");
+    return -1;
+  }
+  queue->slots[tail % FSRV_MAILBOX_SLOTS] = val;
+  /* Pairs with the waiters increment in take_mailbox(): either the consumer
+   * sees the new tail, or the wakeup sees the consumer. */
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_seq_cst);
+  if (atomic_load_explicit(&queue->waiters, memory_order_seq_cst) > 0) {
+    syscall(SYS_futex, (uint32_t *)&queue->tail, FUTEX_WAKE, INT_MAX, NULL,
+            NULL, 0);
+  }
+
+  return 0;
+}
+
+static bool is_peer_alive(pid_t peer)
+{
+  siginfo_t info;
+
+  if (kill(peer, 0) < 0 && errno == ESRCH) {
+    return false;
+  }
+  /* A peer that is our child stays a zombie until it is reaped. */
+  memset(&info, 0, sizeof(info));
+  if (waitid(P_PID, peer, &info, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+      info.si_pid == peer) {
+    return false;
+  }
+
+  return true;
+}
+
+/* Wait for the next word. Returns -1 if peer exits first. */
+int take_mailbox(struct mailbox_queue *queue, uint32_t *val, pid_t peer)
+{
+  const struct timespec timeout = {0, FSRV_MAILBOX_PEER_CHECK_NS};
+  uint32_t head;
+  uint32_t tail;
+  long ret;
+  int spin;
+
+  head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  spin = 0;
+  while ((tail = atomic_load_explicit(&queue->tail, memory_order_acquire)) ==
+         head) {
+    if (spin < FSRV_MAILBOX_SPIN) {
+      spin++;
+      cpu_relax();
+      continue;
+    }
+    atomic_fetch_add_explicit(&queue->waiters, 1, memory_order_seq_cst);
+    ret = syscall(SYS_futex, (uint32_t *)&queue->tail, FUTEX_WAIT, tail,
+                  &timeout, NULL, 0);
+    atomic_fetch_sub_explicit(&queue->waiters, 1, memory_order_relaxed);
+    if (ret < 0 && errno == ETIMEDOUT && !is_peer_alive(peer)) {
+      return -1;
+    }
+  }
+
+  *val = queue->slots[head % FSRV_MAILBOX_SLOTS];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+  return 0;
+}
@@ -0,0 +1,310 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "parallel-decode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * A buffer is split at ETMv4 A-syncs into segments that are decoded by
+ * separate edge decoders on a persistent set of threads, each writing to a
+ * private bitmap. The first segment continues the stream of the previous
+ * buffer, so it goes to the decoder that decoded the last segment of it (the
+ * carry decoder) on the calling thread. The others start from an A-sync on a
+ * freshly reset decoder.
+ *
+ * A reset decoder misses the edge into the first waypoint after its A-sync
+ * and counts one from its reset state instead. So the decoder of a segment
+ * reads on over the first overlap bytes of the next one, where it counts the
+ * edges a serial decode would. The decoder of the next segment counts the
+ * same bytes from its reset state, and so does a probe decoder that stops
+ * there, whose counts are subtracted again. Past the overlap the decoder of
+ * the next segment is in the state a serial decode would be in, so the merged
+ * bitmap equals that of a serial decode, provided that the overlap holds a
+ * waypoint after the A-sync.
+ *
+ * Edge counts are merged by wrapping addition and subtraction. Only the pages
+ * of a private bitmap that its decoder touched are merged.
+ */
+
+/* Decode size bytes of a segment that starts at an A-sync from a reset
+ * state. */
+static int decode_from_sync(struct parallel_decoder *pd, libcsdec_t decoder,
+                            const struct decode_segment *segment, size_t size)
+{
+  unsigned char frame[FORMATTER_FRAME_SIZE];
+
+  if (libcsdec_reset_edge(decoder, pd->trace_id, pd->map_count, pd->mem_map) !=
+      LIBCSDEC_SUCCESS) {
+    return -1;
+  }
+  make_resync_frame(frame, segment->cur_id);
+  if (libcsdec_run_edge(decoder, frame, sizeof(frame)) != LIBCSDEC_SUCCESS) {
+    return -1;
+  }
+
+  return libcsdec_run_edge(decoder, segment->buf, size) == LIBCSDEC_SUCCESS
+             ? 0
+             : -1;
+}
+
+static int decode_segment(struct parallel_decoder *pd,
+                          struct decode_worker *worker)
+{
+  struct decode_segment *segment;
+
+  segment = &worker->segment;
+  if (!segment->resync) {
+    return libcsdec_run_edge(worker->decoder, segment->buf, segment->size) ==
+                   LIBCSDEC_SUCCESS
+               ? 0
+               : -1;
+  }
+
+  if (decode_from_sync(pd, worker->probe, segment, segment->prefix) < 0) {
+    return -1;
+  }
+
+  return decode_from_sync(pd, worker->decoder, segment, segment->size);
+}
+
+static void *decode_segment_worker(void *arg)
+{
+  struct decode_worker *worker;
+  struct parallel_decoder *pd;
+
+  worker = (struct decode_worker *)arg;
+  pd = worker->pd;
+
+  while (1) {
+    pthread_mutex_lock(&pd->mutex);
+    while (!worker->queued && !pd->stopping) {
+      pthread_cond_wait(&pd->start_cond, &pd->mutex);
+    }
+    if (!worker->queued) {
+      pthread_mutex_unlock(&pd->mutex);
+      break;
+    }
+    pthread_mutex_unlock(&pd->mutex);
+
+    worker->ret = decode_segment(pd, worker);
+
+    pthread_mutex_lock(&pd->mutex);
+    worker->queued = false;
+    if (--pd->pending == 0) {
+      pthread_cond_signal(&pd->done_cond);
+    }
+    pthread_mutex_unlock(&pd->mutex);
+  }
+
+  return NULL;
+}
+
+static int init_decode_worker(struct decode_worker *worker,
+                              size_t bitmap_size, int map_count,
+                              struct libcsdec_memory_image *mem_img)
+{
+  if (init_coverage_buf(&worker->cov, bitmap_size) < 0 ||
+      init_coverage_buf(&worker->probe_cov, bitmap_size) < 0) {
+    fprintf(stderr, "init_coverage_buf() failed\n");
+    return -1;
+  }
+  worker->decoder =
+      libcsdec_init_edge(worker->cov.buf, bitmap_size, map_count, mem_img);
+  worker->probe = libcsdec_init_edge(worker->probe_cov.buf, bitmap_size,
+                                     map_count, mem_img);
+  if (!worker->decoder || !worker->probe) {
+    fprintf(stderr, "libcsdec_init_edge() failed\n");
+    return -1;
+  }
+  if (pthread_create(&worker->thread, NULL, decode_segment_worker, worker) !=
+      0) {
+    fprintf(stderr, "pthread_create() failed\n");
+    return -1;
+  }
+  worker->started = true;
+
+  return 0;
+}
+
+int init_parallel_decoder(struct parallel_decoder *pd, int nr_workers,
+                          size_t bitmap_size, int map_count,
+                          struct libcsdec_memory_image *mem_img)
+{
+  int i;
+
+  if (!pd || nr_workers < 1 || bitmap_size == 0) {
+    return -1;
+  }
+
+  memset(pd, 0, sizeof(struct parallel_decoder));
+  pd->bitmap_size = bitmap_size;
+  pd->min_segment = PARALLEL_DECODE_MIN_SEGMENT;
+  pd->overlap = PARALLEL_DECODE_OVERLAP;
+  init_deformatter(&pd->deformatter);
+  pthread_mutex_init(&pd->mutex, NULL);
+  pthread_cond_init(&pd->start_cond, NULL);
+  pthread_cond_init(&pd->done_cond, NULL);
+
+  pd->workers = calloc(nr_workers, sizeof(struct decode_worker));
+  pd->splits = calloc(nr_workers, sizeof(struct async_pos));
+  if (!pd->workers || !pd->splits) {
+    perror("calloc");
+    goto err;
+  }
+
+  for (i = 0; i < nr_workers; i++) {
+    pd->workers[i].pd = pd;
+    pd->nr_workers++;
+    if (init_decode_worker(&pd->workers[i], bitmap_size, map_count, mem_img) <
+        0) {
+      goto err;
+    }
+  }
+
+  return 0;
+
+err:
+  fini_parallel_decoder(pd, NULL);
+  return -1;
+}
+
+/* Reset all decoders for a new trace session. */
+int reset_parallel_decoder(struct parallel_decoder *pd, int trace_id,
+                           int map_count, struct libcsdec_memory_map *mem_map)
+{
+  int i;
+
+  pd->trace_id = trace_id;
+  pd->map_count = map_count;
+  pd->mem_map = mem_map;
+  pd->carry = 0;
+  init_deformatter(&pd->deformatter);
+
+  for (i = 0; i < pd->nr_workers; i++) {
+    if (libcsdec_reset_edge(pd->workers[i].decoder, trace_id, map_count,
+                            mem_map) != LIBCSDEC_SUCCESS) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int run_parallel_decoder(struct parallel_decoder *pd, const void *buf,
+                         size_t size, unsigned char *bitmap)
+{
+  struct decode_worker *worker;
+  size_t min_gap;
+  size_t nr_splits;
+  size_t start;
+  size_t end;
+  size_t overlap;
+  int nr_segments;
+  int ret;
+  int i;
+
+  /* Split points are at least min_gap apart, which bounds the segments to
+   * nr_workers. Small buffers are decoded by the carry decoder alone. A last
+   * segment that fits in the overlap is left to the one before it, so every
+   * segment after the first is longer than the overlap. */
+  min_gap = size / pd->nr_workers;
+  if (min_gap < pd->min_segment) {
+    min_gap = pd->min_segment;
+  }
+  overlap = pd->overlap < min_gap ? pd->overlap : min_gap;
+  nr_splits = scan_async(&pd->deformatter, pd->trace_id, buf, size, min_gap,
+                         pd->splits, pd->nr_workers - 1);
+  while (nr_splits > 0 && size - pd->splits[nr_splits - 1].offset <= overlap) {
+    nr_splits--;
+  }
+  nr_segments = (int)nr_splits + 1;
+
+  pthread_mutex_lock(&pd->mutex);
+  for (i = 0; i < nr_segments; i++) {
+    worker = &pd->workers[(pd->carry + i) % pd->nr_workers];
+    start = i == 0 ? 0 : pd->splits[i - 1].offset;
+    end = i == nr_segments - 1 ? size : pd->splits[i].offset + overlap;
+    worker->segment.buf = (const unsigned char *)buf + start;
+    worker->segment.size = end - start;
+    worker->segment.prefix = overlap;
+    worker->segment.cur_id =
+        i == 0 ? FORMATTER_ID_NULL : pd->splits[i - 1].cur_id;
+    worker->segment.resync = i > 0;
+    worker->ret = 0;
+    worker->queued = i > 0;
+  }
+  pd->pending = nr_segments - 1;
+  if (pd->pending > 0) {
+    pthread_cond_broadcast(&pd->start_cond);
+  }
+  pthread_mutex_unlock(&pd->mutex);
+
+  worker = &pd->workers[pd->carry];
+  ret = decode_segment(pd, worker);
+  flush_coverage_buf(&worker->cov, bitmap);
+
+  pthread_mutex_lock(&pd->mutex);
+  while (pd->pending > 0) {
+    pthread_cond_wait(&pd->done_cond, &pd->mutex);
+  }
+  pthread_mutex_unlock(&pd->mutex);
+
+  for (i = 1; i < nr_segments; i++) {
+    worker = &pd->workers[(pd->carry + i) % pd->nr_workers];
+    if (worker->ret < 0) {
+      ret = -1;
+    }
+    flush_coverage_buf(&worker->cov, bitmap);
+    retract_coverage_buf(&worker->probe_cov, bitmap);
+  }
+
+  pd->carry = (pd->carry + nr_segments - 1) % pd->nr_workers;
+
+  return ret;
+}
+
+/* Stop the threads and finish all decoders. What the carry decoder emits on
+ * finishing is merged into bitmap. */
+void fini_parallel_decoder(struct parallel_decoder *pd, unsigned char *bitmap)
+{
+  struct decode_worker *worker;
+  int i;
+
+  pthread_mutex_lock(&pd->mutex);
+  pd->stopping = true;
+  pthread_cond_broadcast(&pd->start_cond);
+  pthread_mutex_unlock(&pd->mutex);
+
+  for (i = 0; i < pd->nr_workers; i++) {
+    worker = &pd->workers[i];
+    if (worker->started) {
+      pthread_join(worker->thread, NULL);
+    }
+    if (worker->decoder) {
+      libcsdec_finish_edge(worker->decoder);
+    }
+    if (worker->probe) {
+      libcsdec_finish_edge(worker->probe);
+    }
+    if (bitmap && i == pd->carry) {
+      flush_coverage_buf(&worker->cov, bitmap);
+    }
+    fini_coverage_buf(&worker->cov);
+    fini_coverage_buf(&worker->probe_cov);
+  }
+
+  free(pd->workers);
+  free(pd->splits);
+  pthread_mutex_destroy(&pd->mutex);
+  pthread_cond_destroy(&pd->start_cond);
+  pthread_cond_destroy(&pd->done_cond);
+  memset(pd, 0, sizeof(struct parallel_decoder));
+}
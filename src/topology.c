@@ -0,0 +1,559 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "topology.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+static struct topology_state *recorder;
+
+struct topology_state board_topology;
+
+const struct trace_id_rule trace_id_rules[] = {
+    {"Marvell ThunderX2", 0, INT_MAX, 0x10, 28, 4},
+    {"Jetson TX2", 0, 0, 0x10, 1, 1},
+    {"Jetson TX2", 3, 5, 0x11, 1, 1},
+    {"Jetson Nano", 0, INT_MAX, 0x10, 1, 1},
+    {"ZCU104", 0, INT_MAX, 0x10, 1, 1}, /* TODO */
+    {},
+};
+
+void init_topology(struct topology_state *state, const char *hardware,
+                   int n_cpu)
+{
+  struct topology *topo = &state->topo;
+  int i;
+
+  memset(state, 0, sizeof(struct topology_state));
+  memcpy(topo->magic, TOPOLOGY_CACHE_MAGIC, sizeof(TOPOLOGY_CACHE_MAGIC));
+  topo->version = TOPOLOGY_CACHE_VERSION;
+  topo->n_cpu = n_cpu;
+  snprintf(topo->hardware, sizeof(topo->hardware), "%s", hardware);
+  topo->etb = -1;
+  topo->itm = -1;
+  for (i = 0; i < TOPOLOGY_SINKS_MAX; i++) {
+    topo->trace_sinks[i] = -1;
+  }
+  for (i = 0; i < TOPOLOGY_CPUS_MAX; i++) {
+    topo->trace_ids[i] = -1;
+  }
+}
+
+/* Device classes compared against the cache when a device is registered. */
+static uint32_t get_device_classes(cs_device_t dev)
+{
+  const unsigned int classes[] = {CS_DEVCLASS_SOURCE, CS_DEVCLASS_SINK,
+                                  CS_DEVCLASS_CTI, CS_DEVCLASS_BUFFER};
+  uint32_t ret = 0;
+  size_t i;
+
+  for (i = 0; i < ARRAY_LEN(classes); i++) {
+    if (cs_device_has_class(dev, classes[i])) {
+      ret |= classes[i];
+    }
+  }
+
+  return ret;
+}
+
+static int find_device(struct topology_state *state, cs_device_t dev)
+{
+  uint32_t i;
+
+  for (i = 0; i < state->topo.nr_devices; i++) {
+    if (state->handles[i] == dev) {
+      return (int)i;
+    }
+  }
+
+  return -1;
+}
+
+/* Index of a device passed to a recorded call. Devices that were neither
+ * registered nor added through the state cannot be replayed. */
+static int get_device_index(struct topology_state *state, cs_device_t dev)
+{
+  int index;
+
+  if ((index = find_device(state, dev)) < 0) {
+    state->broken = true;
+  }
+
+  return index;
+}
+
+static int get_sink_index(struct topology_state *state, cs_device_t dev)
+{
+  return dev ? get_device_index(state, dev) : -1;
+}
+
+static int add_device(struct topology_state *state, cs_device_t dev,
+                      cs_physaddr_t addr)
+{
+  struct topology *topo = &state->topo;
+  int index;
+
+  if ((index = find_device(state, dev)) >= 0) {
+    return index;
+  }
+  if (topo->nr_devices >= TOPOLOGY_DEVICES_MAX) {
+    state->broken = true;
+    return -1;
+  }
+
+  index = (int)topo->nr_devices++;
+  state->handles[index] = dev;
+  topo->devices[index].addr = addr;
+  topo->devices[index].classes = addr ? get_device_classes(dev) : 0;
+
+  return index;
+}
+
+static void add_op(struct topology_state *state, topology_op_type_t type,
+                   int dev, int arg0, int arg1, int arg2, cs_physaddr_t addr)
+{
+  struct topology *topo = &state->topo;
+  struct topology_op *op;
+
+  if (dev < 0 || topo->nr_ops >= TOPOLOGY_OPS_MAX) {
+    state->broken = true;
+    return;
+  }
+
+  op = &topo->ops[topo->nr_ops++];
+  op->type = type;
+  op->dev = dev;
+  op->args[0] = arg0;
+  op->args[1] = arg1;
+  op->args[2] = arg2;
+  op->addr = addr;
+}
+
+/* Start recording the registration calls into state, or stop with NULL. */
+void record_topology(struct topology_state *state)
+{
+  recorder = state;
+}
+
+int topo_register_romtable(cs_physaddr_t addr)
+{
+  return cs_register_romtable(addr);
+}
+
+int topo_exclude_range(cs_physaddr_t from, cs_physaddr_t to)
+{
+  return cs_exclude_range(from, to);
+}
+
+/* Devices found by the ROM table walk are registered explicitly on replay,
+ * so cs_device_get() is recorded like cs_device_register(). */
+static cs_device_t record_device(cs_device_t dev, cs_physaddr_t addr)
+{
+  uint32_t nr_devices;
+  int index;
+
+  if (!recorder || !dev) {
+    return dev;
+  }
+
+  nr_devices = recorder->topo.nr_devices;
+  index = add_device(recorder, dev, addr);
+  if (index >= 0 && (uint32_t)index == nr_devices) {
+    add_op(recorder, topo_op_register, index, 0, 0, 0, addr);
+  }
+
+  return dev;
+}
+
+cs_device_t topo_device_register(cs_physaddr_t addr)
+{
+  return record_device(cs_device_register(addr), addr);
+}
+
+cs_device_t topo_device_get(cs_physaddr_t addr)
+{
+  return record_device(cs_device_get(addr), addr);
+}
+
+int topo_set_affinity(cs_device_t dev, unsigned int cpu)
+{
+  if (recorder) {
+    add_op(recorder, topo_op_affinity, get_device_index(recorder, dev),
+           (int)cpu, 0, 0, 0);
+  }
+
+  return cs_device_set_affinity(dev, cpu);
+}
+
+cs_device_t topo_cpu_get_device(int cpu, unsigned int classes)
+{
+  cs_device_t dev;
+
+  dev = cs_cpu_get_device(cpu, classes);
+  if (recorder && dev) {
+    get_device_index(recorder, dev);
+  }
+
+  return dev;
+}
+
+int topo_atb_register(cs_device_t from, unsigned int from_port, cs_device_t to,
+                      unsigned int to_port)
+{
+  if (recorder) {
+    add_op(recorder, topo_op_atb, get_device_index(recorder, from),
+           (int)from_port, get_device_index(recorder, to), (int)to_port, 0);
+  }
+
+  return cs_atb_register(from, from_port, to, to_port);
+}
+
+cs_device_t topo_atb_add_replicator(unsigned int n_ports)
+{
+  cs_device_t dev;
+
+  dev = cs_atb_add_replicator(n_ports);
+  if (recorder && dev) {
+    add_op(recorder, topo_op_replicator, add_device(recorder, dev, 0),
+           (int)n_ports, 0, 0, 0);
+  }
+
+  return dev;
+}
+
+int topo_cti_connect_trigsrc(cs_device_t dev, int trig, cs_device_t cti,
+                             int n)
+{
+  if (recorder) {
+    add_op(recorder, topo_op_trigsrc, get_device_index(recorder, dev), trig,
+           get_device_index(recorder, cti), n, 0);
+  }
+
+  return cs_cti_connect_trigsrc(dev, trig, cs_cti_trigsrc(cti, n));
+}
+
+int topo_cti_connect_trigdst(cs_device_t cti, int n, cs_device_t dev,
+                             int trig)
+{
+  if (recorder) {
+    add_op(recorder, topo_op_trigdst, get_device_index(recorder, cti), n,
+           get_device_index(recorder, dev), trig, 0);
+  }
+
+  return cs_cti_connect_trigdst(cs_cti_trigdst(cti, n), dev, trig);
+}
+
+int topo_stm_config_master(cs_device_t stm, unsigned int master,
+                           cs_physaddr_t addr)
+{
+  if (recorder) {
+    add_op(recorder, topo_op_stm_master, get_device_index(recorder, stm),
+           (int)master, 0, 0, addr);
+  }
+
+  return cs_stm_config_master(stm, master, addr);
+}
+
+int topo_stm_select_master(cs_device_t stm, unsigned int master)
+{
+  if (recorder) {
+    add_op(recorder, topo_op_stm_select, get_device_index(recorder, stm),
+           (int)master, 0, 0, 0);
+  }
+
+  return cs_stm_select_master(stm, master);
+}
+
+int lookup_trace_id(const struct trace_id_rule *rules, const char *hardware,
+                    int cpu)
+{
+  const struct trace_id_rule *rule;
+  int n;
+
+  for (rule = rules; rule->hardware; rule++) {
+    if (cpu < rule->first_cpu || cpu > rule->last_cpu ||
+        strcmp(rule->hardware, hardware) != 0) {
+      continue;
+    }
+    n = cpu - rule->first_cpu;
+    return rule->base + (n % rule->cluster) * rule->stride + n / rule->cluster;
+  }
+
+  // Unknown hardware name or CPU
+  return -1;
+}
+
+/* Record the sinks and CPU IDs the registration function set and the trace
+ * ID of each CPU, once the board is registered. */
+int capture_topology(struct topology_state *state,
+                     const struct cs_devices_t *devices,
+                     const struct trace_id_rule *rules)
+{
+  struct topology *topo = &state->topo;
+  size_t nr_cpu_ids;
+  size_t i;
+
+  topo->etb = get_sink_index(state, devices->etb);
+  topo->itm = get_sink_index(state, devices->itm);
+  for (i = 0; i < TOPOLOGY_SINKS_MAX; i++) {
+    topo->trace_sinks[i] = get_sink_index(state, devices->trace_sinks[i]);
+  }
+
+  nr_cpu_ids = ARRAY_LEN(devices->cpu_id);
+  if (nr_cpu_ids > TOPOLOGY_CPUS_MAX) {
+    nr_cpu_ids = TOPOLOGY_CPUS_MAX;
+  }
+  for (i = 0; i < nr_cpu_ids; i++) {
+    topo->cpu_id[i] = devices->cpu_id[i];
+  }
+  for (i = 0; i < TOPOLOGY_CPUS_MAX; i++) {
+    topo->trace_ids[i] = lookup_trace_id(rules, topo->hardware, (int)i);
+  }
+
+  if (state->broken) {
+    return -1;
+  }
+  state->ready = true;
+
+  return 0;
+}
+
+static bool is_valid_device(const struct topology *topo, int index,
+                            bool optional)
+{
+  if (index < 0) {
+    return optional;
+  }
+
+  return (uint32_t)index < topo->nr_devices;
+}
+
+static bool is_valid_topology(const struct topology *topo,
+                              const struct topology *expected)
+{
+  const struct topology_op *op;
+  uint32_t i;
+
+  if (memcmp(topo->magic, expected->magic, sizeof(topo->magic)) ||
+      topo->version != expected->version || topo->n_cpu != expected->n_cpu ||
+      strncmp(topo->hardware, expected->hardware, sizeof(topo->hardware)) ||
+      topo->nr_devices > TOPOLOGY_DEVICES_MAX ||
+      topo->nr_ops > TOPOLOGY_OPS_MAX) {
+    return false;
+  }
+
+  for (i = 0; i < topo->nr_ops; i++) {
+    op = &topo->ops[i];
+    if (!is_valid_device(topo, op->dev, false)) {
+      return false;
+    }
+    if ((op->type == topo_op_atb || op->type == topo_op_trigsrc ||
+         op->type == topo_op_trigdst) &&
+        !is_valid_device(topo, op->args[1], false)) {
+      return false;
+    }
+  }
+
+  if (!is_valid_device(topo, topo->etb, true) ||
+      !is_valid_device(topo, topo->itm, true)) {
+    return false;
+  }
+  for (i = 0; i < TOPOLOGY_SINKS_MAX; i++) {
+    if (!is_valid_device(topo, topo->trace_sinks[i], true)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Remove a cache that does not match the hardware. */
+void remove_topology(const char *path)
+{
+  fprintf(stderr, "%s: Stale topology cache. Removed\n", path);
+  unlink(path);
+}
+
+/* Load the topology of the board init_topology() was given. A cache of
+ * another board or version is removed. */
+int load_topology(struct topology_state *state, const char *path)
+{
+  struct topology *topo;
+  struct stat st;
+  FILE *fp;
+
+  fp = fopen(path, "rb");
+  if (!fp) {
+    return -1;
+  }
+
+  topo = malloc(sizeof(struct topology));
+  if (!topo) {
+    perror("malloc");
+    fclose(fp);
+    return -1;
+  }
+
+  if (fstat(fileno(fp), &st) < 0 ||
+      (size_t)st.st_size != sizeof(struct topology) ||
+      fread(topo, sizeof(struct topology), 1, fp) != 1 ||
+      !is_valid_topology(topo, &state->topo)) {
+    remove_topology(path);
+    free(topo);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  memcpy(&state->topo, topo, sizeof(struct topology));
+  memset(state->handles, 0, sizeof(state->handles));
+  state->broken = false;
+  state->ready = false;
+  free(topo);
+
+  return 0;
+}
+
+/* Write to a temporary file first, so that concurrent instances never see a
+ * partial cache. */
+int store_topology(const struct topology_state *state, const char *path)
+{
+  char tmp_path[PATH_MAX];
+  FILE *fp;
+  int fd;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+  fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return -1;
+  }
+  fp = fdopen(fd, "wb");
+  if (!fp) {
+    perror("fdopen");
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+  }
+
+  if (fwrite(&state->topo, sizeof(struct topology), 1, fp) != 1) {
+    perror("fwrite");
+    fclose(fp);
+    unlink(tmp_path);
+    return -1;
+  }
+  if (fclose(fp) != 0) {
+    perror("fclose");
+    unlink(tmp_path);
+    return -1;
+  }
+  chmod(tmp_path, 0644);
+  if (rename(tmp_path, path) < 0) {
+    perror("rename");
+    unlink(tmp_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+static cs_device_t get_handle(struct topology_state *state, int index)
+{
+  return index < 0 ? NULL : state->handles[index];
+}
+
+/*
+ * Register a loaded topology in place of the registration function of the
+ * board. Every device is checked to be of the classes it was recorded with,
+ * so that a cache that no longer matches the hardware fails here and the
+ * caller can fall back to the ROM table walk.
+ */
+int replay_topology(struct topology_state *state,
+                    struct cs_devices_t *devices)
+{
+  struct topology *topo = &state->topo;
+  const struct topology_op *op;
+  const struct topology_device *device;
+  size_t nr_cpu_ids;
+  cs_device_t dev;
+  uint32_t i;
+
+  for (i = 0; i < topo->nr_ops; i++) {
+    op = &topo->ops[i];
+    dev = state->handles[op->dev];
+
+    switch (op->type) {
+      case topo_op_register:
+        device = &topo->devices[op->dev];
+        dev = cs_device_register(device->addr);
+        if (!dev || get_device_classes(dev) != device->classes) {
+          fprintf(stderr, "Device at 0x%lx does not match the topology cache\n",
+                  (unsigned long)device->addr);
+          return -1;
+        }
+        state->handles[op->dev] = dev;
+        break;
+      case topo_op_affinity:
+        cs_device_set_affinity(dev, (unsigned int)op->args[0]);
+        break;
+      case topo_op_replicator:
+        if (!(state->handles[op->dev] =
+                  cs_atb_add_replicator((unsigned int)op->args[0]))) {
+          return -1;
+        }
+        break;
+      case topo_op_atb:
+        cs_atb_register(dev, (unsigned int)op->args[0],
+                        get_handle(state, op->args[1]),
+                        (unsigned int)op->args[2]);
+        break;
+      case topo_op_trigsrc:
+        cs_cti_connect_trigsrc(
+            dev, op->args[0],
+            cs_cti_trigsrc(get_handle(state, op->args[1]), op->args[2]));
+        break;
+      case topo_op_trigdst:
+        cs_cti_connect_trigdst(cs_cti_trigdst(dev, op->args[0]),
+                               get_handle(state, op->args[1]), op->args[2]);
+        break;
+      case topo_op_stm_master:
+        cs_stm_config_master(dev, (unsigned int)op->args[0], op->addr);
+        break;
+      case topo_op_stm_select:
+        cs_stm_select_master(dev, (unsigned int)op->args[0]);
+        break;
+      default:
+        fprintf(stderr, "Unknown topology operation %u\n", op->type);
+        return -1;
+    }
+  }
+
+  devices->etb = get_handle(state, topo->etb);
+  devices->itm = get_handle(state, topo->itm);
+  for (i = 0; i < TOPOLOGY_SINKS_MAX; i++) {
+    devices->trace_sinks[i] = get_handle(state, topo->trace_sinks[i]);
+  }
+
+  nr_cpu_ids = ARRAY_LEN(devices->cpu_id);
+  if (nr_cpu_ids > TOPOLOGY_CPUS_MAX) {
+    nr_cpu_ids = TOPOLOGY_CPUS_MAX;
+  }
+  for (i = 0; i < nr_cpu_ids; i++) {
+    devices->cpu_id[i] = topo->cpu_id[i];
+  }
+  state->ready = true;
+
+  return 0;
+}
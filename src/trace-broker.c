@@ -0,0 +1,509 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "trace-broker.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <linux/futex.h>
+
+/* A waiting client checks this often whether the broker is still alive. */
+#define TRACE_BROKER_PEER_CHECK_NS (100 * 1000 * 1000)
+
+static size_t get_broker_map_size(size_t ring_size)
+{
+  return ALIGN_UP(sizeof(struct trace_broker_shm), PAGE_SIZE) +
+         ring_size * TRACE_BROKER_CLIENTS_MAX;
+}
+
+static int map_trace_broker(struct trace_broker *broker, int fd,
+                            size_t map_size)
+{
+  void *map;
+
+  map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  broker->shm = (struct trace_broker_shm *)map;
+  broker->rings = (unsigned char *)map +
+                  ALIGN_UP(sizeof(struct trace_broker_shm), PAGE_SIZE);
+  broker->map_size = map_size;
+
+  return 0;
+}
+
+static void wake_broker_word(_Atomic uint32_t *word)
+{
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Wait while *word is val. Returns -1 if peer exits first. */
+static int wait_broker_word(_Atomic uint32_t *word, uint32_t val, pid_t peer)
+{
+  const struct timespec timeout = {0, TRACE_BROKER_PEER_CHECK_NS};
+  long ret;
+
+  while (atomic_load_explicit(word, memory_order_acquire) == val) {
+    ret = syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, val, &timeout, NULL,
+                  0);
+    if (ret < 0 && errno == ETIMEDOUT && kill(peer, 0) < 0 &&
+        errno == ESRCH) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* The ring of every slot is ring_size bytes, which must be a multiple of the
+ * frame size so that no frame wraps. */
+int create_trace_broker(struct trace_broker *broker, const char *name,
+                        size_t ring_size)
+{
+  size_t map_size;
+  int fd;
+
+  memset(broker, 0, sizeof(*broker));
+
+  if (ring_size == 0 || ring_size % FORMATTER_FRAME_SIZE != 0) {
+    fprintf(stderr, "Invalid broker ring size: %zu\n", ring_size);
+    return -1;
+  }
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    perror("shm_open");
+    return -1;
+  }
+  map_size = get_broker_map_size(ring_size);
+  if (ftruncate(fd, map_size) < 0) {
+    perror("ftruncate");
+    goto err;
+  }
+  if (map_trace_broker(broker, fd, map_size) < 0) {
+    goto err;
+  }
+  close(fd);
+
+  strncpy(broker->name, name, sizeof(broker->name) - 1);
+  broker->shm->broker_pid = getpid();
+  broker->shm->ring_size = ring_size;
+  /* Clients check the magic last. */
+  atomic_thread_fence(memory_order_release);
+  broker->shm->magic = TRACE_BROKER_MAGIC;
+
+  return 0;
+
+err:
+  close(fd);
+  shm_unlink(name);
+  return -1;
+}
+
+void destroy_trace_broker(struct trace_broker *broker)
+{
+  if (!broker->shm) {
+    return;
+  }
+  broker->shm->magic = 0;
+  munmap(broker->shm, broker->map_size);
+  shm_unlink(broker->name);
+  broker->shm = NULL;
+}
+
+void set_broker_slot_state(struct broker_slot *slot, broker_slot_state_t state)
+{
+  atomic_store_explicit(&slot->state, state, memory_order_release);
+  wake_broker_word(&slot->state);
+}
+
+/* All trace up to flush request req is in the ring. */
+void ack_broker_flush(struct broker_slot *slot, uint32_t req)
+{
+  slot->flushes++;
+  atomic_store_explicit(&slot->flush_ack, req, memory_order_release);
+  wake_broker_word(&slot->flush_ack);
+}
+
+void init_broker_stream(struct broker_stream *stream)
+{
+  stream->out.buf = stream->block;
+  stream->out.size = sizeof(stream->block);
+  stream->out.len = 0;
+  stream->out.dropped = 0;
+  stream->len = 0;
+}
+
+/* Mark a gap in the trace of the slot at its tail. The partial frame is
+ * dropped with it. */
+static void mark_broker_gap(struct broker_slot *slot,
+                            struct broker_stream *stream)
+{
+  stream->len = 0;
+  atomic_store_explicit(&slot->gap,
+                        atomic_load_explicit(&slot->tail, memory_order_relaxed),
+                        memory_order_relaxed);
+  atomic_fetch_add_explicit(&slot->gaps, 1, memory_order_release);
+}
+
+/* A frame that does not fit is dropped, and so are the frames after it until
+ * the client has read up to the gap. The client decoder resyncs at the next
+ * A-sync after it. */
+static void push_broker_frame(struct trace_broker *broker, int index,
+                              struct broker_stream *stream)
+{
+  struct broker_slot *slot;
+  unsigned char *ring;
+  uint64_t ring_size;
+  uint64_t tail;
+  uint64_t head;
+
+  slot = &broker->shm->slots[index];
+  ring_size = broker->shm->ring_size;
+  ring = broker->rings + ring_size * index;
+
+  tail = atomic_load_explicit(&slot->tail, memory_order_relaxed);
+  head = atomic_load_explicit(&slot->head, memory_order_acquire);
+  if (atomic_load_explicit(&slot->gaps, memory_order_relaxed) > 0 &&
+      head < atomic_load_explicit(&slot->gap, memory_order_relaxed)) {
+    slot->dropped++;
+    stream->len = 0;
+    return;
+  }
+  if (tail - head + FORMATTER_FRAME_SIZE > ring_size) {
+    slot->dropped++;
+    mark_broker_gap(slot, stream);
+    return;
+  }
+
+  pack_frame(slot->trace_id, stream->data, stream->len,
+             &ring[tail % ring_size]);
+  slot->bytes += stream->len;
+  slot->frames++;
+  stream->len = 0;
+  atomic_store_explicit(&slot->tail, tail + FORMATTER_FRAME_SIZE,
+                        memory_order_release);
+}
+
+/* Re-frame what the demultiplexer extracted for the slot into its ring. */
+static void deliver_broker_stream(struct trace_broker *broker,
+                                  struct broker_stream *stream, int index)
+{
+  size_t offset;
+  size_t n;
+
+  for (offset = 0; offset < stream->out.len; offset += n) {
+    n = BROKER_FRAME_DATA - stream->len;
+    if (n > stream->out.len - offset) {
+      n = stream->out.len - offset;
+    }
+    memcpy(&stream->data[stream->len], &stream->out.buf[offset], n);
+    stream->len += n;
+    if (stream->len == BROKER_FRAME_DATA) {
+      push_broker_frame(broker, index, stream);
+    }
+  }
+  stream->out.len = 0;
+}
+
+/* Split the formatter frames from the sink by trace ID in one pass over each
+ * block, and deliver the bytes of each slot to its ring. streams holds one
+ * entry per slot, bound to the demultiplexer under the trace ID of the slot
+ * while it is active. */
+void demux_broker_trace(struct trace_broker *broker,
+                        struct deformat_demux *demux,
+                        struct broker_stream *streams, const unsigned char *buf,
+                        size_t size)
+{
+  size_t offset;
+  size_t n;
+  int index;
+
+  for (offset = 0; offset < size; offset += n) {
+    n = size - offset;
+    if (n > TRACE_BROKER_DEMUX_BLOCK) {
+      n = TRACE_BROKER_DEMUX_BLOCK;
+    }
+    demux_frames(demux, &buf[offset], n);
+    for (index = 0; index < TRACE_BROKER_CLIENTS_MAX; index++) {
+      if (streams[index].out.len > 0) {
+        deliver_broker_stream(broker, &streams[index], index);
+      }
+    }
+  }
+}
+
+/* Push out the partial frame of the slot, so that the client sees all trace
+ * demultiplexed so far. */
+void flush_broker_stream(struct trace_broker *broker,
+                         struct broker_stream *stream, int index)
+{
+  if (stream->len > 0) {
+    push_broker_frame(broker, index, stream);
+  }
+}
+
+/* Trace of the slot was lost before it reached the demultiplexer. */
+void drop_broker_stream(struct trace_broker *broker,
+                        struct broker_stream *stream, int index)
+{
+  stream->out.len = 0;
+  mark_broker_gap(&broker->shm->slots[index], stream);
+}
+
+void dump_broker_slot(FILE *stream, struct broker_slot *slot)
+{
+  fprintf(stream,
+          "Client %d (CPU #%d, ID 0x%x): %lu bytes in %lu frames, %lu frames "
+          "dropped, %lu flushes\n",
+          slot->pid, slot->cpu, slot->trace_id, (unsigned long)slot->bytes,
+          (unsigned long)slot->frames, (unsigned long)slot->dropped,
+          (unsigned long)slot->flushes);
+}
+
+int open_broker_client(struct broker_client *client, const char *name)
+{
+  struct trace_broker_shm *shm;
+  struct stat st;
+  int fd;
+
+  memset(client, 0, sizeof(*client));
+
+  fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    perror("shm_open");
+    return -1;
+  }
+  if (fstat(fd, &st) < 0) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(struct trace_broker_shm) ||
+      map_trace_broker(&client->broker, fd, st.st_size) < 0) {
+    fprintf(stderr, "Invalid trace broker: %s\n", name);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  shm = client->broker.shm;
+  if (shm->magic != TRACE_BROKER_MAGIC ||
+      get_broker_map_size(shm->ring_size) != (size_t)st.st_size) {
+    fprintf(stderr, "Invalid trace broker: %s\n", name);
+    munmap(shm, client->broker.map_size);
+    client->broker.shm = NULL;
+    return -1;
+  }
+  strncpy(client->broker.name, name, sizeof(client->broker.name) - 1);
+  client->ring_size = shm->ring_size;
+
+  return 0;
+}
+
+/* Claim a slot and wait for the broker to enable the ETM of cpu with the
+ * given ranges, under trace_id and filtered on cid if it is not 0. */
+int register_broker_client(struct broker_client *client, int cpu, int trace_id,
+                           pid_t cid, const struct map_info *range,
+                           int range_count)
+{
+  struct trace_broker_shm *shm;
+  struct broker_slot *slot;
+  uint32_t expected;
+  uint32_t state;
+  int index;
+  int i;
+
+  shm = client->broker.shm;
+  if (range_count > RANGE_MAX) {
+    return -1;
+  }
+
+  slot = NULL;
+  for (index = 0; index < TRACE_BROKER_CLIENTS_MAX; index++) {
+    expected = broker_slot_free;
+    if (atomic_compare_exchange_strong(&shm->slots[index].state, &expected,
+                                       broker_slot_claimed)) {
+      slot = &shm->slots[index];
+      break;
+    }
+  }
+  if (!slot) {
+    fprintf(stderr, "No free trace broker slot\n");
+    return -1;
+  }
+
+  slot->pid = getpid();
+  slot->cpu = cpu;
+  slot->cid = cid;
+  slot->trace_id = trace_id;
+  slot->range_count = range_count;
+  for (i = 0; i < range_count; i++) {
+    slot->ranges[i].start = range[i].start;
+    slot->ranges[i].end = range[i].end;
+  }
+  atomic_store(&slot->flush_req, 0);
+  atomic_store(&slot->flush_ack, 0);
+  atomic_store(&slot->tail, 0);
+  atomic_store(&slot->head, 0);
+  atomic_store(&slot->gap, 0);
+  atomic_store(&slot->gaps, 0);
+  slot->bytes = 0;
+  slot->frames = 0;
+  slot->dropped = 0;
+  slot->flushes = 0;
+
+  set_broker_slot_state(slot, broker_slot_ready);
+  if (wait_broker_word(&slot->state, broker_slot_ready, shm->broker_pid) < 0) {
+    fprintf(stderr, "Trace broker exited\n");
+    atomic_store(&slot->state, broker_slot_free);
+    return -1;
+  }
+
+  state = atomic_load_explicit(&slot->state, memory_order_acquire);
+  if (state != broker_slot_active) {
+    fprintf(stderr, "Trace broker rejected CPU #%d with ID 0x%x\n", cpu,
+            trace_id);
+    atomic_store(&slot->state, broker_slot_free);
+    return -1;
+  }
+
+  client->slot = slot;
+  client->ring = client->broker.rings + client->ring_size * index;
+  client->gaps = 0;
+  client->lost = false;
+
+  return 0;
+}
+
+void close_broker_client(struct broker_client *client)
+{
+  if (client->slot) {
+    set_broker_slot_state(client->slot, broker_slot_closing);
+    client->slot = NULL;
+  }
+  if (client->broker.shm) {
+    munmap(client->broker.shm, client->broker.map_size);
+    client->broker.shm = NULL;
+  }
+}
+
+/* Wait until the trace the ETM recorded so far is in the ring. */
+int sync_broker_client(struct broker_client *client)
+{
+  struct broker_slot *slot;
+  uint32_t req;
+  uint32_t ack;
+
+  slot = client->slot;
+  req = atomic_load_explicit(&slot->flush_req, memory_order_relaxed) + 1;
+  atomic_store_explicit(&slot->flush_req, req, memory_order_release);
+
+  while ((ack = atomic_load_explicit(&slot->flush_ack,
+                                     memory_order_acquire)) != req) {
+    if (wait_broker_word(&slot->flush_ack, ack,
+                         client->broker.shm->broker_pid) < 0) {
+      fprintf(stderr, "Trace broker exited\n");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void discard_broker_client(struct broker_client *client)
+{
+  client->lost = true;
+  atomic_store_explicit(
+      &client->slot->head,
+      atomic_load_explicit(&client->slot->tail, memory_order_acquire),
+      memory_order_release);
+}
+
+size_t get_broker_backlog(struct broker_client *client)
+{
+  return (size_t)(atomic_load_explicit(&client->slot->tail,
+                                       memory_order_acquire) -
+                  atomic_load_explicit(&client->slot->head,
+                                       memory_order_relaxed));
+}
+
+/* Bytes the broker has delivered since registration. */
+uint64_t get_broker_write_pos(struct broker_client *client)
+{
+  return atomic_load_explicit(&client->slot->tail, memory_order_acquire);
+}
+
+/* Tell whether the trace read from head on follows a gap. A gap that is not
+ * at head is at or past the tail that was read, since the broker pushes
+ * nothing after a gap until head reaches it, and is left for the next read.
+ * Any gap seen before the last one is then at head. */
+static bool take_broker_gap(struct broker_client *client, uint64_t head)
+{
+  uint64_t gaps;
+  uint64_t gap;
+  bool ret;
+
+  gaps = atomic_load_explicit(&client->slot->gaps, memory_order_acquire);
+  gap = atomic_load_explicit(&client->slot->gap, memory_order_relaxed);
+  ret = client->lost;
+  client->lost = false;
+  if (gaps == client->gaps) {
+    return ret;
+  }
+
+  if (gap <= head) {
+    client->gaps = gaps;
+    return true;
+  }
+  ret |= gaps - client->gaps > 1;
+  client->gaps = gaps - 1;
+
+  return ret;
+}
+
+/* gap is set if the trace read does not continue the trace read before. */
+size_t read_broker_client(struct broker_client *client, void *buf, size_t size,
+                          bool *gap)
+{
+  uint64_t head;
+  size_t offset;
+  size_t len;
+  size_t n;
+
+  len = get_broker_backlog(client);
+  if (len > size) {
+    len = size;
+  }
+
+  head = atomic_load_explicit(&client->slot->head, memory_order_relaxed);
+  *gap = len > 0 && take_broker_gap(client, head);
+  offset = head % client->ring_size;
+  n = client->ring_size - offset;
+  if (n > len) {
+    n = len;
+  }
+  memcpy(buf, &client->ring[offset], n);
+  memcpy((unsigned char *)buf + n, client->ring, len - n);
+  atomic_store_explicit(&client->slot->head, head + len, memory_order_release);
+
+  return len;
+}
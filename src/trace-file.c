@@ -0,0 +1,395 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "trace-file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define TRACE_FILE_INDEX_STEP 64
+
+static int write_all(struct trace_file_writer *writer, const void *buf,
+                     size_t size)
+{
+  if (size > 0 && fwrite(buf, 1, size, writer->fp) != size) {
+    perror("fwrite");
+    return -1;
+  }
+  writer->file_offset += size;
+
+  return 0;
+}
+
+int open_trace_file(struct trace_file_writer *writer, const char *path,
+                    int trace_id, const char *board_name)
+{
+  struct trace_file_header header;
+
+  if (!writer || !path || trace_id < 0) {
+    return -1;
+  }
+
+  memset(writer, 0, sizeof(struct trace_file_writer));
+  writer->trace_id = trace_id;
+  init_async_scanner(&writer->scanner, trace_id);
+
+  writer->fp = fopen(path, "wb");
+  if (!writer->fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC));
+  header.version = TRACE_FILE_VERSION;
+  header.header_size = sizeof(header);
+  header.trace_id = trace_id;
+  if (board_name) {
+    strncpy(header.board, board_name, sizeof(header.board) - 1);
+  }
+  if (write_all(writer, &header, sizeof(header)) < 0) {
+    fclose(writer->fp);
+    writer->fp = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Record an A-sync that started in an earlier chunk than the one it ends in,
+ * unless that chunk has one already. The chunk header in the file was written
+ * before, so only the index gets it. */
+static void set_earlier_async(struct trace_file_writer *writer,
+                              const struct async_pos *pos)
+{
+  struct trace_file_chunk *chunk;
+  size_t i;
+
+  for (i = writer->index_count; i > 0; i--) {
+    chunk = &writer->index[i - 1];
+    if (chunk->raw_offset > pos->offset) {
+      continue;
+    }
+    if (chunk->sync_offset == TRACE_FILE_NO_SYNC) {
+      chunk->sync_offset = pos->offset - chunk->raw_offset;
+      chunk->sync_id = pos->cur_id;
+      if (pos->at_start) {
+        chunk->flags |= TRACE_CHUNK_ASYNC_START;
+      }
+    }
+    break;
+  }
+}
+
+/* Append one fetched chunk. raw is the formatted trace, used for the A-sync
+ * scan and the raw offsets, and data is what is stored, i.e. raw itself or
+ * its compressed form. Chunks must be written in fetch order. */
+int write_trace_file_chunk(struct trace_file_writer *writer, unsigned long seq,
+                           const void *raw, size_t raw_size, const void *data,
+                           size_t data_size, uint32_t flags)
+{
+  struct trace_file_chunk chunk;
+  struct trace_file_chunk *index;
+  struct async_pos pos[2];
+  size_t count;
+  size_t i;
+
+  if (!writer || !writer->fp || !raw || !data) {
+    return -1;
+  }
+
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.magic = TRACE_FILE_CHUNK_MAGIC;
+  chunk.seq = seq;
+  chunk.file_offset = writer->file_offset + sizeof(chunk);
+  chunk.data_size = data_size;
+  chunk.raw_offset = writer->raw_offset;
+  chunk.raw_size = raw_size;
+  chunk.sync_offset = TRACE_FILE_NO_SYNC;
+  chunk.sync_id = FORMATTER_ID_NULL;
+  chunk.flags = flags & ~TRACE_CHUNK_ASYNC_START;
+
+  /* Only the first A-sync can have started in an earlier chunk. */
+  count = scan_async_stream(&writer->scanner, raw, raw_size, pos, 2);
+  for (i = 0; i < count; i++) {
+    if (pos[i].offset < writer->raw_offset) {
+      set_earlier_async(writer, &pos[i]);
+      continue;
+    }
+    chunk.sync_offset = pos[i].offset - writer->raw_offset;
+    chunk.sync_id = pos[i].cur_id;
+    if (pos[i].at_start) {
+      chunk.flags |= TRACE_CHUNK_ASYNC_START;
+    }
+    break;
+  }
+
+  if (writer->index_count == writer->index_size) {
+    index = realloc(writer->index,
+                    (writer->index_size + TRACE_FILE_INDEX_STEP) *
+                        sizeof(struct trace_file_chunk));
+    if (!index) {
+      perror("realloc");
+      return -1;
+    }
+    writer->index = index;
+    writer->index_size += TRACE_FILE_INDEX_STEP;
+  }
+
+  if (write_all(writer, &chunk, sizeof(chunk)) < 0 ||
+      write_all(writer, data, data_size) < 0) {
+    return -1;
+  }
+
+  writer->index[writer->index_count++] = chunk;
+  writer->raw_offset += raw_size;
+
+  return 0;
+}
+
+/* Write the memory map as of now, the index and the footer, and close the
+ * file. */
+int close_trace_file(struct trace_file_writer *writer,
+                     struct map_info *map_info, int count)
+{
+  struct trace_file_footer footer;
+  struct trace_file_map map;
+  int ret;
+  int i;
+
+  if (!writer || !writer->fp || (count > 0 && !map_info)) {
+    return -1;
+  }
+
+  ret = -1;
+
+  memset(&footer, 0, sizeof(footer));
+  footer.map_offset = writer->file_offset;
+  footer.map_count = (uint64_t)count;
+  memcpy(footer.magic, TRACE_FILE_FOOTER_MAGIC,
+         sizeof(TRACE_FILE_FOOTER_MAGIC));
+
+  for (i = 0; i < count; i++) {
+    memset(&map, 0, sizeof(map));
+    map.start = map_info[i].start;
+    map.end = map_info[i].end;
+    map.offset = (uint64_t)map_info[i].offset;
+    strncpy(map.path, map_info[i].path, sizeof(map.path) - 1);
+    if (write_all(writer, &map, sizeof(map)) < 0) {
+      goto exit;
+    }
+  }
+
+  footer.index_offset = writer->file_offset;
+  footer.chunk_count = writer->index_count;
+
+  if (write_all(writer, writer->index,
+                writer->index_count * sizeof(struct trace_file_chunk)) < 0 ||
+      write_all(writer, &footer, sizeof(footer)) < 0) {
+    goto exit;
+  }
+
+  ret = 0;
+
+exit:
+  if (fclose(writer->fp) != 0) {
+    perror("fclose");
+    ret = -1;
+  }
+  writer->fp = NULL;
+  free(writer->index);
+  writer->index = NULL;
+  writer->index_count = 0;
+  writer->index_size = 0;
+
+  return ret;
+}
+
+int map_trace_file(struct trace_file *file, const char *path)
+{
+  const struct trace_file_footer *footer;
+  struct stat st;
+  int fd;
+
+  if (!file || !path) {
+    return -1;
+  }
+
+  memset(file, 0, sizeof(struct trace_file));
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return -1;
+  }
+  if (fstat(fd, &st) < 0) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size <
+      sizeof(struct trace_file_header) + sizeof(struct trace_file_footer)) {
+    fprintf(stderr, "%s: Not a trace file\n", path);
+    close(fd);
+    return -1;
+  }
+
+  file->size = (size_t)st.st_size;
+  file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file->map == MAP_FAILED) {
+    perror("mmap");
+    file->map = NULL;
+    return -1;
+  }
+
+  file->header = (const struct trace_file_header *)file->map;
+  footer = (const struct trace_file_footer *)((const char *)file->map +
+                                              file->size - sizeof(*footer));
+
+  if (memcmp(file->header->magic, TRACE_FILE_MAGIC,
+             sizeof(TRACE_FILE_MAGIC)) ||
+      memcmp(footer->magic, TRACE_FILE_FOOTER_MAGIC,
+             sizeof(TRACE_FILE_FOOTER_MAGIC))) {
+    fprintf(stderr, "%s: Not a trace file\n", path);
+    goto err;
+  }
+  if (file->header->version != TRACE_FILE_VERSION) {
+    fprintf(stderr, "%s: Unsupported version %u\n", path,
+            file->header->version);
+    goto err;
+  }
+  if (file->header->header_size > file->size ||
+      footer->index_offset > file->size - sizeof(*footer) ||
+      footer->chunk_count > (file->size - sizeof(*footer) -
+                             footer->index_offset) /
+                                sizeof(struct trace_file_chunk) ||
+      footer->map_offset > footer->index_offset ||
+      footer->map_count > (footer->index_offset - footer->map_offset) /
+                              sizeof(struct trace_file_map)) {
+    fprintf(stderr, "%s: Truncated trace file\n", path);
+    goto err;
+  }
+
+  file->maps = (const struct trace_file_map *)((const char *)file->map +
+                                               footer->map_offset);
+  file->map_count = footer->map_count;
+  file->index = (const struct trace_file_chunk *)((const char *)file->map +
+                                                  footer->index_offset);
+  file->chunk_count = footer->chunk_count;
+
+  return 0;
+
+err:
+  unmap_trace_file(file);
+  return -1;
+}
+
+void unmap_trace_file(struct trace_file *file)
+{
+  if (file && file->map) {
+    munmap(file->map, file->size);
+    memset(file, 0, sizeof(struct trace_file));
+  }
+}
+
+/* Return the index of the chunk holding raw_offset, or -1. */
+ssize_t find_trace_file_chunk(const struct trace_file *file,
+                              uint64_t raw_offset)
+{
+  size_t lo;
+  size_t hi;
+  size_t mid;
+
+  lo = 0;
+  hi = file->chunk_count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (raw_offset < file->index[mid].raw_offset) {
+      hi = mid;
+    } else if (raw_offset >=
+               file->index[mid].raw_offset + file->index[mid].raw_size) {
+      lo = mid + 1;
+    } else {
+      return (ssize_t)mid;
+    }
+  }
+
+  return -1;
+}
+
+/* Return the stored data of chunk i as mapped, possibly compressed. */
+const void *get_trace_file_chunk(const struct trace_file *file, size_t i,
+                                 size_t *size)
+{
+  const struct trace_file_chunk *chunk;
+
+  if (!file || i >= file->chunk_count) {
+    return NULL;
+  }
+
+  chunk = &file->index[i];
+  if (chunk->file_offset > file->size ||
+      chunk->data_size > file->size - chunk->file_offset) {
+    return NULL;
+  }
+  if (size) {
+    *size = chunk->data_size;
+  }
+
+  return (const char *)file->map + chunk->file_offset;
+}
+
+/* Copy the raw trace of chunk i to buf. Returns the raw size or -1. */
+ssize_t read_trace_file_chunk(const struct trace_file *file, size_t i,
+                              void *buf, size_t size)
+{
+  const struct trace_file_chunk *chunk;
+  const void *data;
+  size_t data_size;
+
+  if (!(data = get_trace_file_chunk(file, i, &data_size))) {
+    return -1;
+  }
+
+  chunk = &file->index[i];
+  if (size < chunk->raw_size) {
+    return -1;
+  }
+
+  if (chunk->flags & TRACE_CHUNK_ZSTD) {
+#ifdef HAVE_ZSTD
+    size_t ret;
+
+    ret = ZSTD_decompress(buf, size, data, data_size);
+    if (ZSTD_isError(ret) || ret != chunk->raw_size) {
+      fprintf(stderr, "ZSTD_decompress() failed\n");
+      return -1;
+    }
+#else
+    fprintf(stderr, "Compressed chunk, but built without zstd\n");
+    return -1;
+#endif
+  } else {
+    if (data_size != chunk->raw_size) {
+      return -1;
+    }
+    memcpy(buf, data, data_size);
+  }
+
+  return (ssize_t)chunk->raw_size;
+}
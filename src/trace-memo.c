@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#include "trace-memo.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Fuzzing replays the same trace over and over. A trace is identified by a
+ * hash of its bytes and the generation of the memory map it was decoded
+ * against, and the words its decode added to the bitmap are kept, so that the
+ * next occurrence can be replayed without running the decoder.
+ */
+
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3 0x165667b19e3779f9ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t v)
+{
+  return rotl64(acc + v * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+static inline uint64_t load64(const unsigned char *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Four independent lanes over 32-byte blocks keep the multipliers busy. Not
+ * for adversarial input. */
+uint64_t hash_trace(const void *buf, size_t size, uint64_t seed)
+{
+  const unsigned char *p;
+  const unsigned char *end;
+  uint64_t acc[4];
+  uint64_t h;
+
+  p = (const unsigned char *)buf;
+  end = p + size;
+  acc[0] = seed + HASH_PRIME1 + HASH_PRIME2;
+  acc[1] = seed + HASH_PRIME2;
+  acc[2] = seed;
+  acc[3] = seed - HASH_PRIME1;
+
+  for (; end - p >= 32; p += 32) {
+    acc[0] = hash_round(acc[0], load64(p));
+    acc[1] = hash_round(acc[1], load64(p + 8));
+    acc[2] = hash_round(acc[2], load64(p + 16));
+    acc[3] = hash_round(acc[3], load64(p + 24));
+  }
+
+  h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) +
+      rotl64(acc[3], 18) + (uint64_t)size;
+  for (; end - p >= 8; p += 8) {
+    h = rotl64(h ^ hash_round(0, load64(p)), 27) * HASH_PRIME1 + HASH_PRIME3;
+  }
+  for (; p < end; p++) {
+    h = rotl64(h ^ (*p * HASH_PRIME3), 11) * HASH_PRIME1;
+  }
+
+  h ^= h >> 33;
+  h *= HASH_PRIME2;
+  h ^= h >> 29;
+  h *= HASH_PRIME3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+int init_trace_memo(struct trace_memo *memo, size_t nr_entries,
+                    size_t max_bytes)
+{
+  size_t size;
+
+  if (!memo || nr_entries == 0 || max_bytes == 0) {
+    return -1;
+  }
+
+  for (size = 1; size < nr_entries; size <<= 1) {
+  }
+
+  memset(memo, 0, sizeof(struct trace_memo));
+  memo->entries = calloc(size, sizeof(struct trace_memo_entry));
+  if (!memo->entries) {
+    perror("calloc");
+    return -1;
+  }
+  memo->mask = size - 1;
+  memo->max_bytes = max_bytes;
+
+  return 0;
+}
+
+static size_t entry_bytes(size_t nr_words)
+{
+  return nr_words * (sizeof(uint32_t) + sizeof(uint64_t));
+}
+
+static void evict_entry(struct trace_memo *memo,
+                        struct trace_memo_entry *entry)
+{
+  if (!entry->counts) {
+    return;
+  }
+
+  memo->used_bytes -= entry_bytes(entry->nr_words);
+  memo->evictions++;
+  free(entry->counts);
+  memset(entry, 0, sizeof(struct trace_memo_entry));
+}
+
+void fini_trace_memo(struct trace_memo *memo)
+{
+  size_t i;
+
+  if (!memo || !memo->entries) {
+    return;
+  }
+
+  for (i = 0; i <= memo->mask; i++) {
+    free(memo->entries[i].counts);
+  }
+  free(memo->entries);
+  memset(memo, 0, sizeof(struct trace_memo));
+}
+
+struct trace_memo_entry *find_trace_memo(struct trace_memo *memo,
+                                         uint64_t hash, size_t len,
+                                         uint32_t generation)
+{
+  struct trace_memo_entry *entry;
+
+  entry = &memo->entries[hash & memo->mask];
+  if (entry->counts && entry->hash == hash && entry->len == len &&
+      entry->generation == generation) {
+    memo->hits++;
+    return entry;
+  }
+  memo->misses++;
+
+  return NULL;
+}
+
+/* Remember the words harvested into cov. Older entries are evicted in clock
+ * order to stay within max_bytes. */
+int add_trace_memo(struct trace_memo *memo, uint64_t hash, size_t len,
+                   uint32_t generation, const struct coverage_buf *cov)
+{
+  struct trace_memo_entry *entry;
+  const uint64_t *words;
+  size_t bytes;
+  size_t i;
+
+  /* An empty trace is memoized as well, with a placeholder allocation. */
+  bytes = entry_bytes(cov->nr_touched > 0 ? cov->nr_touched : 1);
+  if (bytes > memo->max_bytes) {
+    memo->skipped++;
+    return -1;
+  }
+
+  entry = &memo->entries[hash & memo->mask];
+  evict_entry(memo, entry);
+  while (memo->used_bytes + bytes > memo->max_bytes) {
+    evict_entry(memo, &memo->entries[memo->clock]);
+    memo->clock = (memo->clock + 1) & memo->mask;
+  }
+
+  entry->counts = malloc(bytes);
+  if (!entry->counts) {
+    perror("malloc");
+    return -1;
+  }
+  entry->index = (uint32_t *)(entry->counts + cov->nr_touched);
+
+  words = (const uint64_t *)cov->buf;
+  for (i = 0; i < cov->nr_touched; i++) {
+    entry->index[i] = cov->touched[i];
+    entry->counts[i] = words[cov->touched[i]];
+  }
+  entry->hash = hash;
+  entry->len = len;
+  entry->generation = generation;
+  entry->nr_words = cov->nr_touched;
+  memo->used_bytes += bytes;
+
+  return 0;
+}
+
+void replay_trace_memo(const struct trace_memo_entry *entry,
+                       unsigned char *bitmap, size_t bitmap_size)
+{
+  unsigned char tail[sizeof(uint64_t)];
+  size_t nr_words;
+  size_t i;
+  size_t j;
+  uint64_t dst;
+  size_t off;
+
+  nr_words = bitmap_size / sizeof(uint64_t);
+
+  for (i = 0; i < entry->nr_words; i++) {
+    off = (size_t)entry->index[i] * sizeof(uint64_t);
+    if (entry->index[i] < nr_words) {
+      memcpy(&dst, bitmap + off, sizeof(dst));
+      dst = add_coverage_counters(dst, entry->counts[i]);
+      memcpy(bitmap + off, &dst, sizeof(dst));
+    } else {
+      memcpy(tail, &entry->counts[i], sizeof(tail));
+      for (j = 0; off + j < bitmap_size; j++) {
+        bitmap[off + j] += tail[j];
+      }
+    }
+  }
+}
+
+void dump_trace_memo_stats(FILE *stream, struct trace_memo *memo)
+{
+  unsigned long total;
+
+  total = memo->hits + memo->misses;
+  fprintf(stream,
+          "Trace memo: %lu hits, %lu misses (%.1f%%), %lu evicted, "
+          "%lu too large, %zu bytes used\n",
+          memo->hits, memo->misses,
+          total > 0 ? (double)memo->hits * 100.0 / (double)total : 0.0,
+          memo->evictions, memo->skipped, memo->used_bytes);
+}
@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "trace-pool.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <sys/mman.h>
+
+/* Chunks are prefaulted and recycled for the whole session, so page faults
+ * and RSS stay flat across executions. If the pool has a NUMA node, the chunk
+ * is bound to it before the first touch. */
+static struct trace_chunk *alloc_chunk(struct trace_pool *pool)
+{
+  struct trace_chunk *chunk;
+
+  if (pool->nr_chunks >= pool->max_chunks) {
+    return NULL;
+  }
+
+  chunk = malloc(sizeof(struct trace_chunk));
+  if (!chunk) {
+    perror("malloc");
+    return NULL;
+  }
+
+  chunk->buf = mmap(NULL, pool->chunk_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk->buf == MAP_FAILED) {
+    perror("mmap");
+    free(chunk);
+    return NULL;
+  }
+  if (pool->node >= 0 &&
+      bind_memory_node(chunk->buf, pool->chunk_size, pool->node) < 0) {
+    fprintf(stderr, "WARNING: Failed to bind trace chunk to node %d\n",
+            pool->node);
+  }
+  memset(chunk->buf, 0, pool->chunk_size);
+  chunk->size = pool->chunk_size;
+  chunk->len = 0;
+  chunk->seq = 0;
+  chunk->next = NULL;
+  pool->nr_chunks++;
+
+  return chunk;
+}
+
+static void free_chunk(struct trace_pool *pool, struct trace_chunk *chunk)
+{
+  munmap(chunk->buf, chunk->size);
+  free(chunk);
+  pool->nr_chunks--;
+}
+
+int init_trace_pool(struct trace_pool *pool, size_t chunk_size,
+                    size_t nr_prealloc, size_t max_size, int node)
+{
+  struct trace_chunk *chunk;
+  size_t i;
+
+  if (!pool || chunk_size == 0) {
+    return -1;
+  }
+
+  memset(pool, 0, sizeof(struct trace_pool));
+  pool->chunk_size = chunk_size;
+  pool->node = node;
+  pool->max_chunks = max_size / chunk_size;
+  if (pool->max_chunks < nr_prealloc) {
+    pool->max_chunks = nr_prealloc;
+  }
+  /* Every chunk is queued at most once, so the ring never fills up. */
+  if (init_chunk_ring(&pool->filled, pool->max_chunks) < 0) {
+    pool->chunk_size = 0;
+    return -1;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->free_cond, NULL);
+
+  for (i = 0; i < nr_prealloc; i++) {
+    if (!(chunk = alloc_chunk(pool))) {
+      fini_trace_pool(pool);
+      return -1;
+    }
+    chunk->next = pool->free_list;
+    pool->free_list = chunk;
+  }
+
+  return 0;
+}
+
+void fini_trace_pool(struct trace_pool *pool)
+{
+  struct trace_chunk *chunk;
+
+  if (!pool || pool->chunk_size == 0) {
+    return;
+  }
+
+  while ((chunk = dequeue_filled_chunk(pool)) != NULL) {
+    free_chunk(pool, chunk);
+  }
+  while ((chunk = pool->free_list) != NULL) {
+    pool->free_list = chunk->next;
+    free_chunk(pool, chunk);
+  }
+
+  pthread_cond_destroy(&pool->free_cond);
+  pthread_mutex_destroy(&pool->mutex);
+  fini_chunk_ring(&pool->filled);
+  pool->chunk_size = 0;
+}
+
+/* Get an empty chunk. Grows the pool up to max_chunks. Once the pool is at
+ * its bound, either fail or wait until another thread puts a chunk back. */
+struct trace_chunk *get_free_chunk(struct trace_pool *pool, bool wait)
+{
+  struct trace_chunk *chunk;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    if ((chunk = pool->free_list) != NULL) {
+      pool->free_list = chunk->next;
+      break;
+    }
+    if ((chunk = alloc_chunk(pool)) != NULL || !wait) {
+      break;
+    }
+    pthread_cond_wait(&pool->free_cond, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (chunk) {
+    chunk->len = 0;
+    chunk->reset = false;
+    chunk->refs = 1;
+    chunk->next = NULL;
+  }
+
+  return chunk;
+}
+
+/* Take another reference, e.g. while a chunk is both decoded and written. */
+void hold_chunk(struct trace_pool *pool, struct trace_chunk *chunk)
+{
+  pthread_mutex_lock(&pool->mutex);
+  chunk->refs++;
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Drop a reference. The chunk is recycled when the last one is gone. */
+void put_free_chunk(struct trace_pool *pool, struct trace_chunk *chunk)
+{
+  pthread_mutex_lock(&pool->mutex);
+  if (--chunk->refs <= 0) {
+    chunk->next = pool->free_list;
+    pool->free_list = chunk;
+    pthread_cond_signal(&pool->free_cond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Hand a filled chunk from the fetching thread to the decoding thread.
+ * Only one thread may queue and one may dequeue at a time. */
+void queue_filled_chunk(struct trace_pool *pool, struct trace_chunk *chunk)
+{
+  struct chunk_desc desc;
+
+  desc.chunk = chunk;
+  desc.len = chunk->len;
+  desc.seq = chunk->seq;
+  while (!push_chunk_desc(&pool->filled, &desc)) {
+    sched_yield();
+  }
+}
+
+struct trace_chunk *dequeue_filled_chunk(struct trace_pool *pool)
+{
+  struct chunk_desc desc;
+
+  if (!pop_chunk_desc(&pool->filled, &desc)) {
+    return NULL;
+  }
+  desc.chunk->len = desc.len;
+  desc.chunk->seq = desc.seq;
+
+  return desc.chunk;
+}
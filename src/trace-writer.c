@@ -0,0 +1,170 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "trace-writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+
+#define TRACE_WRITER_ZSTD_LEVEL 3
+#endif
+
+/* Compress each chunk on its own, so that any chunk of the trace file can be
+ * decompressed without the others. */
+static int write_chunk(struct trace_writer *writer, struct trace_chunk *chunk)
+{
+  const void *out;
+  size_t out_size;
+  uint32_t flags;
+
+#ifdef HAVE_ZSTD
+  out_size = ZSTD_compress(writer->out_buf, writer->out_buf_size, chunk->buf,
+                           chunk->len, TRACE_WRITER_ZSTD_LEVEL);
+  if (ZSTD_isError(out_size)) {
+    fprintf(stderr, "ZSTD_compress() failed: %s\n",
+            ZSTD_getErrorName(out_size));
+    return -1;
+  }
+  out = writer->out_buf;
+  flags = TRACE_CHUNK_ZSTD;
+#else
+  out = chunk->buf;
+  out_size = chunk->len;
+  flags = 0;
+#endif
+
+  if (write_trace_file_chunk(writer->file, chunk->seq, chunk->buf, chunk->len,
+                             out, out_size, flags) < 0) {
+    return -1;
+  }
+  writer->bytes_in += chunk->len;
+  writer->bytes_out += out_size;
+
+  return 0;
+}
+
+static void *trace_writer_worker(void *arg)
+{
+  struct trace_writer *writer;
+  struct trace_chunk *chunk;
+
+  writer = (struct trace_writer *)arg;
+
+  while (1) {
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->queue_count == 0 && !writer->stopping) {
+      pthread_cond_wait(&writer->cond, &writer->mutex);
+    }
+    if (writer->queue_count == 0) {
+      pthread_mutex_unlock(&writer->mutex);
+      break;
+    }
+    chunk = writer->queue[writer->queue_head];
+    writer->queue_head = (writer->queue_head + 1) % writer->queue_size;
+    writer->queue_count--;
+    pthread_mutex_unlock(&writer->mutex);
+
+    if (!writer->failed && write_chunk(writer, chunk) < 0) {
+      fprintf(stderr, "Failed to write trace. Streaming stopped\n");
+      writer->failed = true;
+    }
+    put_free_chunk(writer->pool, chunk);
+  }
+
+  return NULL;
+}
+
+int start_trace_writer(struct trace_writer *writer,
+                       struct trace_file_writer *file, struct trace_pool *pool)
+{
+  int ret;
+
+  if (!writer || !file || !pool) {
+    return -1;
+  }
+
+  memset(writer, 0, sizeof(struct trace_writer));
+  writer->file = file;
+  writer->pool = pool;
+
+  /* A chunk is queued at most once, so the queue never overflows. */
+  writer->queue_size = pool->max_chunks;
+  writer->queue = calloc(writer->queue_size, sizeof(struct trace_chunk *));
+  if (!writer->queue) {
+    perror("calloc");
+    return -1;
+  }
+
+#ifdef HAVE_ZSTD
+  writer->out_buf_size = ZSTD_compressBound(pool->chunk_size);
+  writer->out_buf = malloc(writer->out_buf_size);
+  if (!writer->out_buf) {
+    perror("malloc");
+    goto err;
+  }
+#endif
+
+  pthread_mutex_init(&writer->mutex, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+
+  ret = pthread_create(&writer->thread, NULL, trace_writer_worker, writer);
+  if (ret != 0) {
+    fprintf(stderr, "pthread_create() failed: %d\n", ret);
+    pthread_cond_destroy(&writer->cond);
+    pthread_mutex_destroy(&writer->mutex);
+    goto err;
+  }
+
+  return 0;
+
+err:
+  free(writer->out_buf);
+  free(writer->queue);
+  writer->out_buf = NULL;
+  writer->queue = NULL;
+  return -1;
+}
+
+/* Hand the caller's reference to chunk over to the writer thread. */
+void write_trace_chunk(struct trace_writer *writer, struct trace_chunk *chunk)
+{
+  pthread_mutex_lock(&writer->mutex);
+  writer->queue[(writer->queue_head + writer->queue_count) %
+                writer->queue_size] = chunk;
+  writer->queue_count++;
+  pthread_cond_signal(&writer->cond);
+  pthread_mutex_unlock(&writer->mutex);
+}
+
+/* Write out the queued chunks. The trace file is left open. */
+int stop_trace_writer(struct trace_writer *writer)
+{
+  if (!writer || !writer->queue) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&writer->mutex);
+  writer->stopping = true;
+  pthread_cond_signal(&writer->cond);
+  pthread_mutex_unlock(&writer->mutex);
+
+  pthread_join(writer->thread, NULL);
+
+  pthread_cond_destroy(&writer->cond);
+  pthread_mutex_destroy(&writer->mutex);
+  free(writer->out_buf);
+  free(writer->queue);
+  writer->out_buf = NULL;
+  writer->queue = NULL;
+
+  return writer->failed ? -1 : 0;
+}
@@ -10,6 +10,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
 #include <string.h>
 #include <limits.h>
 #include <sched.h>
@@ -17,16 +19,24 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <elf.h>
 #include <pthread.h>
 
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/ptrace.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sysinfo.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
-#include <linux/elf.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/futex.h>
 #include <linux/limits.h>
+#include <linux/mempolicy.h>
+#include <linux/seccomp.h>
 
 #include <asm/ptrace.h>
 #include <asm/unistd.h>
@@ -34,6 +44,9 @@
 #define MAX_LINE 8192
 #define MAX_CPUS 4096
 
+#define UDMABUF_CLASS_ROOT "/sys/class/u-dma-buf"
+#define UDMABUF_DEV_ROOT "/dev"
+
 void dump_buf(void *buf, size_t buf_size, const char *buf_path)
 {
   FILE *fp;
@@ -94,14 +107,106 @@ void dump_maps(FILE *stream, pid_t pid)
   return;
 }
 
-int setup_map_info(pid_t pid, struct map_info *map_info, int info_count_max)
+/* Whether a mapped file is selected by modules, a comma-separated list of
+ * "main" for the executable, paths, or library names such as "libpng16" or
+ * "libpng16.so.16". Without modules, only the executable is selected. */
+static bool is_traced_module(const char *path, const char *exe_path,
+                             const char *modules)
+{
+  const char *base;
+  const char *token;
+  size_t len;
+
+  if (!modules) {
+    return !strcmp(path, exe_path);
+  }
+
+  base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+
+  for (token = modules; *token; token += len + (token[len] == ',')) {
+    len = strcspn(token, ",");
+    if (len == 0) {
+      continue;
+    }
+    if (len == 4 && !strncmp(token, "main", 4)) {
+      if (!strcmp(path, exe_path)) {
+        return true;
+      }
+    } else if ((strlen(path) == len && !strncmp(path, token, len)) ||
+               (!strncmp(base, token, len) &&
+                (base[len] == '\0' || base[len] == '.' || base[len] == '-'))) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Whether each module of modules other than "main" matches an entry of
+ * map_info. Libraries are not mapped yet while the target stops at exec. */
+bool has_traced_modules(struct map_info *map_info, int count,
+                        const char *modules)
+{
+  char module[PATH_MAX];
+  const char *token;
+  size_t len;
+  bool found;
+  int i;
+
+  for (token = modules; *token; token += len + (token[len] == ',')) {
+    len = strcspn(token, ",");
+    if (len == 0 || len >= sizeof(module) ||
+        (len == 4 && !strncmp(token, "main", 4))) {
+      continue;
+    }
+    memcpy(module, token, len);
+    module[len] = '\0';
+    found = false;
+    for (i = 0; i < count && !found; i++) {
+      found = is_traced_module(map_info[i].path, "", module);
+    }
+    if (!found) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool has_map_info(struct map_info *map_info, int count,
+                         unsigned long start, off_t offset, const char *path)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (map_info[i].start == start && map_info[i].offset == offset &&
+        !strcmp(map_info[i].path, path)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int setup_map_info(pid_t pid, struct map_info *map_info, int info_count_max,
+                   const char *modules)
+{
+  return update_map_info(pid, map_info, 0, info_count_max, modules);
+}
+
+/* Append the executable regions of modules that are not in the first count
+ * entries of map_info yet. Returns the new count. */
+int update_map_info(pid_t pid, struct map_info *map_info, int count,
+                    int info_count_max, const char *modules)
 {
   FILE *fp;
   char maps_path[PATH_MAX];
+  char exe_path[PATH_MAX];
   char *line;
   size_t n;
   ssize_t readn;
-  int count;
+  int old_count;
   char *path;
   int fd;
   size_t buf_size;
@@ -114,6 +219,13 @@ int setup_map_info(pid_t pid, struct map_info *map_info, int info_count_max)
   char x;
   char c;
 
+  memset(exe_path, 0, sizeof(exe_path));
+  snprintf(maps_path, sizeof(maps_path), "/proc/%d/exe", pid);
+  if (readlink(maps_path, exe_path, sizeof(exe_path) - 1) < 0) {
+    perror("readlink");
+    return -1;
+  }
+
   memset(maps_path, 0, sizeof(maps_path));
   snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", pid);
 
@@ -125,7 +237,7 @@ int setup_map_info(pid_t pid, struct map_info *map_info, int info_count_max)
 
   line = NULL;
   n = 0;
-  count = 0;
+  old_count = count;
   while ((readn = getline(&line, &n, fp)) != -1) {
     if (readn > 0 && line[readn - 1] == '\n') {
       line[readn - 1] = '\0';
@@ -136,13 +248,14 @@ int setup_map_info(pid_t pid, struct map_info *map_info, int info_count_max)
       /* Not an executable region */
       continue;
     }
-    if (count >= info_count_max) {
-      fprintf(stderr, "INFO: [0x%lx-0x%lx] will not be traced\n", start, end);
-      continue;
-    }
     /* Search absolute path */
     path = strchr(line, '/');
-    if (!path) {
+    if (!path || !is_traced_module(path, exe_path, modules) ||
+        has_map_info(map_info, old_count, start, offset, path)) {
+      continue;
+    }
+    if (count >= info_count_max) {
+      fprintf(stderr, "INFO: [0x%lx-0x%lx] will not be traced\n", start, end);
       continue;
     }
     map_info[count].start = start;
@@ -158,7 +271,7 @@ int setup_map_info(pid_t pid, struct map_info *map_info, int info_count_max)
   }
   fclose(fp);
 
-  for (i = 0; i < count; i++) {
+  for (i = old_count; i < count; i++) {
     if ((fd = open(map_info[i].path, O_RDONLY | O_SYNC)) < -1) {
       perror("open");
       return -1;
@@ -307,9 +420,56 @@ exit:
   return ret;
 }
 
-/* Find CPU core in the same group of CPU binded to the PID process. */
-/* NOTE: This is not supported by the Jetson family. */
-int get_preferred_cpu(pid_t pid)
+/* Parse a sysfs CPU list such as "0-27,56-83" into cpu_set. */
+static int parse_cpu_list(const char *list_path, cpu_set_t *cpu_set,
+                          size_t setsize)
+{
+  FILE *fp;
+  char *token;
+  size_t n;
+  ssize_t readn;
+  int first;
+  int last;
+  int cpu;
+  int ret;
+
+  ret = -1;
+
+  fp = fopen(list_path, "r");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  token = NULL;
+  n = 0;
+  while ((readn = getdelim(&token, &n, ',', fp)) != -1) {
+    switch (sscanf(token, "%d-%d", &first, &last)) {
+      case 1:
+        last = first;
+        break;
+      case 2:
+        break;
+      default:
+        continue;
+    }
+    for (cpu = first; cpu <= last; cpu++) {
+      CPU_SET_S(cpu, setsize, cpu_set);
+    }
+  }
+
+  ret = 0;
+
+  if (token) {
+    free(token);
+  }
+  fclose(fp);
+
+  return ret;
+}
+
+static int get_preferred_cpu_in(pid_t pid, cpu_set_t *candidates,
+                                size_t candidates_setsize)
 {
   int ret;
   int i;
@@ -346,6 +506,9 @@ int get_preferred_cpu(pid_t pid)
   }
 
   for (i = 0; i < nprocs; i++) {
+    if (candidates && !CPU_ISSET_S(i, candidates_setsize, candidates)) {
+      continue;
+    }
     if (!CPU_ISSET_S(i, core_setsize, core_cpu_set)) {
       preferred_cpu = i;
       break;
@@ -366,6 +529,37 @@ exit:
   return ret;
 }
 
+/* Find CPU core in the same group of CPU binded to the PID process. */
+/* NOTE: This is not supported by the Jetson family. */
+int get_preferred_cpu(pid_t pid)
+{
+  return get_preferred_cpu_in(pid, NULL, 0);
+}
+
+/* Same as get_preferred_cpu() but only picks a CPU on the NUMA node. */
+int get_preferred_node_cpu(pid_t pid, int node)
+{
+  int ret;
+  cpu_set_t *node_cpu_set;
+  size_t setsize;
+
+  ret = -1;
+
+  if (!alloc_cpu_set(&node_cpu_set, &setsize)) {
+    return -1;
+  }
+  if (get_node_cpus(node, node_cpu_set, setsize) < 0) {
+    goto exit;
+  }
+
+  ret = get_preferred_cpu_in(pid, node_cpu_set, setsize);
+
+exit:
+  CPU_FREE(node_cpu_set);
+
+  return ret;
+}
+
 /* ref:
  * https://github.com/AFLplusplus/AFLplusplus/blob/stable/src/afl-fuzz-init.c */
 /* Finds a free CPU core by reading procfs. */
@@ -478,6 +672,83 @@ exit:
   return ret;
 }
 
+int set_cpu_list_affinity(const int *cpus, int count, pid_t pid)
+{
+  int ret;
+  cpu_set_t *cpu_set;
+  size_t setsize;
+  int i;
+
+  ret = -1;
+
+  if (!alloc_cpu_set(&cpu_set, &setsize)) {
+    goto exit;
+  }
+  for (i = 0; i < count; i++) {
+    CPU_SET_S(cpus[i], setsize, cpu_set);
+  }
+  if (sched_setaffinity(pid, setsize, cpu_set) < 0) {
+    perror("sched_setaffinity");
+    goto exit;
+  }
+
+  ret = 0;
+
+exit:
+  if (cpu_set) {
+    CPU_FREE(cpu_set);
+  }
+
+  return ret;
+}
+
+/* Parse a CPU list argument such as "2-5,8" into cpus, in order and without
+ * duplicates. Returns the number of CPUs, or -1 if the list is malformed or
+ * longer than max. */
+int parse_cpu_arg(const char *arg, int *cpus, int max)
+{
+  const char *p;
+  char *end;
+  long first, last, cpu;
+  int count, i;
+
+  count = 0;
+  p = arg;
+  while (*p) {
+    first = strtol(p, &end, 10);
+    if (end == p || first < 0) {
+      return -1;
+    }
+    last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return -1;
+      }
+    }
+    for (cpu = first; cpu <= last; cpu++) {
+      for (i = 0; i < count && cpus[i] != cpu; i++)
+        ;
+      if (i < count) {
+        continue;
+      }
+      if (count >= max) {
+        return -1;
+      }
+      cpus[count++] = (int)cpu;
+    }
+    if (*end == ',') {
+      end++;
+    } else if (*end != '\0') {
+      return -1;
+    }
+    p = end;
+  }
+
+  return count > 0 ? count : -1;
+}
+
 int set_pthread_cpu_affinity(int cpu, pthread_t thread)
 {
   int ret;
@@ -505,6 +776,391 @@ exit:
   return ret;
 }
 
+int set_pthread_node_affinity(int node, pthread_t thread)
+{
+  int ret;
+  cpu_set_t *cpu_set;
+  size_t setsize;
+
+  ret = -1;
+
+  if (!alloc_cpu_set(&cpu_set, &setsize)) {
+    return -1;
+  }
+  if (get_node_cpus(node, cpu_set, setsize) < 0) {
+    goto exit;
+  }
+  if (pthread_setaffinity_np(thread, setsize, cpu_set) != 0) {
+    perror("pthread_setaffinity_np");
+    goto exit;
+  }
+
+  ret = 0;
+
+exit:
+  CPU_FREE(cpu_set);
+
+  return ret;
+}
+
+/* Find the "nodeN" link sysfs puts in CPU and memory block directories. */
+static int find_node_link(const char *dir_path)
+{
+  DIR *dir;
+  struct dirent *entry;
+  int node;
+
+  if (!(dir = opendir(dir_path))) {
+    perror("opendir");
+    return -1;
+  }
+
+  node = -1;
+  while ((entry = readdir(dir))) {
+    if (!strncmp(entry->d_name, "node", 4) && isdigit(entry->d_name[4])) {
+      node = atoi(&entry->d_name[4]);
+      break;
+    }
+  }
+  closedir(dir);
+
+  return node;
+}
+
+int get_cpu_node(int cpu)
+{
+  char cpu_path[PATH_MAX];
+
+  memset(cpu_path, 0, sizeof(cpu_path));
+  snprintf(cpu_path, sizeof(cpu_path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+  return find_node_link(cpu_path);
+}
+
+/* Look up the memory block holding phys_addr. Returns -1 if the region is not
+ * managed by the kernel, e.g. reserved with no-map. */
+int get_phys_addr_node(unsigned long phys_addr)
+{
+  char block_path[PATH_MAX];
+  char attr[64];
+  unsigned long block_size;
+  int fd;
+
+  if ((fd = open("/sys/devices/system/memory/block_size_bytes", O_RDONLY)) <
+      0) {
+    perror("open");
+    return -1;
+  }
+  memset(attr, 0, sizeof(attr));
+  if (read(fd, attr, sizeof(attr) - 1) < 0) {
+    perror("read");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  block_size = strtoul(attr, NULL, 16);
+  if (block_size == 0) {
+    return -1;
+  }
+
+  memset(block_path, 0, sizeof(block_path));
+  snprintf(block_path, sizeof(block_path),
+           "/sys/devices/system/memory/memory%lu", phys_addr / block_size);
+
+  return find_node_link(block_path);
+}
+
+int get_node_cpus(int node, cpu_set_t *cpu_set, size_t setsize)
+{
+  char cpulist_path[PATH_MAX];
+
+  if (node < 0 || !cpu_set) {
+    return -1;
+  }
+
+  memset(cpulist_path, 0, sizeof(cpulist_path));
+  snprintf(cpulist_path, sizeof(cpulist_path),
+           "/sys/devices/system/node/node%d/cpulist", node);
+
+  return parse_cpu_list(cpulist_path, cpu_set, setsize);
+}
+
+/* Bind [addr, addr + len) to the node. Pages already faulted are migrated. */
+int bind_memory_node(void *addr, size_t len, int node)
+{
+  unsigned long nodemask;
+
+  if (!addr || node < 0 || node >= (int)(sizeof(nodemask) * 8)) {
+    return -1;
+  }
+
+  nodemask = 1UL << node;
+  if (syscall(SYS_mbind, addr, len, MPOL_BIND, &nodemask,
+              sizeof(nodemask) * 8 + 1, MPOL_MF_MOVE) < 0) {
+    perror("mbind");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Returns the node of the page backing addr. */
+int get_memory_node(void *addr)
+{
+  int node;
+
+  if (!addr) {
+    return -1;
+  }
+
+  node = -1;
+  if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+              MPOL_F_NODE | MPOL_F_ADDR) < 0) {
+    return -1;
+  }
+
+  return node;
+}
+
+/* Sleep while *uaddr is val. The caller must recheck the condition, since
+ * wakeups can be spurious. */
+void futex_wait(uint32_t *uaddr, uint32_t val)
+{
+  syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+void futex_wake(uint32_t *uaddr)
+{
+  syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Returns the default hugetlbfs page size, or 0 if it is unknown. */
+static size_t get_hugepage_size(void)
+{
+  FILE *fp;
+  char tmp[MAX_LINE];
+  unsigned long size_kb;
+
+  if (!(fp = fopen("/proc/meminfo", "r"))) {
+    perror("fopen");
+    return 0;
+  }
+
+  size_kb = 0;
+  while (fgets(tmp, MAX_LINE, fp)) {
+    if (sscanf(tmp, "Hugepagesize: %lu kB", &size_kb) == 1) {
+      break;
+    }
+  }
+  fclose(fp);
+
+  return (size_t)size_kb * 1024;
+}
+
+/* Read the image of a mapping from its file. Reading stops at the end of the
+ * file, which may have shrunk since it was mapped; the rest of buf is left
+ * zero. */
+static int read_map_image(const struct map_info *map_info, void *buf,
+                          size_t size)
+{
+  size_t len;
+  ssize_t n;
+  int fd;
+
+  if ((fd = open(map_info->path, O_RDONLY)) < 0) {
+    perror("open");
+    return -1;
+  }
+  for (len = 0; len < size; len += (size_t)n) {
+    n = pread(fd, (char *)buf + len, size - len, map_info->offset + (off_t)len);
+    if (n < 0) {
+      perror("pread");
+      close(fd);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+  }
+  close(fd);
+
+  return 0;
+}
+
+/* Replace the file mappings of map_info with private anonymous copies, bound
+ * to the node if it is not negative. With preload, the copies are backed by
+ * hugetlbfs pages if possible (transparent huge pages otherwise) and locked
+ * so that the decoder never faults on them. */
+int load_map_images(struct map_info *map_info, int count, int node,
+                    bool preload)
+{
+  size_t hugepage_size;
+  size_t buf_size;
+  size_t map_size;
+  void *buf;
+  int i;
+
+  hugepage_size = preload ? get_hugepage_size() : 0;
+
+  for (i = 0; i < count; i++) {
+    buf_size = (size_t)ALIGN_UP(map_info[i].end - map_info[i].start, PAGE_SIZE);
+    buf = MAP_FAILED;
+
+    if (hugepage_size > 0) {
+      map_size = ALIGN_UP(buf_size, hugepage_size);
+      buf = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (buf == MAP_FAILED) {
+        fprintf(stderr,
+                "INFO: No hugetlbfs pages for %s image. Use transparent huge "
+                "pages\n",
+                map_info[i].path);
+      }
+    }
+    if (buf == MAP_FAILED) {
+      map_size = buf_size;
+      buf = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (buf == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+      }
+      if (preload && madvise(buf, map_size, MADV_HUGEPAGE) < 0) {
+        perror("madvise");
+      }
+    }
+
+    if (node >= 0 && bind_memory_node(buf, map_size, node) < 0) {
+      fprintf(stderr, "WARNING: Failed to bind %s image to node %d\n",
+              map_info[i].path, node);
+    }
+    if (read_map_image(&map_info[i], buf, buf_size) < 0) {
+      munmap(buf, map_size);
+      return -1;
+    }
+    if (preload && mlock(buf, map_size) < 0) {
+      fprintf(stderr, "WARNING: Failed to lock %s image\n", map_info[i].path);
+    }
+    mprotect(buf, map_size, PROT_READ);
+    munmap(map_info[i].buf, buf_size);
+    map_info[i].buf = buf;
+  }
+
+  return 0;
+}
+
+static void *read_elf_section(int fd, const Elf64_Shdr *shdr)
+{
+  void *buf;
+
+  buf = malloc(shdr->sh_size);
+  if (!buf) {
+    perror("malloc");
+    return NULL;
+  }
+  if (pread(fd, buf, shdr->sh_size, shdr->sh_offset) !=
+      (ssize_t)shdr->sh_size) {
+    free(buf);
+    return NULL;
+  }
+
+  return buf;
+}
+
+/* Find a defined symbol of an ELF64 file in .symtab, or in .dynsym if the
+ * file is stripped, and return the file offset of its code, which is where
+ * it is found in a mapping of the file. */
+int lookup_elf_symbol(const char *path, const char *name, off_t *offset)
+{
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr phdr;
+  Elf64_Shdr *shdrs;
+  Elf64_Shdr *symtab;
+  Elf64_Sym *syms;
+  char *strtab;
+  uint64_t value;
+  size_t nr_syms;
+  size_t j;
+  int ret;
+  int fd;
+  int i;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  ret = -1;
+  shdrs = NULL;
+  syms = NULL;
+  strtab = NULL;
+  if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+      memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+      ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr.e_shentsize != sizeof(Elf64_Shdr) || ehdr.e_shnum == 0) {
+    goto exit;
+  }
+
+  shdrs = malloc(ehdr.e_shnum * sizeof(Elf64_Shdr));
+  if (!shdrs) {
+    perror("malloc");
+    goto exit;
+  }
+  if (pread(fd, shdrs, ehdr.e_shnum * sizeof(Elf64_Shdr), ehdr.e_shoff) !=
+      (ssize_t)(ehdr.e_shnum * sizeof(Elf64_Shdr))) {
+    goto exit;
+  }
+
+  symtab = NULL;
+  for (i = 0; i < ehdr.e_shnum; i++) {
+    if (shdrs[i].sh_type == SHT_SYMTAB ||
+        (shdrs[i].sh_type == SHT_DYNSYM && !symtab)) {
+      symtab = &shdrs[i];
+    }
+  }
+  if (!symtab || symtab->sh_link >= ehdr.e_shnum ||
+      !(syms = read_elf_section(fd, symtab)) ||
+      !(strtab = read_elf_section(fd, &shdrs[symtab->sh_link]))) {
+    goto exit;
+  }
+
+  value = 0;
+  nr_syms = symtab->sh_size / sizeof(Elf64_Sym);
+  for (j = 0; j < nr_syms; j++) {
+    if (syms[j].st_shndx != SHN_UNDEF && syms[j].st_value != 0 &&
+        syms[j].st_name < shdrs[symtab->sh_link].sh_size &&
+        !strcmp(strtab + syms[j].st_name, name)) {
+      value = syms[j].st_value;
+      break;
+    }
+  }
+  if (value == 0) {
+    goto exit;
+  }
+
+  for (i = 0; i < ehdr.e_phnum; i++) {
+    if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) !=
+        sizeof(phdr)) {
+      goto exit;
+    }
+    if (phdr.p_type == PT_LOAD && value >= phdr.p_vaddr &&
+        value < phdr.p_vaddr + phdr.p_filesz) {
+      *offset = (off_t)(value - phdr.p_vaddr + phdr.p_offset);
+      ret = 0;
+      break;
+    }
+  }
+
+exit:
+  free(strtab);
+  free(syms);
+  free(shdrs);
+  close(fd);
+  return ret;
+}
+
 void read_pid_fd_path(pid_t pid, int fd, char *buf, size_t size)
 {
   char fd_path[PATH_MAX];
@@ -526,7 +1182,7 @@ static long get_pid_syscall_regs(pid_t pid, struct user_pt_regs *regs)
   }
 
   iov.iov_base = regs;
-  iov.iov_len = sizeof(regs);
+  iov.iov_len = sizeof(*regs);
   if (ptrace(PTRACE_GETREGSET, pid, (void *)NT_PRSTATUS, &iov) < 0) {
     return -1;
   }
@@ -569,13 +1225,99 @@ bool is_syscall_exit_group(pid_t pid)
   return false;
 }
 
-int get_udmabuf_info(int udmabuf_num, unsigned long *phys_addr, size_t *size)
+/* Make the calling process stop for its tracer on mmap() of a file with
+ * PROT_EXEC, and on nothing else. Called in the child before execve(). The
+ * tracer must set PTRACE_O_TRACESECCOMP before the first such mmap(), or it
+ * fails with ENOSYS. */
+int install_exec_map_filter(void)
+{
+  struct sock_filter filter[] = {
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_AARCH64, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_mmap, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+      /* prot */
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+               offsetof(struct seccomp_data, args[2])),
+      BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, PROT_EXEC, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+      /* fd, anonymous mappings pass -1 */
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+               offsetof(struct seccomp_data, args[4])),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xffffffff, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE),
+  };
+  struct sock_fprog prog = {
+      .len = sizeof(filter) / sizeof(filter[0]),
+      .filter = filter,
+  };
+
+  if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0) {
+    perror("prctl");
+    return -1;
+  }
+  if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) < 0) {
+    perror("prctl");
+    return -1;
+  }
+
+  return 0;
+}
+
+bool is_exec_map_stop(int wstatus)
+{
+  return WIFSTOPPED(wstatus) &&
+         (wstatus >> 8) == (SIGTRAP | (PTRACE_EVENT_SECCOMP << 8));
+}
+
+/* CS_TRACE_UDMABUF_ROOT prefixes the sysfs and devfs paths of u-dma-buf, so
+ * that a file-backed fake udmabuf can stand in for the real device. */
+static const char *get_udmabuf_root(void)
+{
+  const char *root;
+
+  root = getenv("CS_TRACE_UDMABUF_ROOT");
+
+  return root ? root : "";
+}
+
+static int open_udmabuf_attr(int udmabuf_num, const char *name, int flags)
 {
-  const char *udmabuf_root = "/sys/class/u-dma-buf";
+  char attr_path[PATH_MAX];
+  int fd;
+
+  memset(attr_path, '\0', sizeof(attr_path));
+  snprintf(attr_path, sizeof(attr_path), "%s%s/udmabuf%d/%s",
+           get_udmabuf_root(), UDMABUF_CLASS_ROOT, udmabuf_num, name);
+  if ((fd = open(attr_path, flags)) < 0) {
+    perror("open");
+  }
+
+  return fd;
+}
+
+static int write_udmabuf_attr(int fd, unsigned long val)
+{
+  char attr[32];
+  int len;
+
+  memset(attr, 0, sizeof(attr));
+  len = snprintf(attr, sizeof(attr), "%lu", val);
+  if (pwrite(fd, attr, (size_t)len, 0) != len) {
+    perror("pwrite");
+    return -1;
+  }
+
+  return 0;
+}
 
+int get_udmabuf_info(int udmabuf_num, unsigned long *phys_addr, size_t *size)
+{
   int ret;
   char udmabuf_path[PATH_MAX];
-  char tmp_path[PATH_MAX];
   char attr[1024];
   int fd;
   struct stat sb;
@@ -583,18 +1325,14 @@ int get_udmabuf_info(int udmabuf_num, unsigned long *phys_addr, size_t *size)
   ret = -1;
 
   memset(udmabuf_path, '\0', sizeof(udmabuf_path));
-  snprintf(udmabuf_path, sizeof(udmabuf_path), "%s/udmabuf%d", udmabuf_root,
-           udmabuf_num);
+  snprintf(udmabuf_path, sizeof(udmabuf_path), "%s%s/udmabuf%d",
+           get_udmabuf_root(), UDMABUF_CLASS_ROOT, udmabuf_num);
   if (stat(udmabuf_path, &sb) != 0 || (!S_ISDIR(sb.st_mode))) {
     fprintf(stderr, "u-dma-buf device 'udmabuf%d' not found\n", udmabuf_num);
     return ret;
   }
 
-  memset(tmp_path, '\0', sizeof(tmp_path));
-  snprintf(tmp_path, sizeof(tmp_path), "%s/udmabuf%d/phys_addr", udmabuf_root,
-           udmabuf_num);
-  if ((fd = open(tmp_path, O_RDONLY)) < 0) {
-    perror("open");
+  if ((fd = open_udmabuf_attr(udmabuf_num, "phys_addr", O_RDONLY)) < 0) {
     return -1;
   }
 
@@ -607,11 +1345,7 @@ int get_udmabuf_info(int udmabuf_num, unsigned long *phys_addr, size_t *size)
   sscanf(attr, "%lx", phys_addr);
   close(fd);
 
-  memset(tmp_path, '\0', sizeof(tmp_path));
-  snprintf(tmp_path, sizeof(tmp_path), "%s/udmabuf%d/size", udmabuf_root,
-           udmabuf_num);
-  if ((fd = open(tmp_path, O_RDONLY)) < 0) {
-    perror("open");
+  if ((fd = open_udmabuf_attr(udmabuf_num, "size", O_RDONLY)) < 0) {
     return -1;
   }
 
@@ -626,3 +1360,183 @@ int get_udmabuf_info(int udmabuf_num, unsigned long *phys_addr, size_t *size)
 
   return 0;
 }
+
+/* Map the u-dma-buf region with CPU caching enabled. The caller must sync the
+ * region for the CPU before reading what the ETR wrote into it. */
+int open_udmabuf(int udmabuf_num, struct udmabuf *udmabuf)
+{
+  char dev_path[PATH_MAX];
+  int sync_mode_fd;
+  int sync_direction_fd;
+
+  if (!udmabuf) {
+    return -1;
+  }
+
+  memset(udmabuf, 0, sizeof(struct udmabuf));
+  udmabuf->num = udmabuf_num;
+  udmabuf->fd = -1;
+  udmabuf->sync_offset_fd = -1;
+  udmabuf->sync_size_fd = -1;
+  udmabuf->sync_for_cpu_fd = -1;
+  udmabuf->sync_for_device_fd = -1;
+
+  if (get_udmabuf_info(udmabuf_num, &udmabuf->phys_addr, &udmabuf->size) <
+      0) {
+    goto err;
+  }
+
+  /* sync_mode=1: the mapping is cacheable unless O_SYNC is given to open(). */
+  if ((sync_mode_fd = open_udmabuf_attr(udmabuf_num, "sync_mode", O_WRONLY)) <
+      0) {
+    goto err;
+  }
+  if (write_udmabuf_attr(sync_mode_fd, 1) < 0) {
+    close(sync_mode_fd);
+    goto err;
+  }
+  close(sync_mode_fd);
+
+  /* The ETR is the only writer, so every sync is DMA_FROM_DEVICE. */
+  if ((sync_direction_fd =
+           open_udmabuf_attr(udmabuf_num, "sync_direction", O_WRONLY)) < 0) {
+    goto err;
+  }
+  if (write_udmabuf_attr(sync_direction_fd, 2) < 0) {
+    close(sync_direction_fd);
+    goto err;
+  }
+  close(sync_direction_fd);
+
+  if ((udmabuf->sync_offset_fd =
+           open_udmabuf_attr(udmabuf_num, "sync_offset", O_WRONLY)) < 0 ||
+      (udmabuf->sync_size_fd =
+           open_udmabuf_attr(udmabuf_num, "sync_size", O_WRONLY)) < 0 ||
+      (udmabuf->sync_for_cpu_fd =
+           open_udmabuf_attr(udmabuf_num, "sync_for_cpu", O_WRONLY)) < 0 ||
+      (udmabuf->sync_for_device_fd =
+           open_udmabuf_attr(udmabuf_num, "sync_for_device", O_WRONLY)) < 0) {
+    goto err;
+  }
+
+  memset(dev_path, '\0', sizeof(dev_path));
+  snprintf(dev_path, sizeof(dev_path), "%s%s/udmabuf%d", get_udmabuf_root(),
+           UDMABUF_DEV_ROOT, udmabuf_num);
+  if ((udmabuf->fd = open(dev_path, O_RDWR)) < 0) {
+    perror("open");
+    goto err;
+  }
+
+  udmabuf->buf = mmap(NULL, udmabuf->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      udmabuf->fd, 0);
+  if (udmabuf->buf == MAP_FAILED) {
+    perror("mmap");
+    udmabuf->buf = NULL;
+    goto err;
+  }
+
+  return 0;
+
+err:
+  close_udmabuf(udmabuf);
+  return -1;
+}
+
+void close_udmabuf(struct udmabuf *udmabuf)
+{
+  if (!udmabuf) {
+    return;
+  }
+
+  if (udmabuf->buf) {
+    munmap(udmabuf->buf, udmabuf->size);
+    udmabuf->buf = NULL;
+  }
+  if (udmabuf->fd >= 0) {
+    close(udmabuf->fd);
+    udmabuf->fd = -1;
+  }
+  if (udmabuf->sync_offset_fd >= 0) {
+    close(udmabuf->sync_offset_fd);
+    udmabuf->sync_offset_fd = -1;
+  }
+  if (udmabuf->sync_size_fd >= 0) {
+    close(udmabuf->sync_size_fd);
+    udmabuf->sync_size_fd = -1;
+  }
+  if (udmabuf->sync_for_cpu_fd >= 0) {
+    close(udmabuf->sync_for_cpu_fd);
+    udmabuf->sync_for_cpu_fd = -1;
+  }
+  if (udmabuf->sync_for_device_fd >= 0) {
+    close(udmabuf->sync_for_device_fd);
+    udmabuf->sync_for_device_fd = -1;
+  }
+}
+
+static int sync_udmabuf(struct udmabuf *udmabuf, int sync_fd, size_t offset,
+                        size_t size)
+{
+  if (!udmabuf || sync_fd < 0 || offset + size > udmabuf->size) {
+    return -1;
+  }
+
+  if (write_udmabuf_attr(udmabuf->sync_offset_fd, offset) < 0 ||
+      write_udmabuf_attr(udmabuf->sync_size_fd, size) < 0 ||
+      write_udmabuf_attr(sync_fd, 1) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int sync_udmabuf_for_cpu(struct udmabuf *udmabuf, size_t offset, size_t size)
+{
+  return sync_udmabuf(udmabuf, udmabuf ? udmabuf->sync_for_cpu_fd : -1, offset,
+                      size);
+}
+
+int sync_udmabuf_for_device(struct udmabuf *udmabuf, size_t offset,
+                            size_t size)
+{
+  return sync_udmabuf(udmabuf, udmabuf ? udmabuf->sync_for_device_fd : -1,
+                      offset, size);
+}
+
+/* Split [read_offset, write_offset) of the ring the ETR writes to into at
+ * most two slices, oldest first. wrapped is the TMC Full status, which tells
+ * that the ETR has passed the end of the region since it was last cleared.
+ * If it has also passed read_offset, the trace in between is lost and the
+ * whole region from write_offset is returned, so the first slice does not
+ * start at read_offset. Returns the number of slices. */
+int get_udmabuf_slices(const struct udmabuf *udmabuf, size_t read_offset,
+                       size_t write_offset, bool wrapped,
+                       struct udmabuf_slice slices[2])
+{
+  int count;
+
+  count = 0;
+
+  if (!wrapped) {
+    if (write_offset > read_offset) {
+      slices[count].offset = read_offset;
+      slices[count].size = write_offset - read_offset;
+      count++;
+    }
+    return count;
+  }
+
+  if (write_offset > read_offset) {
+    read_offset = write_offset;
+  }
+  slices[count].offset = read_offset;
+  slices[count].size = udmabuf->size - read_offset;
+  count++;
+  if (write_offset > 0) {
+    slices[count].offset = 0;
+    slices[count].size = write_offset;
+    count++;
+  }
+
+  return count;
+}
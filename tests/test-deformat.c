@@ -0,0 +1,327 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+/* Demultiplex random formatter frames with frame syncs in between, fed in
+ * random pieces, and check each stream against deformat_frame() run on the
+ * frames for its ID alone. The check is built once as is, which takes the
+ * NEON path on AArch64, and once with DEFORMAT_SCALAR, so both paths are held
+ * to the same reference. With -b, demux_frames() is also timed. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deformat.h"
+
+#define TEST_FRAMES 0x4000
+#define TEST_ROUNDS 8
+#define TEST_SMALL_STREAM 0x100
+#define BENCH_SIZE (64 << 20)
+#define BENCH_ROUNDS 8
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+/* IDs that frames switch to. 0x10 and 0x11 have streams, 0x20 does not. */
+static const int test_ids[] = {0x10, 0x11, 0x20, FORMATTER_ID_NULL};
+static const int stream_ids[] = {0x10, 0x11};
+
+#define NR_TEST_IDS (int)(sizeof(test_ids) / sizeof(test_ids[0]))
+#define NR_STREAM_IDS (int)(sizeof(stream_ids) / sizeof(stream_ids[0]))
+
+static int failures = 0;
+
+/* A random frame. Most frames carry data of the current ID only, so that the
+ * plain frame path is taken; the others change IDs at random places, with
+ * random aux bits deciding where the data byte after a change goes. */
+static void make_frame(unsigned char *frame)
+{
+  int changes;
+  int i;
+
+  for (i = 0; i < FORMATTER_FRAME_SIZE; i++) {
+    frame[i] = (unsigned char)rand();
+  }
+  for (i = 0; i < FORMATTER_FRAME_SIZE - 1; i += 2) {
+    frame[i] &= ~1;
+  }
+
+  changes = rand() % 4 == 0 ? 1 + rand() % 3 : 0;
+  while (changes-- > 0) {
+    i = (rand() % (FORMATTER_FRAME_SIZE / 2)) * 2;
+    frame[i] = (unsigned char)((test_ids[rand() % NR_TEST_IDS] << 1) | 1);
+  }
+}
+
+/* Frames with up to two frame syncs between some of them. Returns the
+ * size. */
+static size_t make_trace(unsigned char *buf, unsigned char *frames,
+                         size_t nr_frames, size_t *nr_fsyncs)
+{
+  static const unsigned char fsync[FORMATTER_FSYNC_SIZE] = {0xff, 0xff, 0xff,
+                                                            0x7f};
+  size_t size;
+  size_t i;
+  int n;
+
+  size = 0;
+  *nr_fsyncs = 0;
+  for (i = 0; i < nr_frames; i++) {
+    for (n = rand() % 16 == 0 ? 1 + rand() % 2 : 0; n > 0; n--) {
+      memcpy(&buf[size], fsync, sizeof(fsync));
+      size += sizeof(fsync);
+      (*nr_fsyncs)++;
+    }
+    make_frame(&frames[i * FORMATTER_FRAME_SIZE]);
+    memcpy(&buf[size], &frames[i * FORMATTER_FRAME_SIZE],
+           FORMATTER_FRAME_SIZE);
+    size += FORMATTER_FRAME_SIZE;
+  }
+
+  return size;
+}
+
+static size_t deformat_reference(int trace_id, const unsigned char *frames,
+                                 size_t nr_frames, unsigned char *out)
+{
+  struct deformatter deformatter;
+  size_t len;
+  size_t i;
+
+  init_deformatter(&deformatter);
+  len = 0;
+  for (i = 0; i < nr_frames; i++) {
+    len += deformat_frame(&deformatter, trace_id,
+                          &frames[i * FORMATTER_FRAME_SIZE], &out[len]);
+  }
+
+  return len;
+}
+
+/* Feed buf in pieces of random size, which splits frames and frame syncs
+ * across calls. */
+static void demux_pieces(struct deformat_demux *demux, const unsigned char *buf,
+                         size_t size)
+{
+  size_t offset;
+  size_t n;
+
+  for (offset = 0; offset < size; offset += n) {
+    n = rand() % 3 == 0 ? (size_t)(rand() % 40) : (size_t)(rand() % 4096);
+    if (n > size - offset) {
+      n = size - offset;
+    }
+    demux_frames(demux, &buf[offset], n);
+  }
+}
+
+static void test_demux(size_t stream_size)
+{
+  struct deformat_stream streams[NR_STREAM_IDS];
+  struct deformat_demux demux;
+  unsigned char *frames;
+  unsigned char *buf;
+  unsigned char *ref;
+  size_t nr_fsyncs;
+  size_t ref_len;
+  size_t size;
+  size_t kept;
+  int round;
+  int i;
+
+  frames = malloc(TEST_FRAMES * FORMATTER_FRAME_SIZE);
+  buf = malloc(TEST_FRAMES * (FORMATTER_FRAME_SIZE + 2 * FORMATTER_FSYNC_SIZE));
+  ref = malloc(TEST_FRAMES * FORMATTER_FRAME_SIZE);
+  for (i = 0; i < NR_STREAM_IDS; i++) {
+    streams[i].buf = malloc(stream_size);
+    streams[i].size = stream_size;
+  }
+
+  for (round = 0; round < TEST_ROUNDS; round++) {
+    size = make_trace(buf, frames, TEST_FRAMES, &nr_fsyncs);
+
+    init_deformat_demux(&demux);
+    for (i = 0; i < NR_STREAM_IDS; i++) {
+      streams[i].len = 0;
+      streams[i].dropped = 0;
+      set_deformat_stream(&demux, stream_ids[i], &streams[i]);
+    }
+    demux_pieces(&demux, buf, size);
+
+    CHECK(demux.frames == TEST_FRAMES);
+    CHECK(demux.fsyncs == nr_fsyncs);
+    CHECK(demux.partial_len == 0);
+
+    for (i = 0; i < NR_STREAM_IDS; i++) {
+      ref_len = deformat_reference(stream_ids[i], frames, TEST_FRAMES, ref);
+      kept = ref_len < stream_size ? ref_len : stream_size;
+      CHECK(streams[i].len == kept);
+      CHECK(streams[i].dropped == ref_len - kept);
+      CHECK(!memcmp(streams[i].buf, ref, kept));
+    }
+  }
+
+  for (i = 0; i < NR_STREAM_IDS; i++) {
+    free(streams[i].buf);
+  }
+  free(ref);
+  free(buf);
+  free(frames);
+}
+
+/* A frame sync that straddles calls must not be taken for frame data, and
+ * an ID change in byte 14 carries over to the next frame. */
+static void test_edges(void)
+{
+  unsigned char buf[2 * FORMATTER_FRAME_SIZE + FORMATTER_FSYNC_SIZE];
+  unsigned char out[2 * FORMATTER_FRAME_SIZE];
+  struct deformat_stream stream;
+  struct deformat_demux demux;
+  size_t i;
+
+  memset(buf, 0, sizeof(buf));
+  /* Frame 0: data of the null ID, then a switch to 0x10 in byte 14. */
+  buf[FORMATTER_FRAME_SIZE - 2] = (0x10 << 1) | 1;
+  buf[16] = 0xff;
+  buf[17] = 0xff;
+  buf[18] = 0xff;
+  buf[19] = 0x7f;
+  /* Frame 1: all data of 0x10, even bytes with their aux bits set. */
+  for (i = 0; i < FORMATTER_FRAME_SIZE - 1; i++) {
+    buf[20 + i] = (unsigned char)(i << 1);
+  }
+  buf[20 + FORMATTER_FRAME_SIZE - 1] = 0xff;
+
+  for (i = 1; i < sizeof(buf); i++) {
+    stream.buf = out;
+    stream.size = sizeof(out);
+    stream.len = 0;
+    stream.dropped = 0;
+    init_deformat_demux(&demux);
+    set_deformat_stream(&demux, 0x10, &stream);
+    demux_frames(&demux, buf, i);
+    demux_frames(&demux, &buf[i], sizeof(buf) - i);
+
+    CHECK(demux.frames == 2 && demux.fsyncs == 1);
+    CHECK(stream.len == FORMATTER_FRAME_DATA_MAX);
+    CHECK(out[0] == 1 && out[1] == 2 && out[2] == 5 && out[14] == 29);
+  }
+}
+
+static double elapsed(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)(now.tv_sec - start->tv_sec) +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Time demux_frames() over trace of one ID, as from a single ETM, and over
+ * trace that changes IDs in every fourth frame. */
+static void bench_demux(void)
+{
+  struct deformat_stream stream;
+  struct deformat_demux demux;
+  struct timespec start;
+  unsigned char *frames;
+  unsigned char *buf;
+  size_t nr_frames;
+  size_t nr_fsyncs;
+  size_t size;
+  size_t i;
+  double secs;
+  int mixed;
+  int round;
+
+  nr_frames = BENCH_SIZE / FORMATTER_FRAME_SIZE;
+  frames = malloc(BENCH_SIZE);
+  buf = malloc(BENCH_SIZE + BENCH_SIZE / 2);
+  stream.buf = malloc(BENCH_SIZE);
+  stream.size = BENCH_SIZE;
+  /* Fault the stream in before timing. */
+  memset(stream.buf, 0, BENCH_SIZE);
+
+  for (mixed = 0; mixed < 2; mixed++) {
+    size = make_trace(buf, frames, nr_frames, &nr_fsyncs);
+    if (!mixed) {
+      /* The same frames without frame syncs or ID changes. */
+      size = nr_frames * FORMATTER_FRAME_SIZE;
+      memcpy(buf, frames, size);
+      for (i = 0; i < size; i += 2) {
+        buf[i] &= ~1;
+      }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+      init_deformat_demux(&demux);
+      demux.deformatter.cur_id = 0x10;
+      stream.len = 0;
+      stream.dropped = 0;
+      set_deformat_stream(&demux, 0x10, &stream);
+      demux_frames(&demux, buf, size);
+    }
+    secs = elapsed(&start);
+
+    printf("demux_frames (%s, %s): %.1f MiB/s\n",
+#ifdef DEFORMAT_SCALAR
+           "scalar",
+#else
+           "default",
+#endif
+           mixed ? "mixed IDs" : "one ID",
+           (double)size * BENCH_ROUNDS / secs / (1 << 20));
+  }
+
+  free(stream.buf);
+  free(buf);
+  free(frames);
+}
+
+int main(int argc, char *argv[])
+{
+  bool bench;
+  int opt;
+
+  bench = false;
+  while ((opt = getopt(argc, argv, "b")) != -1) {
+    switch (opt) {
+      case 'b':
+        bench = true;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-b]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  srand(1);
+  test_edges();
+  test_demux(TEST_FRAMES * FORMATTER_FRAME_SIZE);
+  test_demux(TEST_SMALL_STREAM);
+
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("%s: OK\n", argv[0]);
+
+  if (bench) {
+    bench_demux();
+  }
+
+  return 0;
+}
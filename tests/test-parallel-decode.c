@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+/* Decode a trace container recorded from tests/fib serially and with the
+ * parallel decoder, and check that both give the same edge bitmap. The trace
+ * must be recorded uncompressed, with a short sync period so that even the
+ * short trace of fib is split, e.g. by make check-decode. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+
+#include "libcsdec.h"
+
+#include "parallel-decode.h"
+#include "trace-file.h"
+#include "utils.h"
+
+#define TEST_BITMAP_SIZE 0x10000
+#define TEST_MIN_SEGMENT 0x400
+#define TEST_OVERLAP 0x200
+
+static const int test_jobs[] = {2, 3, 4};
+
+struct test_trace {
+  struct trace_file file;
+  int map_count;
+  struct libcsdec_memory_image *mem_img;
+  struct libcsdec_memory_map *mem_map;
+};
+
+static int load_test_images(struct test_trace *trace)
+{
+  const struct trace_file_map *map;
+  size_t size;
+  void *buf;
+  int fd;
+  int i;
+
+  trace->map_count = (int)trace->file.map_count;
+  trace->mem_img = calloc(trace->map_count, sizeof(*trace->mem_img));
+  trace->mem_map = calloc(trace->map_count, sizeof(*trace->mem_map));
+  if (!trace->mem_img || !trace->mem_map) {
+    perror("calloc");
+    return -1;
+  }
+
+  for (i = 0; i < trace->map_count; i++) {
+    map = &trace->file.maps[i];
+    size = (size_t)ALIGN_UP(map->end - map->start, PAGE_SIZE);
+    if ((fd = open(map->path, O_RDONLY)) < 0) {
+      perror("open");
+      return -1;
+    }
+    buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, (off_t)map->offset);
+    close(fd);
+    if (buf == MAP_FAILED) {
+      perror("mmap");
+      return -1;
+    }
+    trace->mem_img[i].data = buf;
+    trace->mem_img[i].size = size;
+    trace->mem_map[i].start = map->start;
+    trace->mem_map[i].end = map->end;
+    strncpy(trace->mem_map[i].path, map->path,
+            sizeof(trace->mem_map[i].path) - 1);
+  }
+
+  return 0;
+}
+
+static const void *get_test_chunk(struct test_trace *trace, size_t i,
+                                  size_t *size)
+{
+  if (trace->file.index[i].flags & TRACE_CHUNK_ZSTD) {
+    fprintf(stderr, "Chunk %zu is compressed. Record without -s\n", i);
+    return NULL;
+  }
+
+  return get_trace_file_chunk(&trace->file, i, size);
+}
+
+static int decode_serial(struct test_trace *trace, unsigned char *bitmap)
+{
+  const void *buf;
+  libcsdec_t decoder;
+  size_t size;
+  size_t i;
+  int ret;
+
+  decoder = libcsdec_init_edge(bitmap, TEST_BITMAP_SIZE, trace->map_count,
+                               trace->mem_img);
+  if (!decoder ||
+      libcsdec_reset_edge(decoder, trace->file.header->trace_id,
+                          trace->map_count,
+                          trace->mem_map) != LIBCSDEC_SUCCESS) {
+    fprintf(stderr, "Failed to set up the serial decoder\n");
+    return -1;
+  }
+
+  ret = 0;
+  for (i = 0; ret == 0 && i < trace->file.chunk_count; i++) {
+    if (!(buf = get_test_chunk(trace, i, &size)) ||
+        libcsdec_run_edge(decoder, buf, size) != LIBCSDEC_SUCCESS) {
+      ret = -1;
+    }
+  }
+  libcsdec_finish_edge(decoder);
+
+  return ret;
+}
+
+static int decode_parallel(struct test_trace *trace, int jobs,
+                           unsigned char *bitmap)
+{
+  struct parallel_decoder pd;
+  const void *buf;
+  size_t size;
+  size_t i;
+  int ret;
+
+  if (init_parallel_decoder(&pd, jobs, TEST_BITMAP_SIZE, trace->map_count,
+                            trace->mem_img) < 0) {
+    fprintf(stderr, "init_parallel_decoder() failed\n");
+    return -1;
+  }
+  pd.min_segment = TEST_MIN_SEGMENT;
+  pd.overlap = TEST_OVERLAP;
+
+  ret = reset_parallel_decoder(&pd, trace->file.header->trace_id,
+                               trace->map_count, trace->mem_map);
+  for (i = 0; ret == 0 && i < trace->file.chunk_count; i++) {
+    if (!(buf = get_test_chunk(trace, i, &size)) ||
+        run_parallel_decoder(&pd, buf, size, bitmap) < 0) {
+      ret = -1;
+    }
+  }
+  fini_parallel_decoder(&pd, bitmap);
+
+  return ret;
+}
+
+static size_t count_mismatches(const unsigned char *a, const unsigned char *b)
+{
+  size_t count;
+  size_t i;
+
+  count = 0;
+  for (i = 0; i < TEST_BITMAP_SIZE; i++) {
+    if (a[i] != b[i]) {
+      if (count++ < 8) {
+        fprintf(stderr, "  bitmap[0x%zx]: serial %u, parallel %u\n", i, a[i],
+                b[i]);
+      }
+    }
+  }
+
+  return count;
+}
+
+int main(int argc, char *argv[])
+{
+  static unsigned char serial[TEST_BITMAP_SIZE];
+  static unsigned char parallel[TEST_BITMAP_SIZE];
+  struct test_trace trace;
+  size_t mismatches;
+  int failures;
+  size_t i;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s TRACE\n", argv[0]);
+    return 1;
+  }
+
+  memset(&trace, 0, sizeof(trace));
+  if (map_trace_file(&trace.file, argv[1]) < 0 ||
+      load_test_images(&trace) < 0) {
+    fprintf(stderr, "Failed to load %s\n", argv[1]);
+    return 1;
+  }
+
+  if (decode_serial(&trace, serial) < 0) {
+    fprintf(stderr, "Serial decoding failed\n");
+    return 1;
+  }
+
+  failures = 0;
+  for (i = 0; i < sizeof(test_jobs) / sizeof(test_jobs[0]); i++) {
+    memset(parallel, 0, sizeof(parallel));
+    if (decode_parallel(&trace, test_jobs[i], parallel) < 0) {
+      fprintf(stderr, "Parallel decoding on %d jobs failed\n", test_jobs[i]);
+      failures++;
+      continue;
+    }
+    if ((mismatches = count_mismatches(serial, parallel)) > 0) {
+      fprintf(stderr, "%zu counters differ on %d jobs\n", mismatches,
+              test_jobs[i]);
+      failures++;
+    }
+  }
+
+  unmap_trace_file(&trace.file);
+
+  if (failures > 0) {
+    return 1;
+  }
+  printf("test-parallel-decode: OK\n");
+
+  return 0;
+}
@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+/* Map a file-backed fake u-dma-buf through CS_TRACE_UDMABUF_ROOT, and check
+ * the slices the ETR ring is split into and the syncs written for them. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+#include "utils.h"
+
+#define FAKE_UDMABUF_SIZE 0x1000
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static int failures = 0;
+static char root[] = "/tmp/cs-trace-udmabuf-XXXXXX";
+
+static int write_file(const char *dir, const char *name, const char *data)
+{
+  char path[PATH_MAX];
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if (!(fp = fopen(path, "w"))) {
+    perror("fopen");
+    return -1;
+  }
+  fputs(data, fp);
+  fclose(fp);
+
+  return 0;
+}
+
+static long read_attr(const char *dir, const char *name)
+{
+  char path[PATH_MAX];
+  FILE *fp;
+  long val;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if (!(fp = fopen(path, "r"))) {
+    return -1;
+  }
+  if (fscanf(fp, "%ld", &val) != 1) {
+    val = -1;
+  }
+  fclose(fp);
+
+  return val;
+}
+
+static int make_fake_udmabuf(char *attr_dir, size_t size)
+{
+  static const char *const attrs[] = {
+      "sync_mode",   "sync_direction", "sync_offset",
+      "sync_size",   "sync_for_cpu",   "sync_for_device",
+  };
+  char path[PATH_MAX];
+  char val[32];
+  size_t i;
+  int fd;
+
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return -1;
+  }
+  snprintf(path, sizeof(path),
+           "mkdir -p %s/sys/class/u-dma-buf/udmabuf0 %s/dev", root, root);
+  if (system(path) != 0) {
+    return -1;
+  }
+  snprintf(attr_dir, PATH_MAX, "%s/sys/class/u-dma-buf/udmabuf0", root);
+
+  if (write_file(attr_dir, "phys_addr", "0x80000000\n") < 0) {
+    return -1;
+  }
+  snprintf(val, sizeof(val), "%zu\n", size);
+  if (write_file(attr_dir, "size", val) < 0) {
+    return -1;
+  }
+  for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+    if (write_file(attr_dir, attrs[i], "0\n") < 0) {
+      return -1;
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/dev/udmabuf0", root);
+  if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 ||
+      ftruncate(fd, (off_t)size) < 0) {
+    perror("open");
+    return -1;
+  }
+  close(fd);
+
+  setenv("CS_TRACE_UDMABUF_ROOT", root, 1);
+
+  return 0;
+}
+
+static void test_slices(struct udmabuf *udmabuf)
+{
+  struct udmabuf_slice slices[2];
+  int n;
+
+  /* Nothing written. */
+  n = get_udmabuf_slices(udmabuf, 0x100, 0x100, false, slices);
+  CHECK(n == 0);
+
+  /* Written past the read pointer. */
+  n = get_udmabuf_slices(udmabuf, 0x100, 0x300, false, slices);
+  CHECK(n == 1);
+  CHECK(slices[0].offset == 0x100 && slices[0].size == 0x200);
+
+  /* Wrapped behind the read pointer. */
+  n = get_udmabuf_slices(udmabuf, 0xc00, 0x200, true, slices);
+  CHECK(n == 2);
+  CHECK(slices[0].offset == 0xc00 && slices[0].size == 0x400);
+  CHECK(slices[1].offset == 0 && slices[1].size == 0x200);
+
+  /* Filled exactly up to the end. */
+  n = get_udmabuf_slices(udmabuf, 0, 0, true, slices);
+  CHECK(n == 1);
+  CHECK(slices[0].offset == 0 && slices[0].size == FAKE_UDMABUF_SIZE);
+
+  /* Wrapped past the read pointer: the oldest trace starts at the RWP. */
+  n = get_udmabuf_slices(udmabuf, 0x100, 0x300, true, slices);
+  CHECK(n == 2);
+  CHECK(slices[0].offset == 0x300 &&
+        slices[0].size == FAKE_UDMABUF_SIZE - 0x300);
+  CHECK(slices[1].offset == 0 && slices[1].size == 0x300);
+}
+
+static void test_sync(struct udmabuf *udmabuf, const char *attr_dir)
+{
+  CHECK(read_attr(attr_dir, "sync_mode") == 1);
+  CHECK(read_attr(attr_dir, "sync_direction") == 2);
+
+  CHECK(sync_udmabuf_for_cpu(udmabuf, 0x200, 0x400) == 0);
+  CHECK(read_attr(attr_dir, "sync_offset") == 0x200);
+  CHECK(read_attr(attr_dir, "sync_size") == 0x400);
+  CHECK(read_attr(attr_dir, "sync_for_cpu") == 1);
+
+  CHECK(sync_udmabuf_for_device(udmabuf, 0xc00, 0x400) == 0);
+  CHECK(read_attr(attr_dir, "sync_offset") == 0xc00);
+  CHECK(read_attr(attr_dir, "sync_for_device") == 1);
+
+  /* Past the end of the region. */
+  CHECK(sync_udmabuf_for_cpu(udmabuf, 0xc00, 0x800) < 0);
+}
+
+int main(void)
+{
+  char attr_dir[PATH_MAX];
+  char cmd[PATH_MAX];
+  struct udmabuf udmabuf;
+
+  if (make_fake_udmabuf(attr_dir, FAKE_UDMABUF_SIZE) < 0) {
+    fprintf(stderr, "Failed to make a fake u-dma-buf\n");
+    return 1;
+  }
+
+  if (open_udmabuf(0, &udmabuf) < 0) {
+    fprintf(stderr, "open_udmabuf() failed\n");
+    failures++;
+  } else {
+    CHECK(udmabuf.size == FAKE_UDMABUF_SIZE);
+    CHECK(udmabuf.phys_addr == 0x80000000);
+    test_slices(&udmabuf);
+    test_sync(&udmabuf, attr_dir);
+    close_udmabuf(&udmabuf);
+  }
+
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+  if (system(cmd) != 0) {
+    fprintf(stderr, "Failed to remove %s\n", root);
+  }
+
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("test-udmabuf: OK\n");
+
+  return 0;
+}